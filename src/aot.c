@@ -0,0 +1,42 @@
+#include <string.h>
+
+#include "aot.h"
+
+// Returns the recompiled program of the ROM, or NULL if it was not
+// recompiled
+const AotProgram *find_aot_program(const uint8_t *rom, size_t size) {
+	uint64_t hash = hash_rom(rom, size);
+	for (int i = 0; i < NUM_AOT_PROGRAMS; i++) {
+		const AotProgram *p = AOT_PROGRAMS[i];
+		if (p->rom_hash == hash && p->rom_size == size
+				&& memcmp(p->rom, rom, size) == 0) {
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+// Run up to the given number of instructions on the interpreter
+long aot_interpret(Chip8 *c, long cycles) {
+	long n = 0;
+	for (; n < cycles && !is_stopped(c); n++) {
+		decd_and_exec_instr(c, fetch_instr(c));
+	}
+
+	return n;
+}
+
+// Whether the compiled instructions are still in memory unchanged
+int aot_code_intact(const Chip8 *c, const AotProgram *p) {
+	for (int i = 0; i < p->num_code_ranges; i++) {
+		uint16_t start = p->code_ranges[i][0];
+		uint16_t end = p->code_ranges[i][1];
+		if (memcmp(&c->mem[start], &p->rom[start - RAM_START_ADDR],
+				end - start) != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
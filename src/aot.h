@@ -0,0 +1,45 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+#include "instructions.h"
+
+// ROMs recompiled ahead of time to C by the recompile tool. The build
+// recompiles every ROM in roms/ and links the results into libchip8_aot,
+// where they are found by the hash of their image.
+//
+// A program runs like an execution engine: run executes up to the given
+// number of instructions and stops early if the program waits for a key
+// press or faults, leaving the machine in exactly the state the interpreter
+// would. Code that was not found statically (the targets of jmp_V0_nnn and
+// code outside the ROM) is interpreted, and so is everything once a store
+// changes the compiled code.
+
+typedef struct AotProgram {
+	const char *name;
+	uint64_t rom_hash;
+	size_t rom_size;
+
+	// The compiled instructions, as ranges [start, end) of the ROM image
+	// that must be unchanged in memory for the compiled code to be used
+	const uint8_t *rom;
+	const uint16_t (*code_ranges)[2];
+	int num_code_ranges;
+
+	long (*run)(Chip8 *c, long cycles);
+} AotProgram;
+
+// Every program linked in (defined by the generated registry)
+extern const AotProgram *const AOT_PROGRAMS[];
+extern const int NUM_AOT_PROGRAMS;
+
+const AotProgram *find_aot_program(const uint8_t *rom, size_t size);
+
+// Used by the generated code
+long aot_interpret(Chip8 *c, long cycles);
+int aot_code_intact(const Chip8 *c, const AotProgram *p);
+
+#endif
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libchip8.h"
+#include "pool.h"
+
+#define DEFAULT_CLOCK_RATE 700
+#define FRAME_RATE 60
+#define MAX_LINE 4096
+
+// The held keys change to keys at the start of frame
+typedef struct KeyEvent {
+	long frame;
+	uint16_t keys;
+} KeyEvent;
+
+typedef struct Job {
+	char *rom_path;
+	long cycles;
+	char *input_path; // NULL if no key is ever pressed
+
+	// Results
+	Chip8Status status;
+	long executed;
+	double time;
+	uint64_t hash;
+	uint64_t fb[CHIP8_SCREEN_HEIGHT];
+} Job;
+
+typedef struct Batch {
+	Job *jobs;
+	long num_jobs;
+	const char *engine;
+	long rate;
+	uint64_t seed;
+
+	// One emulator per worker, reused for all the jobs the worker runs
+	Chip8Emu **emus;
+} Batch;
+
+static double now_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read an input script: one "FRAME KEYS" pair per line (KEYS is a mask, e.g.
+// 0x0020), in increasing frame order. Lines starting with # are comments.
+static Chip8Status read_input_script(const char *path, KeyEvent **events,
+	long *num_events) {
+	*events = NULL;
+	*num_events = 0;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return CHIP8_ERR_FILE;
+	}
+
+	Chip8Status status = CHIP8_OK;
+	long capacity = 0;
+	char line[MAX_LINE];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0') {
+			continue;
+		}
+
+		long frame;
+		long keys;
+		if (sscanf(p, "%ld %li", &frame, &keys) != 2 || frame < 0
+				|| keys < 0 || keys > 0xFFFF || (*num_events > 0
+				&& frame < (*events)[*num_events - 1].frame)) {
+			status = CHIP8_ERR_INVALID_ARG;
+			break;
+		}
+
+		if (*num_events == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			KeyEvent *grown = realloc(*events, capacity * sizeof(KeyEvent));
+			if (grown == NULL) {
+				status = CHIP8_ERR_NO_MEMORY;
+				break;
+			}
+			*events = grown;
+		}
+
+		(*events)[(*num_events)++] = (KeyEvent){frame, keys};
+	}
+
+	fclose(f);
+	if (status != CHIP8_OK) {
+		free(*events);
+		*events = NULL;
+		*num_events = 0;
+	}
+	return status;
+}
+
+// Run one job on the worker's emulator. The cycle budget is run as whole
+// 60 Hz frames at the batch's clock rate, so a ROM waiting for a key press
+// idles through its frames instead of running forever.
+static Chip8Status run_job(Batch *b, Job *job, Chip8Emu *emu) {
+	KeyEvent *events = NULL;
+	long num_events = 0;
+	if (job->input_path != NULL) {
+		Chip8Status status = read_input_script(job->input_path, &events,
+			&num_events);
+		if (status != CHIP8_OK) {
+			return status;
+		}
+	}
+
+	Chip8Status status = chip8_load_rom_file(emu, job->rom_path);
+	long frames = (job->cycles * FRAME_RATE + b->rate - 1) / b->rate;
+	long frame = 0;
+	long next_event = 0;
+	while (status == CHIP8_OK && frame < frames) {
+		while (next_event < num_events && events[next_event].frame <= frame) {
+			chip8_set_keys(emu, events[next_event++].keys);
+		}
+
+		// Run up to the next key change in one call
+		long until = frames;
+		if (next_event < num_events && events[next_event].frame < until) {
+			until = events[next_event].frame;
+		}
+
+		long n;
+		status = chip8_run_frames(emu, until - frame, &n);
+		job->executed += n;
+		frame = until;
+	}
+
+	free(events);
+	return status;
+}
+
+static void run_task(void *ctx, long task, int worker) {
+	Batch *b = ctx;
+	Job *job = &b->jobs[task];
+	double start = now_s();
+
+	job->executed = 0;
+	Chip8Emu **emu = &b->emus[worker];
+	if (*emu == NULL) {
+		job->status = chip8_create(emu, b->engine);
+		if (job->status == CHIP8_OK) {
+			job->status = chip8_set_clock_rate(*emu, b->rate);
+			chip8_set_seed(*emu, b->seed);
+		}
+		if (job->status != CHIP8_OK) {
+			chip8_destroy(*emu);
+			*emu = NULL;
+			return;
+		}
+	}
+
+	// Jobs that could not be started (missing ROM or input script) have no
+	// final state, the emulator still holds the one of the previous job
+	job->status = run_job(b, job, *emu);
+	if (job->status == CHIP8_OK || job->status >= CHIP8_ERR_INVALID_INSTR) {
+		job->hash = chip8_hash_state(*emu);
+		memcpy(job->fb, chip8_get_framebuffer(*emu), sizeof(job->fb));
+	}
+	job->time = now_s() - start;
+}
+
+static char *copy_string(const char *s) {
+	char *copy = malloc(strlen(s) + 1);
+	if (copy != NULL) {
+		strcpy(copy, s);
+	}
+	return copy;
+}
+
+// Read the manifest: one "ROM CYCLES [INPUT_SCRIPT]" job per line. Lines
+// starting with # are comments. Returns -1 (after printing the error) if the
+// manifest cannot be read.
+static int read_manifest(const char *path, Batch *b) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		printf("ERROR: Unable to open manifest '%s'.\n", path);
+		return -1;
+	}
+
+	long capacity = 0;
+	long line_num = 0;
+	char line[MAX_LINE];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line_num++;
+		char *rom = strtok(line, " \t\r\n");
+		if (rom == NULL || rom[0] == '#') {
+			continue;
+		}
+
+		char *cycles = strtok(NULL, " \t\r\n");
+		char *input = strtok(NULL, " \t\r\n");
+		char *end = NULL;
+		long num_cycles = cycles ? strtol(cycles, &end, 10) : 0;
+		if (cycles == NULL || *end != '\0' || num_cycles <= 0
+				|| strtok(NULL, " \t\r\n") != NULL) {
+			printf("ERROR: Invalid job on line %ld of '%s' (expected "
+				"'ROM CYCLES [INPUT_SCRIPT]').\n", line_num, path);
+			fclose(f);
+			return -1;
+		}
+
+		if (b->num_jobs == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			Job *grown = realloc(b->jobs, capacity * sizeof(Job));
+			if (grown == NULL) {
+				printf("ERROR: Out of memory.\n");
+				fclose(f);
+				return -1;
+			}
+			b->jobs = grown;
+		}
+
+		Job *job = &b->jobs[b->num_jobs++];
+		memset(job, 0, sizeof(Job));
+		job->rom_path = copy_string(rom);
+		job->cycles = num_cycles;
+		job->input_path = input ? copy_string(input) : NULL;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void print_json_string(const char *s) {
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			printf("\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			printf("\\u%04x", *s);
+		} else {
+			putchar(*s);
+		}
+	}
+	putchar('"');
+}
+
+// One JSON object per line, in manifest order. The framebuffer is given as
+// one 16-digit hex string per row (MSB is the leftmost pixel).
+static void print_result(const Job *job, long index, int print_fb) {
+	printf("{\"job\":%ld,\"rom\":", index);
+	print_json_string(job->rom_path);
+	printf(",\"status\":");
+	print_json_string(job->status == CHIP8_OK ? "ok"
+		: chip8_status_message(job->status));
+	printf(",\"cycles\":%ld,\"time\":%.6f", job->executed, job->time);
+	if (job->status != CHIP8_OK && job->status < CHIP8_ERR_INVALID_INSTR) {
+		printf("}\n");
+		return;
+	}
+
+	printf(",\"hash\":\"%016llx\"", (unsigned long long)job->hash);
+	if (print_fb) {
+		printf(",\"fb\":[");
+		for (int row = 0; row < CHIP8_SCREEN_HEIGHT; row++) {
+			printf("%s\"%016llx\"", row ? "," : "",
+				(unsigned long long)job->fb[row]);
+		}
+		printf("]");
+	}
+	printf("}\n");
+}
+
+static void usage(const char *prog) {
+	printf("Usage: %s {PATH_TO_MANIFEST} [--threads N] [--rate HZ] "
+		"[--engine NAME] [--seed N] [--no-fb]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+	// The batch runner runs every job of a manifest headlessly on a pool of
+	// worker threads (one per CPU by default) and prints the result of each
+	// job as a line of JSON. A summary is printed to stderr.
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	Batch b = {NULL, 0, NULL, DEFAULT_CLOCK_RATE, 0, NULL};
+	int num_threads = get_num_cpus();
+	int print_fb = 1;
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--no-fb") == 0) {
+			print_fb = 0;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			printf("ERROR: Missing value for option '%s'.\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		if (strcmp(argv[i], "--threads") == 0) {
+			num_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--rate") == 0) {
+			b.rate = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--engine") == 0) {
+			b.engine = argv[++i];
+		} else if (strcmp(argv[i], "--seed") == 0) {
+			b.seed = strtoull(argv[++i], NULL, 0);
+		} else {
+			printf("ERROR: Unknown option '%s'.\n", argv[i]);
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (b.rate <= 0 || num_threads <= 0) {
+		printf("ERROR: Clock rate and thread count must be positive.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Fail early on an unknown engine rather than once per job
+	Chip8Emu *probe;
+	Chip8Status status = chip8_create(&probe, b.engine);
+	if (status != CHIP8_OK) {
+		printf("ERROR: %s.\n", chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+	chip8_destroy(probe);
+
+	if (read_manifest(argv[1], &b) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	b.emus = calloc(num_threads, sizeof(Chip8Emu *));
+	if (b.emus == NULL) {
+		printf("ERROR: Out of memory.\n");
+		return EXIT_FAILURE;
+	}
+
+	double start = now_s();
+	if (run_pool(num_threads, b.num_jobs, run_task, &b) != 0) {
+		printf("ERROR: Out of memory.\n");
+		return EXIT_FAILURE;
+	}
+	double elapsed = now_s() - start;
+
+	long total_cycles = 0;
+	long failed = 0;
+	for (long i = 0; i < b.num_jobs; i++) {
+		print_result(&b.jobs[i], i, print_fb);
+		total_cycles += b.jobs[i].executed;
+		failed += b.jobs[i].status != CHIP8_OK;
+	}
+
+	fprintf(stderr, "jobs=%ld failed=%ld threads=%d cycles=%ld time=%.6fs "
+		"(%.0f instructions/s)\n", b.num_jobs, failed, num_threads,
+		total_cycles, elapsed, elapsed > 0 ? total_cycles / elapsed : 0);
+
+	for (int i = 0; i < num_threads; i++) {
+		chip8_destroy(b.emus[i]);
+	}
+	for (long i = 0; i < b.num_jobs; i++) {
+		free(b.jobs[i].rom_path);
+		free(b.jobs[i].input_path);
+	}
+	free(b.emus);
+	free(b.jobs);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,379 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "aot.h"
+#include "engine.h"
+
+#define DEFAULT_CLOCK_RATE 700
+#define DEFAULT_CYCLES 5000000
+#define DEFAULT_REPEAT 3
+#define TIMER_RATE 60
+
+// The held key moves on to the next one every KEY_FRAMES frames, so that
+// ROMs waiting for a key press get going and games see some input
+#define KEY_FRAMES 30
+#define NUM_KEYS 16
+
+// A workload stops early after this many frames in a row without running an
+// instruction (every key has been held down by then)
+#define MAX_IDLE_FRAMES (2 * NUM_KEYS * KEY_FRAMES)
+
+#define MAX_WORKLOADS 64
+
+// Value of --engine aot, after the engines of engine.h
+#define AOT_ENGINE NUM_ENGINES
+
+// Synthetic kernels, each an endless loop that stresses one kind of
+// instruction
+static const uint8_t ALU_KERNEL[] = {
+	0x60, 0x01, // 200: ld V0, 1
+	0x61, 0x03, // 202: ld V1, 3
+	0x80, 0x14, // 204: add V0, V1
+	0x81, 0x05, // 206: sub V1, V0
+	0x72, 0x07, // 208: add V2, 7
+	0x80, 0x21, // 20A: or V0, V2
+	0x81, 0x22, // 20C: and V1, V2
+	0x82, 0x13, // 20E: xor V2, V1
+	0x83, 0x06, // 210: shr V3
+	0x84, 0x2E, // 212: shl V4, V2
+	0x3F, 0x00, // 214: se VF, 0
+	0x75, 0x01, // 216: add V5, 1
+	0x12, 0x04  // 218: jp 204
+};
+
+static const uint8_t DRW_KERNEL[] = {
+	0x60, 0x00, // 200: ld V0, 0
+	0x61, 0x00, // 202: ld V1, 0
+	0x62, 0x00, // 204: ld V2, 0
+	0xF2, 0x29, // 206: ld F, V2
+	0xD0, 0x15, // 208: drw V0, V1, 5
+	0x70, 0x05, // 20A: add V0, 5
+	0x72, 0x01, // 20C: add V2, 1
+	0x42, 0x10, // 20E: sne V2, 16
+	0x62, 0x00, // 210: ld V2, 0
+	0x71, 0x07, // 212: add V1, 7
+	0x12, 0x06  // 214: jp 206
+};
+
+static const uint8_t CALL_KERNEL[] = {
+	0x22, 0x04, // 200: call 204
+	0x12, 0x00, // 202: jp 200
+	0x22, 0x0A, // 204: call 20A
+	0x22, 0x0A, // 206: call 20A
+	0x00, 0xEE, // 208: ret
+	0x22, 0x0E, // 20A: call 20E
+	0x00, 0xEE, // 20C: ret
+	0x70, 0x01, // 20E: add V0, 1
+	0x00, 0xEE  // 210: ret
+};
+
+// Rewrites the operand of the instruction at 20A on every iteration
+static const uint8_t SMC_KERNEL[] = {
+	0xA2, 0x0B, // 200: ld I, 20B
+	0x70, 0x01, // 202: add V0, 1
+	0xF0, 0x55, // 204: ld [I], V0
+	0x82, 0x14, // 206: add V2, V1
+	0x73, 0x01, // 208: add V3, 1
+	0x61, 0x00, // 20A: ld V1, (V0)
+	0x12, 0x02  // 20C: jp 202
+};
+
+typedef struct Workload {
+	char name[64];
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t size;
+} Workload;
+
+typedef struct Result {
+	long instructions;
+	long frames;
+	double time;
+	uint64_t hash;
+	Chip8Status fault;
+} Result;
+
+static double now_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_kernel(Workload *w, const char *name, const uint8_t *rom,
+		size_t size) {
+	snprintf(w->name, sizeof(w->name), "%s", name);
+	memcpy(w->rom, rom, size);
+	w->size = size;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(((const Workload *)a)->name, ((const Workload *)b)->name);
+}
+
+// Add every .ch8 file in dir, in name order. Returns the number added.
+static int add_rom_dir(Workload *w, int max, const char *dir) {
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		printf("ERROR: Unable to open ROM directory '%s'.\n", dir);
+		return 0;
+	}
+
+	int n = 0;
+	struct dirent *entry;
+	while (n < max && (entry = readdir(d)) != NULL) {
+		size_t len = strlen(entry->d_name);
+		if (len < 4 || strcmp(entry->d_name + len - 4, ".ch8") != 0
+				|| len - 4 >= sizeof(w[n].name)) {
+			continue;
+		}
+
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		Chip8Status status = read_rom_file(path, w[n].rom, &w[n].size);
+		if (status != CHIP8_OK) {
+			printf("ERROR: Unable to load ROM '%s': %s.\n", path,
+				chip8_status_message(status));
+			continue;
+		}
+		snprintf(w[n].name, sizeof(w[n].name), "%.*s", (int)(len - 4),
+			entry->d_name);
+		n++;
+	}
+	closedir(d);
+
+	qsort(w, n, sizeof(Workload), compare_names);
+	return n;
+}
+
+// Run the workload for a budget of instructions as 60 Hz frames, like the
+// frontends do: each frame runs its share of the clock rate with the key of
+// the frame held down, then ticks the timers. Frames a ROM spends waiting
+// for a key press run fewer instructions, so the frame count is kept as
+// well. Only execution is timed. With a recompiled program, it runs instead
+// of the engine.
+static Result run_workload(Engine *e, const AotProgram *aot,
+		const Workload *w, long cycles, long rate) {
+	Chip8 c;
+	init_sys(&c);
+	load_rom(&c, w->rom, w->size);
+
+	Result r = {0};
+	long owed = 0;
+	long idle_frames = 0;
+	double start = now_s();
+	while (r.instructions < cycles && idle_frames < MAX_IDLE_FRAMES) {
+		owed += rate;
+		long burst = owed / TIMER_RATE;
+		owed %= TIMER_RATE;
+		if (burst > cycles - r.instructions) {
+			burst = cycles - r.instructions;
+		}
+
+		c.keys = 1 << (r.frames / KEY_FRAMES % NUM_KEYS);
+		if (c.start_wait && c.keys) {
+			c.end_wait = 1;
+		}
+		long ran = aot ? aot->run(&c, burst) : run_engine(e, &c, burst);
+		r.instructions += ran;
+		idle_frames = ran == 0 ? idle_frames + 1 : 0;
+		r.frames++;
+		if (c.fault != CHIP8_OK) {
+			break;
+		}
+		tick_timers(&c);
+	}
+	r.time = now_s() - start;
+	r.hash = hash_state(&c);
+	r.fault = c.fault;
+	return r;
+}
+
+static void print_json_result(const char *workload, const char *engine,
+		const Result *r, double speedup, int mismatch) {
+	printf("{\"workload\":\"%s\",\"engine\":\"%s\",\"status\":\"%s\","
+		"\"instructions\":%ld,\"frames\":%ld,\"time\":%.6f,", workload,
+		engine, mismatch ? "mismatch" : r->fault == CHIP8_OK ? "ok"
+		: chip8_status_message(r->fault), r->instructions, r->frames,
+		r->time);
+	printf("\"instructions_per_s\":%.0f,\"ns_per_instruction\":%.3f,"
+		"\"frames_per_s\":%.1f,\"speedup\":%.3f,\"hash\":\"%016llx\"}\n",
+		r->time > 0 ? r->instructions / r->time : 0,
+		r->instructions > 0 ? r->time * 1e9 / r->instructions : 0,
+		r->time > 0 ? r->frames / r->time : 0, speedup,
+		(unsigned long long)r->hash);
+}
+
+static void print_result(const char *workload, const char *engine,
+		const Result *r, double speedup, int mismatch) {
+	printf("%-16s %-7s %12.0f %9.3f %12.0f %8.2fx%s\n", workload, engine,
+		r->time > 0 ? r->instructions / r->time : 0,
+		r->instructions > 0 ? r->time * 1e9 / r->instructions : 0,
+		r->time > 0 ? r->frames / r->time : 0, speedup,
+		mismatch ? "  ERROR: state differs from interp"
+		: r->fault != CHIP8_OK ? "  (faulted)" : "");
+}
+
+// Print the result of an engine and check it against the interpreter's
+static int report_result(const char *workload, const char *engine,
+		const Result *r, const Result *base, int json) {
+	int mismatch = r->hash != base->hash
+		|| r->instructions != base->instructions;
+	double speedup = r->time > 0 ? base->time / r->time : 0;
+	if (json) {
+		print_json_result(workload, engine, r, speedup, mismatch);
+	} else {
+		print_result(workload, engine, r, speedup, mismatch);
+	}
+	return mismatch;
+}
+
+static void usage(const char *prog) {
+	printf("Usage: %s [ROM_DIR] [--cycles N] [--rate HZ] [--repeat N] "
+		"[--engine NAME] [--idle-skip] [--json]\n", prog);
+	printf("Engines:");
+	for (int i = 0; i < NUM_ENGINES; i++) {
+		printf(" %s", ENGINE_NAMES[i]);
+	}
+	printf(" aot\n");
+}
+
+int main(int argc, char *argv[]) {
+	// The benchmark runs every ROM of a directory (roms/ of the source tree
+	// by default) and the synthetic kernels above on every engine for a fixed
+	// budget of instructions, and reports the best of --repeat runs. The
+	// speedup of an engine is relative to the interpreter on the same
+	// workload. Every engine must end a workload in the same state as the
+	// interpreter, so a mismatch is reported as an error. Idle loops are not
+	// skipped unless --idle-skip is given, and never on the interpreter the
+	// others are compared with. With --json, each result is printed as a line
+	// of JSON instead of a table row, to keep track of regressions over time.
+	// Workloads that were recompiled ahead of time (the ROMs of roms/, see
+	// aot.h) also get an aot row.
+
+	const char *rom_dir = BENCH_ROM_DIR;
+	long cycles = DEFAULT_CYCLES;
+	long rate = DEFAULT_CLOCK_RATE;
+	int repeat = DEFAULT_REPEAT;
+	int only_engine = -1;
+	int json = 0;
+	int skip_idle = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0) {
+			json = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--idle-skip") == 0) {
+			skip_idle = 1;
+			continue;
+		}
+		if (argv[i][0] != '-') {
+			rom_dir = argv[i];
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			printf("ERROR: Missing value for option '%s'.\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		if (strcmp(argv[i], "--cycles") == 0) {
+			cycles = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--rate") == 0) {
+			rate = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--repeat") == 0) {
+			repeat = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--engine") == 0) {
+			only_engine = strcmp(argv[++i], "aot") == 0 ? AOT_ENGINE
+				: get_engine_from_name(argv[i]);
+			if (only_engine < 0) {
+				printf("ERROR: Unknown engine '%s'.\n", argv[i]);
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else {
+			printf("ERROR: Unknown option '%s'.\n", argv[i]);
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (cycles <= 0 || rate <= 0 || repeat <= 0) {
+		printf("ERROR: Cycles, clock rate and repeat count must be "
+			"positive.\n");
+		return EXIT_FAILURE;
+	}
+
+	static Workload workloads[MAX_WORKLOADS];
+	int num_workloads = add_rom_dir(workloads, MAX_WORKLOADS - 4, rom_dir);
+	Workload *w = &workloads[num_workloads];
+	add_kernel(w++, "kernel-alu", ALU_KERNEL, sizeof(ALU_KERNEL));
+	add_kernel(w++, "kernel-drw", DRW_KERNEL, sizeof(DRW_KERNEL));
+	add_kernel(w++, "kernel-call", CALL_KERNEL, sizeof(CALL_KERNEL));
+	add_kernel(w++, "kernel-smc", SMC_KERNEL, sizeof(SMC_KERNEL));
+	num_workloads += 4;
+
+	if (!json) {
+		printf("%-16s %-7s %12s %9s %12s %9s\n", "workload", "engine",
+			"instr/s", "ns/instr", "frames/s", "speedup");
+	}
+
+	int failed = 0;
+	for (int i = 0; i < num_workloads; i++) {
+		// The interpreter always runs, it is the baseline of the speedups
+		// and of the final states
+		Result base = {0};
+		for (int kind = 0; kind < NUM_ENGINES; kind++) {
+			if (kind != ENGINE_INTERP && only_engine >= 0
+					&& kind != only_engine) {
+				continue;
+			}
+
+			Engine engine;
+			if (init_engine(&engine, kind) != 0) {
+				close_engine(&engine);
+				continue;
+			}
+			engine.skip_idle = skip_idle && kind != ENGINE_INTERP;
+
+			Result best;
+			for (int run = 0; run < repeat; run++) {
+				Result r = run_workload(&engine, NULL, &workloads[i], cycles,
+					rate);
+				if (run == 0 || r.time < best.time) {
+					best = r;
+				}
+			}
+			close_engine(&engine);
+
+			if (kind == ENGINE_INTERP) {
+				base = best;
+				if (only_engine > ENGINE_INTERP) {
+					continue;
+				}
+			}
+
+			failed |= report_result(workloads[i].name, ENGINE_NAMES[kind],
+				&best, &base, json);
+		}
+
+		const AotProgram *aot = find_aot_program(workloads[i].rom,
+			workloads[i].size);
+		if (aot == NULL || (only_engine >= 0 && only_engine != AOT_ENGINE)) {
+			continue;
+		}
+		Result best;
+		for (int run = 0; run < repeat; run++) {
+			Result r = run_workload(NULL, aot, &workloads[i], cycles, rate);
+			if (run == 0 || r.time < best.time) {
+				best = r;
+			}
+		}
+		failed |= report_result(workloads[i].name, "aot", &best, &base, json);
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,442 @@
+#include <string.h>
+
+#include "block.h"
+#include "profile.h"
+
+// Use direct-threaded dispatch (labels as values) where the compiler supports
+// it, and a switch over the op kind everywhere else
+#if defined(__GNUC__) && !defined(BLOCK_NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#endif
+
+// Ops marked 1 are exits: they leave the block because they change the control
+// flow, write memory (which may invalidate code) or may wait for a key press.
+// An exit that directly follows a skip is conditional, and the block goes on
+// after it. Skips themselves never leave the block: when taken, they jump over
+// the op that follows them.
+#define BLOCK_OPS(X) \
+	X(LD_VX_NN, 0) \
+	X(ADD_VX_NN, 0) \
+	X(LD_VX_VY, 0) \
+	X(OR, 0) \
+	X(AND, 0) \
+	X(XOR, 0) \
+	X(ADD_VX_VY, 0) \
+	X(SUB, 0) \
+	X(SHR, 0) \
+	X(SUBN, 0) \
+	X(SHL, 0) \
+	X(LD_I_NNN, 0) \
+	X(LD_VX_DT, 0) \
+	X(LD_DT_VX, 0) \
+	X(LD_ST_VX, 0) \
+	X(ADD_I_VX, 0) \
+	X(LD_I_F, 0) \
+	X(LD_V_FROM_MEM, 0) \
+	X(HANDLER, 0) \
+	X(JMP_THROUGH, 0) \
+	X(SE_VX_NN, 0) \
+	X(SNE_VX_NN, 0) \
+	X(SE_VX_VY, 0) \
+	X(SNE_VX_VY, 0) \
+	X(SKP, 0) \
+	X(SKPN, 0) \
+	X(JMP, 1) \
+	X(EXIT_HANDLER, 1) \
+	X(EXIT, 1)
+
+#define OP_ENUM(k, exit) OP_##k,
+#define OP_TERM(k, exit) exit,
+#define OP_LABEL(k, exit) &&L_##k,
+
+enum { BLOCK_OPS(OP_ENUM) NUM_OPS };
+
+static const uint8_t IS_EXIT[NUM_OPS] = { BLOCK_OPS(OP_TERM) };
+
+// Map a decoded instruction to the op that executes it
+static uint8_t get_op_kind(const Instr *in) {
+	InstrHandler h = in->exec;
+
+	if (h == ld_Vx_nn) return OP_LD_VX_NN;
+	if (h == add_Vx_nn) return OP_ADD_VX_NN;
+	if (h == ld_Vx_Vy) return OP_LD_VX_VY;
+	if (h == bor) return OP_OR;
+	if (h == band) return OP_AND;
+	if (h == bxor) return OP_XOR;
+	if (h == add_Vx_Vy) return OP_ADD_VX_VY;
+	if (h == sub) return OP_SUB;
+	if (h == shr) return OP_SHR;
+	if (h == subn) return OP_SUBN;
+	if (h == shl) return OP_SHL;
+	if (h == ld_I_nnn) return OP_LD_I_NNN;
+	if (h == ld_Vx_DT) return OP_LD_VX_DT;
+	if (h == ld_DT_Vx) return OP_LD_DT_VX;
+	if (h == ld_ST_Vx) return OP_LD_ST_VX;
+	if (h == add_I_Vx) return OP_ADD_I_VX;
+	if (h == ld_I_f) return OP_LD_I_F;
+	if (h == ld_V_from_mem) return OP_LD_V_FROM_MEM;
+	if (h == cls || h == drw || h == rnd) return OP_HANDLER;
+	if (h == jmp_nnn) return OP_JMP;
+	if (h == se_Vx_nn) return OP_SE_VX_NN;
+	if (h == sne_Vx_nn) return OP_SNE_VX_NN;
+	if (h == se_Vx_Vy) return OP_SE_VX_VY;
+	if (h == sne_Vx_Vy) return OP_SNE_VX_VY;
+	if (h == skp) return OP_SKP;
+	if (h == skpn) return OP_SKPN;
+
+	// call, ret, jmp_V0_nnn, ld_Vx_k, stores and invalid instructions
+	return OP_EXIT_HANDLER;
+}
+
+// Drop every block, keeping the modification counts
+static void clear_block_cache(BlockCache *bc) {
+	memset(bc->map, 0, sizeof(bc->map));
+	memset(bc->page_blocks, 0, sizeof(bc->page_blocks));
+	bc->num_blocks = 0;
+	bc->pool_used = 0;
+	bc->num_links = 0;
+}
+
+void init_block_cache(BlockCache *bc) {
+	run_block_cache(bc, NULL, 0);
+
+	memset(bc->smc_count, 0, sizeof(bc->smc_count));
+	clear_block_cache(bc);
+}
+
+// Whether the instructions of a block are still the ones in memory
+static int is_block_current(const Block *b, const Chip8 *c) {
+	for (int i = 0; i < b->len; i++) {
+		uint16_t pc = b->ops[i].next_pc - 2;
+		if (((c->mem[pc] << 8) | c->mem[pc + 1]) != b->ops[i].in.raw) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Called when pages have been written: drop the blocks on those pages whose
+// code actually changed (stores to data that shares a page with code are
+// common and harmless). Only RAM can hold translated code, so stores to the
+// stack are ignored, and a write to every page means a new program was
+// loaded.
+void flush_block_cache(BlockCache *bc, const Chip8 *c, uint16_t pages) {
+	pages &= RAM_PAGES;
+	if (pages == 0) {
+		return;
+	}
+
+	if (pages == RAM_PAGES) {
+		init_block_cache(bc);
+		return;
+	}
+
+	uint16_t modified = 0;
+	for (int p = 0; p < NUM_PAGES; p++) {
+		if (!(pages & (1 << p))) {
+			continue;
+		}
+
+		// Blocks that were dropped or replaced are unlinked on the way
+		BlockLink **link = &bc->page_blocks[p];
+		while (*link != NULL) {
+			Block *b = (*link)->block;
+			Block **entry = &bc->map[b->start - RAM_START_ADDR];
+			if (*entry == b && is_block_current(b, c)) {
+				link = &(*link)->next;
+				continue;
+			}
+			if (*entry == b) {
+				*entry = NULL;
+				modified |= b->pages & pages;
+			}
+			*link = (*link)->next;
+		}
+	}
+
+	for (int p = 0; p < NUM_PAGES; p++) {
+		if ((modified & (1 << p)) && bc->smc_count[p] < 255) {
+			bc->smc_count[p]++;
+		}
+	}
+}
+
+static int is_skip(uint8_t kind) {
+	return kind >= OP_SE_VX_NN && kind <= OP_SKPN;
+}
+
+// Decode the straight-line run of instructions starting at pc into a new
+// block. Unconditional jumps are followed, so a loop closed by a jump becomes
+// a single block.
+static Block *translate_block(BlockCache *bc, Chip8 *c, uint16_t pc) {
+	if (bc->num_blocks == MAX_BLOCKS
+			|| bc->pool_used + MAX_BLOCK_LEN + 1 > BLOCK_POOL_SIZE
+			|| bc->num_links + NUM_PAGES > MAX_BLOCK_LINKS) {
+		clear_block_cache(bc);
+	}
+
+	Block *b = &bc->blocks[bc->num_blocks++];
+	b->ops = &bc->pool[bc->pool_used];
+	b->start = pc;
+	b->pages = 0;
+	b->len = 0;
+
+	// The op following a skip is always part of the block, and so is the op
+	// after that (possibly the final EXIT), since a taken skip jumps over one op
+	int after_skip = 0;
+	int ended = 0;
+	while (!ended && (after_skip || b->len < MAX_BLOCK_LEN)
+			&& pc < RAM_END_ADDR) {
+		BlockOp *op = &b->ops[b->len];
+		decd_instr((c->mem[pc] << 8) | c->mem[pc + 1], &op->in);
+		op->kind = get_op_kind(&op->in);
+		op->next_pc = pc + 2;
+
+		// No room left for the op the skip may jump over: end the block
+		// before the skip, or if it must be included (because it follows
+		// another skip), let its handler run as a conditional exit
+		if (is_skip(op->kind)
+				&& (b->len + 2 > MAX_BLOCK_LEN || pc + 2 >= RAM_END_ADDR)) {
+			if (!after_skip) {
+				break;
+			}
+			op->kind = OP_EXIT_HANDLER;
+		}
+
+		b->len++;
+		b->pages |= (1 << (pc >> PAGE_SHIFT)) | (1 << ((pc + 1) >> PAGE_SHIFT));
+
+		if (op->kind == OP_JMP && !after_skip && b->len < MAX_BLOCK_LEN
+				&& op->in.nnn >= RAM_START_ADDR) {
+			op->kind = OP_JMP_THROUGH;
+			pc = op->in.nnn;
+		} else {
+			ended = IS_EXIT[op->kind] && !after_skip;
+			pc += 2;
+		}
+
+		after_skip = is_skip(op->kind);
+	}
+
+	if (!ended) {
+		BlockOp *op = &b->ops[b->len];
+		op->kind = OP_EXIT;
+		op->next_pc = pc;
+	}
+
+	for (int i = 0; i <= b->len - ended; i++) {
+		b->ops[i].target = bc->targets ? bc->targets[b->ops[i].kind] : NULL;
+		b->ops[i].rest = b->len - 1 - i;
+	}
+
+	bc->pool_used += b->len + !ended;
+	bc->map[b->start - RAM_START_ADDR] = b;
+
+	for (int p = 0; p < NUM_PAGES; p++) {
+		if (b->pages & (1 << p)) {
+			BlockLink *link = &bc->links[bc->num_links++];
+			link->block = b;
+			link->next = bc->page_blocks[p];
+			bc->page_blocks[p] = link;
+		}
+	}
+
+	return b;
+}
+
+// Execute up to the given number of instructions a block at a time. Stops
+// early when the program starts waiting for a key press or faults. Returns the
+// number of instructions executed.
+//
+// Control goes straight from the exit op of one block to the lookup of
+// the next one, so tight loops made of short blocks never leave this function.
+// Called with a NULL machine, it only stores the op targets in the cache.
+long run_block_cache(BlockCache *bc, Chip8 *c, long cycles) {
+#ifdef USE_COMPUTED_GOTO
+	static const void *const targets[NUM_OPS] = { BLOCK_OPS(OP_LABEL) };
+	if (c == NULL) {
+		bc->targets = targets;
+		return 0;
+	}
+
+#define OP(k) L_##k:
+#define NEXT() do { op++; goto *op->target; } while (0)
+#define JUMP_OVER() do { op += 2; goto *op->target; } while (0)
+#define DISPATCH() goto *op->target;
+#else
+	if (c == NULL) {
+		bc->targets = NULL;
+		return 0;
+	}
+
+#define OP(k) case OP_##k:
+#define NEXT() do { op++; goto dispatch; } while (0)
+#define JUMP_OVER() do { op += 2; goto dispatch; } while (0)
+#define DISPATCH() dispatch: switch (op->kind)
+#endif
+
+	uint8_t *V = c->V;
+	const BlockOp *op;
+	long n = 0;
+
+#define SKIP_IF(cond) \
+	do { \
+		if (cond) { \
+			n--; \
+			JUMP_OVER(); \
+		} \
+		NEXT(); \
+	} while (0)
+
+next_block:
+	if (n >= cycles || is_stopped(c)) {
+		return n;
+	}
+
+	// Blocks are only started where the first instruction and the one after
+	// it are in RAM, the last bytes of memory are single-stepped, and so is
+	// code that keeps being rewritten
+	uint16_t pc = c->PC;
+	if (pc < RAM_START_ADDR || pc >= RAM_END_ADDR - 2
+			|| bc->smc_count[pc >> PAGE_SHIFT] >= BLOCK_SMC_LIMIT) {
+		decd_and_exec_instr(c, fetch_instr(c));
+		n++;
+		goto next_block;
+	}
+
+	// Every store leaves its block, so this catches self-modifying code before
+	// the modified instructions can run
+	if (c->dirty_pages) {
+		flush_block_cache(bc, c, c->dirty_pages);
+		c->dirty_pages = 0;
+	}
+
+	Block *b = bc->map[pc - RAM_START_ADDR];
+	if (b == NULL) {
+		b = translate_block(bc, c, pc);
+	}
+
+	// Not enough cycles left for the whole block: single-step the rest.
+	// Stores made meanwhile leave their pages dirty for the next call.
+	if (b->len > cycles - n) {
+		for (; n < cycles && !is_stopped(c); n++) {
+			decd_and_exec_instr(c, fetch_instr(c));
+		}
+		return n;
+	}
+
+	// Count the whole block up front. Exits subtract the ops they leave
+	// behind and taken skips the op they jump over.
+	n += b->len;
+	op = b->ops;
+
+	DISPATCH()
+	{
+	OP(LD_VX_NN)
+		V[op->in.x] = op->in.nn;
+		NEXT();
+	OP(ADD_VX_NN)
+		V[op->in.x] += op->in.nn;
+		NEXT();
+	OP(LD_VX_VY)
+		V[op->in.x] = V[op->in.y];
+		NEXT();
+	OP(OR)
+		V[op->in.x] |= V[op->in.y];
+		NEXT();
+	OP(AND)
+		V[op->in.x] &= V[op->in.y];
+		NEXT();
+	OP(XOR)
+		V[op->in.x] ^= V[op->in.y];
+		NEXT();
+	OP(ADD_VX_VY) {
+		uint16_t res = V[op->in.x] + V[op->in.y];
+		V[op->in.x] = res;
+		V[0xF] = res > 255;
+		NEXT();
+	}
+	OP(SUB) {
+		uint8_t flag = V[op->in.x] > V[op->in.y];
+		V[op->in.x] -= V[op->in.y];
+		V[0xF] = flag;
+		NEXT();
+	}
+	OP(SHR)
+		V[op->in.x] >>= 1;
+		NEXT();
+	OP(SUBN) {
+		uint8_t flag = V[op->in.y] > V[op->in.x];
+		V[op->in.x] = V[op->in.y] - V[op->in.x];
+		V[0xF] = flag;
+		NEXT();
+	}
+	OP(SHL)
+		V[op->in.x] <<= 1;
+		NEXT();
+	OP(LD_I_NNN)
+		c->I = op->in.nnn;
+		NEXT();
+	OP(LD_VX_DT)
+		V[op->in.x] = c->DT;
+		NEXT();
+	OP(LD_DT_VX)
+		c->DT = V[op->in.x];
+		NEXT();
+	OP(LD_ST_VX)
+		c->ST = V[op->in.x];
+		NEXT();
+	OP(ADD_I_VX)
+		c->I += V[op->in.x];
+		NEXT();
+	OP(LD_I_F)
+		c->I = FONTSET_START_ADDR + 5 * V[op->in.x];
+		NEXT();
+	OP(LD_V_FROM_MEM)
+		for (int i = 0; i <= op->in.x; i++) {
+			V[i] = read_mem(c, c->I + i);
+		}
+		NEXT();
+	OP(HANDLER)
+		c->PC = op->next_pc;
+		PROFILE_EXEC(c, &op->in);
+		NEXT();
+	OP(JMP_THROUGH)
+		// The block continues at the jump target
+		NEXT();
+	OP(SE_VX_NN)
+		SKIP_IF(V[op->in.x] == op->in.nn);
+	OP(SNE_VX_NN)
+		SKIP_IF(V[op->in.x] != op->in.nn);
+	OP(SE_VX_VY)
+		SKIP_IF(V[op->in.x] == V[op->in.y]);
+	OP(SNE_VX_VY)
+		SKIP_IF(V[op->in.x] != V[op->in.y]);
+	OP(SKP)
+		SKIP_IF(is_key_down(c, V[op->in.x]));
+	OP(SKPN)
+		SKIP_IF(!is_key_down(c, V[op->in.x]));
+	OP(JMP)
+		c->PC = op->in.nnn;
+		n -= op->rest;
+		goto next_block;
+	OP(EXIT_HANDLER)
+		c->PC = op->next_pc;
+		PROFILE_EXEC(c, &op->in);
+		n -= op->rest;
+		goto next_block;
+	OP(EXIT)
+		// Not an instruction: continue at the address following the block
+		c->PC = op->next_pc;
+		goto next_block;
+	}
+
+	// Not reached, every op either continues the block or leaves it
+	return n;
+
+#undef OP
+#undef NEXT
+#undef JUMP_OVER
+#undef DISPATCH
+#undef SKIP_IF
+}
@@ -0,0 +1,79 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+#include "instructions.h"
+#include "icache.h"
+
+// Maximum number of instructions in a block. Longer straight-line runs are
+// split into several blocks.
+#define MAX_BLOCK_LEN 32
+
+// When any pool runs out, the whole cache is flushed and refilled
+#define MAX_BLOCKS 2048
+#define BLOCK_POOL_SIZE (MAX_BLOCKS * 8)
+#define MAX_BLOCK_LINKS (MAX_BLOCKS * 4)
+
+// A page whose code has been modified this many times is no longer
+// translated, its instructions are left to the interpreter
+#define BLOCK_SMC_LIMIT 4
+
+typedef struct BlockOp BlockOp;
+typedef struct Block Block;
+typedef struct BlockLink BlockLink;
+typedef struct BlockCache BlockCache;
+
+// One translated instruction. target is the address of the code that
+// executes it (direct-threaded dispatch), kind is used where computed goto is
+// not available. Instructions that are not implemented inline call the
+// regular handler through in.exec.
+struct BlockOp {
+	const void *target;
+	Instr in;
+	uint16_t next_pc;
+	uint8_t kind;
+	uint8_t rest; // Number of instructions after this one in the block
+};
+
+// A straight-line sequence of instructions starting at start. Unconditional
+// jumps are followed and skips stay inside the block; only the last
+// instruction, or one directly after a skip, can leave the block.
+struct Block {
+	BlockOp *ops;
+	uint16_t start;
+	uint16_t pages; // Pages that hold the instructions of the block
+	uint16_t len;
+};
+
+// Entry in the list of the blocks that hold code from a page. A block is
+// linked into the list of each of its pages.
+struct BlockLink {
+	Block *block;
+	BlockLink *next;
+};
+
+struct BlockCache {
+	// Addresses of the op implementations inside run_block_cache
+	const void *const *targets;
+
+	Block *map[ICACHE_SIZE];
+	Block blocks[MAX_BLOCKS];
+	BlockOp pool[BLOCK_POOL_SIZE];
+	int num_blocks;
+	int pool_used;
+
+	// So that a store only has to check the blocks on the pages it wrote
+	BlockLink *page_blocks[NUM_PAGES];
+	BlockLink links[MAX_BLOCK_LINKS];
+	int num_links;
+
+	uint8_t smc_count[NUM_PAGES];
+};
+
+void init_block_cache(BlockCache *bc);
+void flush_block_cache(BlockCache *bc, const Chip8 *c, uint16_t pages);
+long run_block_cache(BlockCache *bc, Chip8 *c, long cycles);
+
+#endif
@@ -1,9 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 
 #include "chip8.h"
 #include "instructions.h"
+#include "profile.h"
 
 // Initialize/reset the emulator state
 void init_sys(Chip8 *c) {
@@ -21,246 +22,314 @@ void init_sys(Chip8 *c) {
 		c->mem[i] = 0;
 	}
 
+	for (int i = 0; i < SCREEN_HEIGHT; i++) {
+		c->fb[i] = 0;
+	}
+
 	// Load font into memory
 	for (int i = 0; i < FONTSET_SIZE; i++) {
 		c->mem[i + FONTSET_START_ADDR] = FONTSET[i];
 	}
 
-	srand(time(NULL));
-
 	c->is_running = 1;
-	c->key_down = -1;
+	c->keys = 0;
 	c->start_wait = 0;
 	c->end_wait = 0;
 	c->update_screen = 0;
+	c->fault = CHIP8_OK;
+	seed_rng(c, DEFAULT_SEED);
+	c->dirty_pages = ALL_PAGES;
+	c->dirty_rows = ALL_ROWS;
+	c->snap_pages = ALL_PAGES;
+	c->snap_base = 0;
+}
+
+// Copy a ROM into RAM (0x200-0xFFF)
+Chip8Status load_rom(Chip8 *c, const uint8_t *rom, size_t size) {
+	if (size == 0) {
+		return CHIP8_ERR_ROM_EMPTY;
+	}
+
+	if (size > MAX_ROM_SIZE) {
+		return CHIP8_ERR_ROM_TOO_LARGE;
+	}
+
+	memcpy(&c->mem[RAM_START_ADDR], rom, size);
+	c->dirty_pages = ALL_PAGES;
+	c->snap_pages = ALL_PAGES;
+	return CHIP8_OK;
 }
 
-void load_rom(Chip8 *c, char *file_path) {
+// Read a ROM file into rom, which must have room for MAX_ROM_SIZE bytes
+Chip8Status read_rom_file(const char *file_path, uint8_t *rom, size_t *size) {
 	FILE *f = fopen(file_path, "rb");
 	if (f == NULL) {
-		printf("ERROR: Unable to open file with path '%s'.\n", file_path);
-		exit(EXIT_FAILURE);
+		return CHIP8_ERR_FILE;
 	}
 
-	size_t bytes_read = fread(&c->mem[RAM_START_ADDR], 1, 
-		MEM_SIZE - RAM_START_ADDR, f);
-	if (bytes_read == 0) {
-		printf("ERROR:Unable to read file.\n");
-		exit(EXIT_FAILURE);
-	}
+	*size = fread(rom, 1, MAX_ROM_SIZE, f);
+	int failed = ferror(f);
 
+	// Anything left after MAX_ROM_SIZE bytes does not fit into RAM
+	int too_large = !failed && fgetc(f) != EOF;
 	fclose(f);
+
+	if (failed) {
+		return CHIP8_ERR_FILE;
+	}
+
+	if (too_large) {
+		return CHIP8_ERR_ROM_TOO_LARGE;
+	}
+
+	return *size == 0 ? CHIP8_ERR_ROM_EMPTY : CHIP8_OK;
+}
+
+Chip8Status load_rom_file(Chip8 *c, const char *file_path) {
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t size;
+	Chip8Status status = read_rom_file(file_path, rom, &size);
+	if (status != CHIP8_OK) {
+		return status;
+	}
+
+	return load_rom(c, rom, size);
+}
+
+// Seed the generator of rnd. The seed is scrambled (with splitmix64) so that
+// nearby seeds, such as the indices of a batch of machines, give unrelated
+// sequences.
+void seed_rng(Chip8 *c, uint64_t seed) {
+	uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	z ^= z >> 31;
+	c->rng = z ? z : 1;
+}
+
+// Decrement the delay and sound timers (called at 60 Hz)
+void tick_timers(Chip8 *c) {
+	if (c->DT > 0) {
+		c->DT--;
+	}
+
+	if (c->ST > 0) {
+		c->ST--;
+	}
+}
+
+// Returns 1 if both machines are in the same state. Bookkeeping that depends
+// on the execution engine, the frontend or snapshots (dirty_pages, dirty_rows,
+// snap_pages, snap_base) is not compared.
+int same_state(const Chip8 *a, const Chip8 *b) {
+	return memcmp(a->V, b->V, sizeof(a->V)) == 0
+		&& a->DT == b->DT
+		&& a->ST == b->ST
+		&& a->PC == b->PC
+		&& a->I == b->I
+		&& a->SP == b->SP
+		&& memcmp(a->mem, b->mem, sizeof(a->mem)) == 0
+		&& memcmp(a->fb, b->fb, sizeof(a->fb)) == 0
+		&& a->is_running == b->is_running
+		&& a->keys == b->keys
+		&& a->start_wait == b->start_wait
+		&& a->end_wait == b->end_wait
+		&& a->update_screen == b->update_screen
+		&& a->fault == b->fault
+		&& a->rng == b->rng;
+}
+
+#define FNV_OFFSET 0xCBF29CE484222325ull
+#define FNV_PRIME 0x100000001B3ull
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t size) {
+	const uint8_t *p = data;
+	for (size_t i = 0; i < size; i++) {
+		h = (h ^ p[i]) * FNV_PRIME;
+	}
+	return h;
+}
+
+// Hash of a ROM image, to tell which ROM a recording was made with
+uint64_t hash_rom(const uint8_t *rom, size_t size) {
+	return fnv1a(FNV_OFFSET, rom, size);
+}
+
+// Hash of the registers, timers, memory and display, used to compare runs
+// without keeping whole machines around. Multi-byte values are hashed MSB
+// first, so the hash does not depend on the host.
+uint64_t hash_state(const Chip8 *c) {
+	uint8_t regs[] = {
+		c->PC >> 8, c->PC & 0xFF, c->I >> 8, c->I & 0xFF,
+		c->SP >> 8, c->SP & 0xFF, c->DT, c->ST
+	};
+
+	uint64_t h = FNV_OFFSET;
+	h = fnv1a(h, c->V, sizeof(c->V));
+	h = fnv1a(h, regs, sizeof(regs));
+	h = fnv1a(h, c->mem, sizeof(c->mem));
+	for (int row = 0; row < SCREEN_HEIGHT; row++) {
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			uint8_t byte = c->fb[row] >> shift;
+			h = fnv1a(h, &byte, 1);
+		}
+	}
+	return h;
 }
 
 uint16_t fetch_instr(Chip8 *c) {
 	// Combine byte at PC and PC + 1 (MSB first) to form 16-bit instruction
-	return (c->mem[c->PC] << 8) | c->mem[c->PC + 1];
+	// (addresses wrap around so that a stray PC never reads outside of mem)
+	uint16_t pc = c->PC & (MEM_SIZE - 1);
+	return (c->mem[pc] << 8) | c->mem[(pc + 1) & (MEM_SIZE - 1)];
 }
 
-void decd_and_exec_instr(Chip8 *c, uint16_t instr) {
+// Decode a raw instruction into its handler and operands. Opcodes that do not
+// map to an instruction decode to the invalid handler, so that decoding data
+// (e.g. when filling a cache) never fails; the error is raised on execution.
+void decd_instr(uint16_t instr, Instr *in) {
 	uint16_t opcode = instr & OPCODE_MASK;
 	uint8_t n = get_n(instr);
 	uint8_t nn = get_nn(instr);
-	c->PC += 2;
+
+	in->raw = instr;
+	in->x = get_x(instr);
+	in->y = get_y(instr);
+	in->n = n;
+	in->nn = nn;
+	in->nnn = get_nnn(instr);
+	in->exec = invalid;
 
 	switch(opcode) {
 		case 0x0000:
 			switch(nn) {
 				case 0xE0:
-					cls(c);
+					in->exec = cls;
 					break;
 				case 0xEE:
-					ret(c);
+					in->exec = ret;
 					break;
-				default:
-					printf("ERROR: Invalid instruction 0x%04x.\n", instr);
-					exit(EXIT_FAILURE);
 			}
 			break;
 		case 0x1000:
-			jmp_nnn(c, instr);
+			in->exec = jmp_nnn;
 			break;
 		case 0x2000:
-			call_nnn(c, instr);
+			in->exec = call_nnn;
 			break;
 		case 0x3000:
-			se_Vx_nn(c, instr);
+			in->exec = se_Vx_nn;
 			break;
 		case 0x4000:
-			sne_Vx_nn(c, instr);
+			in->exec = sne_Vx_nn;
 			break;
 		case 0x5000:
-			se_Vx_Vy(c, instr);
+			in->exec = se_Vx_Vy;
 			break;
 		case 0x6000:
-			ld_Vx_nn(c, instr);
+			in->exec = ld_Vx_nn;
 			break;
 		case 0x7000:
-			add_Vx_nn(c, instr);
+			in->exec = add_Vx_nn;
 			break;
 		case 0x8000:
 			switch(n) {
 				case 0x0:
-					ld_Vx_Vy(c, instr);
+					in->exec = ld_Vx_Vy;
 					break;
 				case 0x1:
-					bor(c, instr);
+					in->exec = bor;
 					break;
 				case 0x2:
-					band(c, instr);
+					in->exec = band;
 					break;
 				case 0x3:
-					bxor(c, instr);
+					in->exec = bxor;
 					break;
 				case 0x4:
-					add_Vx_Vy(c, instr);
+					in->exec = add_Vx_Vy;
 					break;
 				case 0x5:
-					sub(c, instr);
+					in->exec = sub;
 					break;
 				case 0x6:
-					shr(c, instr);
+					in->exec = shr;
 					break;
 				case 0x7:
-					subn(c, instr);
+					in->exec = subn;
 					break;
 				case 0xE:
-					shl(c, instr);
+					in->exec = shl;
 					break;
-				default:
-					printf("ERROR: Invalid instruction 0x%04x.\n", instr);
-					exit(EXIT_FAILURE);
 			}
 			break;
 		case 0x9000:
-			sne_Vx_Vy(c, instr);
+			in->exec = sne_Vx_Vy;
 			break;
 		case 0xA000:
-			ld_I_nnn(c, instr);
+			in->exec = ld_I_nnn;
 			break;
 		case 0xB000:
-			jmp_V0_nnn(c, instr);
+			in->exec = jmp_V0_nnn;
 			break;
 		case 0xC000:
-			rnd(c, instr);
+			in->exec = rnd;
 			break;
 		case 0xD000:
-			drw(c, instr);
+			in->exec = drw;
 			break;
 		case 0xE000:
 			switch(nn) {
 				case 0x9E:
-					skp(c, instr);
+					in->exec = skp;
 					break;
 				case 0xA1:
-					skpn(c, instr);
+					in->exec = skpn;
 					break;
-				default:
-					printf("ERROR: Invalid instruction 0x%04x.\n", instr);
-					exit(EXIT_FAILURE);
 			}
 			break;
 		case 0xF000:
 			switch(nn) {
 				case 0x07:
-					ld_Vx_DT(c, instr);
+					in->exec = ld_Vx_DT;
 					break;
 				case 0x0A:
-					ld_Vx_k(c, instr);
+					in->exec = ld_Vx_k;
 					break;
 				case 0x15:
-					ld_DT_Vx(c, instr);
+					in->exec = ld_DT_Vx;
 					break;
 				case 0x18:
-					ld_ST_Vx(c, instr);
+					in->exec = ld_ST_Vx;
 					break;
 				case 0x1E:
-					add_I_Vx(c, instr);
+					in->exec = add_I_Vx;
 					break;
 				case 0x29:
-					ld_I_f(c, instr);
+					in->exec = ld_I_f;
 					break;
 				case 0x33:
-					ld_I_b(c, instr);
+					in->exec = ld_I_b;
 					break;
 				case 0x55:
-					ld_I_from_reg(c, instr);
+					in->exec = ld_I_from_reg;
 					break;
 				case 0x65:
-					ld_V_from_mem(c, instr);
+					in->exec = ld_V_from_mem;
 					break;
-				default:
-					printf("ERROR: Invalid instruction 0x%04x.\n", instr);
-					exit(EXIT_FAILURE);
 			}
 			break;
 	}
+
+#ifdef CHIP8_PROFILE
+	in->op = get_profile_op(in->exec);
+#endif
 }
 
+void decd_and_exec_instr(Chip8 *c, uint16_t instr) {
+	Instr in;
+	decd_instr(instr, &in);
+	c->PC += 2;
+	PROFILE_EXEC(c, &in);
+}
 
-/*
-
---- CONTROLLER LAYOUT ---
-1  2  3  C
-4  5  6  D
-7  8  9  E
-A  0  B  F
-
---- MAPPING (QWERTY) ----
-1 --> 1
-2 --> 2
-3 --> 3
-4 --> C
-Q --> 4
-W --> 5
-E --> 6
-R --> D
-A --> 7
-S --> 8
-D --> 9
-F --> E
-Z --> A
-X --> 0
-C --> B
-V --> F
-
-*/
-
-int get_key_from_scancode(int sc) {
-	switch(sc) {
-		case 30:
-			return 0x1;
-		case 31:
-			return 0x2;
-		case 32:
-			return 0x3;
-		case 33:
-			return 0xC;
-		case 20:
-			return 0x4;
-		case 26:
-			return 0x5;
-		case 8:
-			return 0x6;
-		case 21:
-			return 0xD;
-		case 4:
-			return 0x7;
-		case 22:
-			return 0x8;
-		case 7:
-			return 0x9;
-		case 9:
-			return 0xE;
-		case 29:
-			return 0xA;
-		case 27:
-			return 0x0;
-		case 6:
-			return 0xB;
-		case 25:
-			return 0xF;
-		default:
-			return -1;
-	}
-}
\ No newline at end of file
@@ -1,9 +1,11 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "instructions.h"
+#include "libchip8.h"
 
 #define MEM_START_ADDR 0x000
 #define MEM_END_ADDR 0xFFF
@@ -14,26 +16,33 @@
 #define FONTSET_START_ADDR 0x000
 #define FONTSET_END_ADDR 0x04F
 
-#define FRAME_BUFFER_START_ADDR 0x050
-#define FRAME_BUFFER_END_ADDR 0x14F
-
 #define STACK_START_ADDR 0x150
 #define STACK_END_ADDR 0x18F
 
 #define RAM_START_ADDR 0x200
 #define RAM_END_ADDR 0xFFF
 
+#define MAX_ROM_SIZE (RAM_END_ADDR - RAM_START_ADDR + 1)
 #define FONTSET_SIZE 80
 #define NUM_V_REGISTERS 16
 #define MEM_SIZE 4096
 #define STACK_SIZE 32
 
-#define OPCODE_MASK 0xF000
-#define X_MASK 0x0F00
-#define Y_MASK 0x00F0
-#define N_MASK 0x000F
-#define NN_MASK 0x00FF
-#define NNN_MASK 0x0FFF
+// The display is kept outside of mem, one 64-bit word per row. The most
+// significant bit of a row is its leftmost pixel (x = 0).
+#define SCREEN_WIDTH CHIP8_SCREEN_WIDTH
+#define SCREEN_HEIGHT CHIP8_SCREEN_HEIGHT
+#define ALL_ROWS ((uint32_t)((1ull << SCREEN_HEIGHT) - 1))
+
+// Memory is split into 256-byte pages for tracking writes
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define NUM_PAGES (MEM_SIZE >> PAGE_SHIFT)
+#define ALL_PAGES ((1 << NUM_PAGES) - 1)
+#define RAM_PAGES (ALL_PAGES & ~((1 << (RAM_START_ADDR >> PAGE_SHIFT)) - 1))
+
+// Seed of the random number generator after init_sys
+#define DEFAULT_SEED 0
 
 typedef struct Chip8 Chip8;
 
@@ -67,19 +76,89 @@ struct Chip8 {
 	uint16_t I;
 	uint16_t SP;
 
-	uint8_t mem[MEM_SIZE];
+	uint64_t fb[SCREEN_HEIGHT];
 
 	int is_running;
-	int key_down;
+	uint16_t keys; // Bit k is set while key k is held down
 	int start_wait;
 	int end_wait;
 	int update_screen;
+
+	// Set by an instruction that cannot be executed. The PC is left at the
+	// faulting instruction and execution stops until the machine is reset.
+	Chip8Status fault;
+
+	// State of the xorshift64* generator behind rnd (never 0). Each machine
+	// has its own, so runs are reproducible from the seed.
+	uint64_t rng;
+
+	// Kept after the rest of the machine state so that snapshots can copy
+	// everything before it in one go and share the pages of mem (snapshot.h).
+	// Everything after it is bookkeeping.
+	uint8_t mem[MEM_SIZE];
+
+	// Bit i is set when page i of mem has been written. Execution engines that
+	// cache decoded code consume (and clear) this mask to invalidate stale
+	// entries, which keeps self-modifying ROMs working.
+	uint16_t dirty_pages;
+
+	// Bit i is set when row i of the frame buffer may have changed. The
+	// frontend clears it after presenting a frame.
+	uint32_t dirty_rows;
+
+	// Bit i is set when page i of mem has been written since the machine was
+	// saved to or restored from the snapshot with id snap_base. The other
+	// pages are still equal to that snapshot's and can be shared with it.
+	uint16_t snap_pages;
+	uint64_t snap_base;
 };
 
+// Memory accesses through I wrap around at the end of memory
+static inline uint8_t read_mem(const Chip8 *c, uint16_t addr) {
+	return c->mem[addr & (MEM_SIZE - 1)];
+}
+
+// Only the low nibble of a key value selects a key (like the keypad latch of
+// the COSMAC VIP)
+static inline int is_key_down(const Chip8 *c, uint8_t key) {
+	return (c->keys >> (key & 0xF)) & 1;
+}
+
+// Execution engines stop while the program waits for a key press or after a
+// fault
+static inline int is_stopped(const Chip8 *c) {
+	return (c->start_wait && !c->end_wait) || c->fault != CHIP8_OK;
+}
+
+// Next random byte for rnd: the top byte of the next xorshift64* output
+static inline uint8_t next_random(Chip8 *c) {
+	uint64_t x = c->rng;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	c->rng = x;
+	return (x * 0x2545F4914F6CDD1Dull) >> 56;
+}
+
+// Every store into mem made by an instruction goes through here
+static inline void write_mem(Chip8 *c, uint16_t addr, uint8_t val) {
+	addr &= MEM_SIZE - 1;
+	c->mem[addr] = val;
+	c->dirty_pages |= 1 << (addr >> PAGE_SHIFT);
+	c->snap_pages |= 1 << (addr >> PAGE_SHIFT);
+}
+
 void init_sys(Chip8 *c);
-void load_rom(Chip8 *c, char *file_path);
+Chip8Status load_rom(Chip8 *c, const uint8_t *rom, size_t size);
+Chip8Status read_rom_file(const char *file_path, uint8_t *rom, size_t *size);
+Chip8Status load_rom_file(Chip8 *c, const char *file_path);
+void seed_rng(Chip8 *c, uint64_t seed);
+void tick_timers(Chip8 *c);
+int same_state(const Chip8 *a, const Chip8 *b);
+uint64_t hash_rom(const uint8_t *rom, size_t size);
+uint64_t hash_state(const Chip8 *c);
 uint16_t fetch_instr(Chip8 *c);
+void decd_instr(uint16_t instr, Instr *in);
 void decd_and_exec_instr(Chip8 *c, uint16_t instr);
-int get_key_from_scancode(int sc);
 
 #endif
\ No newline at end of file
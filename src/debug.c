@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "debug.h"
+#include "profile.h"
+
+void init_debugger(Debugger *d) {
+	memset(d, 0, sizeof(*d));
+	d->resume_pc = -1;
+}
+
+void set_breakpoint(Debugger *d, uint16_t addr, int on) {
+	addr &= MEM_SIZE - 1;
+	d->num_breakpoints += (on != 0) - d->breakpoints[addr];
+	d->breakpoints[addr] = on != 0;
+}
+
+void set_watchpoint(Debugger *d, uint16_t addr, int on) {
+	addr &= MEM_SIZE - 1;
+	d->num_watchpoints += (on != 0) - d->watchpoints[addr];
+	d->watchpoints[addr] = on != 0;
+}
+
+// Execute up to the given number of instructions on the interpreter,
+// stopping before an instruction at a breakpoint and after an instruction
+// that stores into a watched byte (d->stop says which). Otherwise stops
+// early like the engines, when the program waits for a key press or faults.
+// Returns the number of instructions executed.
+long run_debug(Debugger *d, Chip8 *c, long cycles) {
+	d->stop = DEBUG_NONE;
+	long n = 0;
+	while (n < cycles && !is_stopped(c)) {
+		uint16_t pc = c->PC & (MEM_SIZE - 1);
+		if (d->breakpoints[pc] && pc != d->resume_pc) {
+			d->stop = DEBUG_BREAKPOINT;
+			d->stop_pc = pc;
+			d->resume_pc = pc;
+			break;
+		}
+		d->resume_pc = -1;
+
+		// The bytes the instruction stores into, if any: every store goes
+		// through I, except for the return address pushed by a call
+		Instr in;
+		decd_instr(fetch_instr(c), &in);
+		uint16_t start = 0;
+		int len = 0;
+		if (in.exec == ld_I_b) {
+			start = c->I;
+			len = 3;
+		} else if (in.exec == ld_I_from_reg) {
+			start = c->I;
+			len = in.x + 1;
+		} else if (in.exec == call_nnn) {
+			start = c->SP;
+			len = 2;
+		}
+
+		uint8_t old[NUM_V_REGISTERS];
+		for (int i = 0; i < len; i++) {
+			old[i] = read_mem(c, start + i);
+		}
+
+		c->PC += 2;
+		PROFILE_EXEC(c, &in);
+		n++;
+
+		// A call that overflows the stack faults without storing
+		if (c->fault != CHIP8_OK) {
+			continue;
+		}
+		for (int i = 0; i < len; i++) {
+			uint16_t addr = (start + i) & (MEM_SIZE - 1);
+			if (d->watchpoints[addr]) {
+				d->stop = DEBUG_WATCHPOINT;
+				d->stop_pc = pc;
+				d->stop_addr = addr;
+				d->stop_old = old[i];
+				d->stop_new = c->mem[addr];
+				return n;
+			}
+		}
+	}
+
+	return n;
+}
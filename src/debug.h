@@ -0,0 +1,47 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Breakpoints on the PC and watchpoints on stores into mem. While any is
+// set, run_engine runs the program on run_debug, an interpreter loop that
+// checks them around every instruction, instead of its engine. Otherwise the
+// engine runs exactly as without a debugger: there is no per-instruction
+// check on the fast path, only one per run.
+
+// Why run_debug stopped before the end of its run
+typedef enum DebugStop {
+	DEBUG_NONE,
+	DEBUG_BREAKPOINT, // Before executing the instruction at a breakpoint
+	DEBUG_WATCHPOINT  // After an instruction stored into a watched byte
+} DebugStop;
+
+typedef struct Debugger {
+	uint8_t breakpoints[MEM_SIZE];
+	uint8_t watchpoints[MEM_SIZE];
+	int num_breakpoints;
+	int num_watchpoints;
+
+	// Set when run_debug stops, and cleared when it is called again
+	DebugStop stop;
+	uint16_t stop_pc;   // Of the instruction it stopped before or after
+	uint16_t stop_addr; // The first watched byte that was written
+	uint8_t stop_old;   // The byte before the store
+	uint8_t stop_new;
+
+	// A run that starts at the breakpoint it stopped at executes it
+	int resume_pc;
+} Debugger;
+
+void init_debugger(Debugger *d);
+void set_breakpoint(Debugger *d, uint16_t addr, int on);
+void set_watchpoint(Debugger *d, uint16_t addr, int on);
+long run_debug(Debugger *d, Chip8 *c, long cycles);
+
+static inline int is_debug_armed(const Debugger *d) {
+	return d->num_breakpoints > 0 || d->num_watchpoints > 0;
+}
+
+#endif
@@ -0,0 +1,330 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "debug.h"
+#include "disasm.h"
+#include "engine.h"
+#include "instructions.h"
+
+#define DEFAULT_CLOCK_RATE 700
+#define TIMER_RATE 60
+
+// continue without a frame count stops after a minute of emulated time
+#define DEFAULT_CONTINUE_FRAMES (60 * TIMER_RATE)
+#define DEFAULT_LIST_LENGTH 10
+#define DEFAULT_DUMP_LENGTH 64
+#define MAX_LINE 256
+
+typedef struct Session {
+	Chip8 c;
+	Engine engine;
+	Debugger debug;
+	long rate;
+	long cycles_owed;  // Remainder of rate / TIMER_RATE carried between frames
+	long frame_cycles; // Instructions in the current frame
+	long frame_pos;    // Instructions run in the current frame
+	long frames;
+} Session;
+
+// The clock rate's share of instructions in a frame, with the remainder
+// carried over to the next frame like headless and libchip8 do. At rates
+// below 60 Hz, some frames run no instructions but still tick the timers.
+static void start_frame(Session *s) {
+	s->cycles_owed += s->rate;
+	s->frame_cycles = s->cycles_owed / TIMER_RATE;
+	s->cycles_owed %= TIMER_RATE;
+	s->frame_pos = 0;
+}
+
+static void print_instr(const Session *s, uint16_t addr) {
+	Instr in;
+	char text[MAX_ASM_SIZE];
+	uint16_t raw = read_mem(&s->c, addr) << 8 | read_mem(&s->c, addr + 1);
+	decd_instr(raw, &in);
+	format_instr(&in, text, sizeof(text));
+	printf("%c%c %03X  %04X  %s\n", addr == s->c.PC ? '>' : ' ',
+		s->debug.breakpoints[addr & (MEM_SIZE - 1)] ? '*' : ' ', addr, raw,
+		text);
+}
+
+static void print_regs(const Session *s) {
+	const Chip8 *c = &s->c;
+	printf("PC=%03X I=%03X SP=%03X DT=%02X ST=%02X keys=%04X frame=%ld+%ld\n",
+		c->PC, c->I, c->SP, c->DT, c->ST, c->keys, s->frames, s->frame_pos);
+	for (int i = 0; i < NUM_V_REGISTERS; i++) {
+		printf("V%c=%02X%c", HEX[i], c->V[i],
+			i == NUM_V_REGISTERS - 1 ? '\n' : ' ');
+	}
+
+	printf("stack:");
+	for (int addr = STACK_START_ADDR; addr < c->SP; addr += 2) {
+		printf(" %03X", c->mem[addr] << 8 | c->mem[addr + 1]);
+	}
+	printf("%s\n", c->SP == STACK_START_ADDR ? " (empty)" : "");
+	if (c->start_wait) {
+		printf("Waiting for a key press.\n");
+	}
+	if (c->fault != CHIP8_OK) {
+		printf("ERROR: %s.\n", chip8_status_message(c->fault));
+	}
+}
+
+static void print_mem(const Session *s, uint16_t addr, long len) {
+	for (long i = 0; i < len; i++) {
+		uint16_t a = (addr + i) & (MEM_SIZE - 1);
+		if (i % 16 == 0) {
+			printf("%s%03X:", i ? "\n" : "", a);
+		}
+		printf(" %02X%c", s->c.mem[a], s->debug.watchpoints[a] ? 'w' : ' ');
+	}
+	printf("\n");
+}
+
+static void print_screen(const Chip8 *c) {
+	for (int row = 0; row < SCREEN_HEIGHT; row++) {
+		uint64_t bits = c->fb[row];
+		for (int col = 0; col < SCREEN_WIDTH; col++) {
+			putchar(bits >> 63 ? '#' : '.');
+			bits <<= 1;
+		}
+		putchar('\n');
+	}
+}
+
+// Run up to max_instrs instructions or max_frames frames, like headless
+// does: frames of the clock rate's share of instructions followed by a timer
+// tick, with a key wait ending at the start of a frame if a key is held
+// down. Stops early at a breakpoint, a watchpoint, a fault, or a wait for a
+// key press while no key is held down.
+static void run(Session *s, long max_instrs, long max_frames) {
+	Chip8 *c = &s->c;
+	long instrs = 0;
+	long frames = 0;
+	s->debug.stop = DEBUG_NONE;
+	while (instrs < max_instrs && frames < max_frames) {
+		if (s->frame_pos == 0 && c->start_wait && c->keys) {
+			c->end_wait = 1;
+		}
+
+		long burst = s->frame_cycles - s->frame_pos;
+		if (burst > max_instrs - instrs) {
+			burst = max_instrs - instrs;
+		}
+		long ran = run_engine(&s->engine, c, burst);
+		instrs += ran;
+		s->frame_pos += ran;
+
+		if (s->debug.stop != DEBUG_NONE || c->fault != CHIP8_OK) {
+			break;
+		}
+		if (ran < burst) {
+			// The rest of the frame is spent waiting
+			if (!c->keys) {
+				break;
+			}
+			s->frame_pos = s->frame_cycles;
+		}
+		if (s->frame_pos == s->frame_cycles) {
+			tick_timers(c);
+			start_frame(s);
+			s->frames++;
+			frames++;
+		}
+	}
+
+	const Debugger *d = &s->debug;
+	if (d->stop == DEBUG_BREAKPOINT) {
+		printf("Breakpoint at %03X.\n", d->stop_pc);
+	} else if (d->stop == DEBUG_WATCHPOINT) {
+		printf("Watchpoint at %03X: %02X -> %02X (stored by %03X).\n",
+			d->stop_addr, d->stop_old, d->stop_new, d->stop_pc);
+	} else if (c->fault != CHIP8_OK) {
+		printf("ERROR: %s (0x%04X at 0x%03X).\n",
+			chip8_status_message(c->fault), fetch_instr(c), c->PC);
+	} else if (is_stopped(c)) {
+		printf("Waiting for a key press (hold keys down with 'keys').\n");
+	}
+	printf("Ran %ld instructions in %ld frames.\n", instrs, frames);
+	print_instr(s, c->PC);
+}
+
+static void print_breakpoints(const Session *s) {
+	printf("Breakpoints:");
+	for (int addr = 0; addr < MEM_SIZE; addr++) {
+		if (s->debug.breakpoints[addr]) {
+			printf(" %03X", addr);
+		}
+	}
+	printf("\nWatchpoints:");
+	for (int addr = 0; addr < MEM_SIZE; addr++) {
+		if (s->debug.watchpoints[addr]) {
+			printf(" %03X", addr);
+		}
+	}
+	printf("\n");
+}
+
+static void help() {
+	printf("break ADDR      (b)  stop before executing ADDR\n");
+	printf("delete ADDR     (d)  remove the breakpoint at ADDR\n");
+	printf("watch ADDR [N]  (w)  stop after a store into ADDR..ADDR+N-1\n");
+	printf("unwatch ADDR [N]     remove watchpoints\n");
+	printf("info            (i)  list breakpoints and watchpoints\n");
+	printf("step [N]        (s)  execute N instructions (1)\n");
+	printf("continue [N]    (c)  run N frames (%d) or until a stop\n",
+		DEFAULT_CONTINUE_FRAMES);
+	printf("regs            (r)  show the registers and stack\n");
+	printf("list [ADDR] [N] (l)  disassemble N instructions (%d) from ADDR "
+		"(PC)\n", DEFAULT_LIST_LENGTH);
+	printf("mem ADDR [N]    (x)  dump N bytes (%d) from ADDR\n",
+		DEFAULT_DUMP_LENGTH);
+	printf("screen               show the frame buffer\n");
+	printf("keys MASK       (k)  hold keys down (bit k is key k)\n");
+	printf("quit            (q)\n");
+	printf("Addresses and masks are hexadecimal, counts decimal.\n");
+}
+
+// Returns 0 when the session should end
+static int execute(Session *s, char *line) {
+	char *cmd = strtok(line, " \t\n");
+	char *arg1 = strtok(NULL, " \t\n");
+	char *arg2 = strtok(NULL, " \t\n");
+	if (cmd == NULL) {
+		return 1;
+	}
+
+	int has_addr = arg1 != NULL;
+	uint16_t addr = has_addr ? strtol(arg1, NULL, 16) : s->c.PC;
+	long count = arg2 ? atol(arg2) : 1;
+
+	if (strcmp(cmd, "q") == 0 || strcmp(cmd, "quit") == 0) {
+		return 0;
+	} else if (strcmp(cmd, "h") == 0 || strcmp(cmd, "help") == 0) {
+		help();
+	} else if (strcmp(cmd, "b") == 0 || strcmp(cmd, "break") == 0
+			|| strcmp(cmd, "d") == 0 || strcmp(cmd, "delete") == 0) {
+		if (!has_addr) {
+			printf("ERROR: Missing address.\n");
+			return 1;
+		}
+		set_breakpoint(&s->debug, addr, cmd[0] == 'b');
+	} else if (strcmp(cmd, "w") == 0 || strcmp(cmd, "watch") == 0
+			|| strcmp(cmd, "unwatch") == 0) {
+		if (!has_addr) {
+			printf("ERROR: Missing address.\n");
+			return 1;
+		}
+		for (long i = 0; i < count; i++) {
+			set_watchpoint(&s->debug, addr + i, cmd[0] == 'w');
+		}
+	} else if (strcmp(cmd, "i") == 0 || strcmp(cmd, "info") == 0) {
+		print_breakpoints(s);
+	} else if (strcmp(cmd, "s") == 0 || strcmp(cmd, "step") == 0) {
+		run(s, arg1 ? atol(arg1) : 1, LONG_MAX);
+	} else if (strcmp(cmd, "c") == 0 || strcmp(cmd, "continue") == 0) {
+		run(s, LONG_MAX, arg1 ? atol(arg1) : DEFAULT_CONTINUE_FRAMES);
+	} else if (strcmp(cmd, "r") == 0 || strcmp(cmd, "regs") == 0) {
+		print_regs(s);
+	} else if (strcmp(cmd, "l") == 0 || strcmp(cmd, "list") == 0) {
+		long n = arg2 ? count : DEFAULT_LIST_LENGTH;
+		for (long i = 0; i < n; i++) {
+			print_instr(s, (addr + 2 * i) & (MEM_SIZE - 1));
+		}
+	} else if (strcmp(cmd, "x") == 0 || strcmp(cmd, "mem") == 0) {
+		print_mem(s, addr, arg2 ? count : DEFAULT_DUMP_LENGTH);
+	} else if (strcmp(cmd, "screen") == 0) {
+		print_screen(&s->c);
+	} else if (strcmp(cmd, "k") == 0 || strcmp(cmd, "keys") == 0) {
+		s->c.keys = arg1 ? strtol(arg1, NULL, 16) : 0;
+	} else {
+		printf("ERROR: Unknown command '%s' (try help).\n", cmd);
+	}
+
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	// Debugger for a ROM, driven by commands on stdin (see help). The program
+	// runs on the selected engine until a breakpoint or watchpoint is set,
+	// then on the instrumented loop of debug.h until all are removed again.
+	// Like headless, there is no display, sound or keyboard: the screen is
+	// printed on demand and keys are held down with the keys command.
+
+	if (argc < 2) {
+		printf("Usage: %s {PATH_TO_ROM} [--rate HZ] [--engine NAME] "
+			"[--seed N]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	long rate = DEFAULT_CLOCK_RATE;
+	int engine_kind = ENGINE_CACHE;
+	uint64_t seed = DEFAULT_SEED;
+	for (int i = 2; i < argc; i++) {
+		if (i + 1 >= argc) {
+			printf("ERROR: Missing value for option '%s'.\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		if (strcmp(argv[i], "--rate") == 0) {
+			rate = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--seed") == 0) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--engine") == 0) {
+			engine_kind = get_engine_from_name(argv[++i]);
+			if (engine_kind < 0) {
+				printf("ERROR: Unknown engine '%s'.\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else {
+			printf("ERROR: Unknown option '%s'.\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (rate <= 0) {
+		printf("ERROR: Clock rate must be positive.\n");
+		return EXIT_FAILURE;
+	}
+
+	static Session s;
+	init_sys(&s.c);
+	Chip8Status status = load_rom_file(&s.c, argv[1]);
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to load ROM '%s': %s.\n", argv[1],
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+	seed_rng(&s.c, seed);
+
+	if (init_engine(&s.engine, engine_kind) != 0) {
+		printf("ERROR: Unable to initialize the %s engine.\n",
+			ENGINE_NAMES[engine_kind]);
+		return EXIT_FAILURE;
+	}
+	precompile_engine(&s.engine, &s.c);
+	init_debugger(&s.debug);
+	s.engine.debug = &s.debug;
+	s.rate = rate;
+	start_frame(&s);
+
+	int interactive = isatty(STDIN_FILENO);
+	char line[MAX_LINE];
+	print_instr(&s, s.c.PC);
+	for (;;) {
+		if (interactive) {
+			printf("(chip8) ");
+			fflush(stdout);
+		}
+		if (fgets(line, sizeof(line), stdin) == NULL
+				|| !execute(&s, line)) {
+			break;
+		}
+	}
+
+	close_engine(&s.engine);
+	return EXIT_SUCCESS;
+}
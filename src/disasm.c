@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "disasm.h"
+
+// Operands printed by the format of an instruction
+typedef enum Operands {
+	OPS_NONE,
+	OPS_NNN,
+	OPS_X,
+	OPS_X_NN,
+	OPS_X_Y,
+	OPS_X_Y_N
+} Operands;
+
+typedef struct AsmFormat {
+	InstrHandler exec;
+	const char *format;
+	Operands ops;
+} AsmFormat;
+
+static const AsmFormat ASM_FORMATS[] = {
+	{cls, "cls", OPS_NONE},
+	{ret, "ret", OPS_NONE},
+	{jmp_nnn, "jp 0x%03X", OPS_NNN},
+	{call_nnn, "call 0x%03X", OPS_NNN},
+	{se_Vx_nn, "se V%X, 0x%02X", OPS_X_NN},
+	{sne_Vx_nn, "sne V%X, 0x%02X", OPS_X_NN},
+	{se_Vx_Vy, "se V%X, V%X", OPS_X_Y},
+	{ld_Vx_nn, "ld V%X, 0x%02X", OPS_X_NN},
+	{add_Vx_nn, "add V%X, 0x%02X", OPS_X_NN},
+	{ld_Vx_Vy, "ld V%X, V%X", OPS_X_Y},
+	{bor, "or V%X, V%X", OPS_X_Y},
+	{band, "and V%X, V%X", OPS_X_Y},
+	{bxor, "xor V%X, V%X", OPS_X_Y},
+	{add_Vx_Vy, "add V%X, V%X", OPS_X_Y},
+	{sub, "sub V%X, V%X", OPS_X_Y},
+	{shr, "shr V%X", OPS_X},
+	{subn, "subn V%X, V%X", OPS_X_Y},
+	{shl, "shl V%X", OPS_X},
+	{sne_Vx_Vy, "sne V%X, V%X", OPS_X_Y},
+	{ld_I_nnn, "ld I, 0x%03X", OPS_NNN},
+	{jmp_V0_nnn, "jp V0, 0x%03X", OPS_NNN},
+	{rnd, "rnd V%X, 0x%02X", OPS_X_NN},
+	{drw, "drw V%X, V%X, %d", OPS_X_Y_N},
+	{skp, "skp V%X", OPS_X},
+	{skpn, "sknp V%X", OPS_X},
+	{ld_Vx_DT, "ld V%X, DT", OPS_X},
+	{ld_Vx_k, "ld V%X, K", OPS_X},
+	{ld_DT_Vx, "ld DT, V%X", OPS_X},
+	{ld_ST_Vx, "ld ST, V%X", OPS_X},
+	{add_I_Vx, "add I, V%X", OPS_X},
+	{ld_I_f, "ld F, V%X", OPS_X},
+	{ld_I_b, "ld B, V%X", OPS_X},
+	{ld_I_from_reg, "ld [I], V%X", OPS_X},
+	{ld_V_from_mem, "ld V%X, [I]", OPS_X},
+};
+
+#define NUM_ASM_FORMATS (sizeof(ASM_FORMATS) / sizeof(ASM_FORMATS[0]))
+
+Flow get_flow(const Instr *in) {
+	InstrHandler h = in->exec;
+	if (h == jmp_nnn) {
+		return FLOW_JUMP;
+	} else if (h == call_nnn) {
+		return FLOW_CALL;
+	} else if (h == se_Vx_nn || h == sne_Vx_nn || h == se_Vx_Vy
+			|| h == sne_Vx_Vy || h == skp || h == skpn) {
+		return FLOW_SKIP;
+	} else if (h == ret) {
+		return FLOW_RETURN;
+	} else if (h == jmp_V0_nnn) {
+		return FLOW_INDIRECT;
+	} else if (h == invalid) {
+		return FLOW_STOP;
+	}
+	return FLOW_NEXT;
+}
+
+// Write the assembly of an instruction (in the syntax of Cowgod's reference)
+// into buf. Opcodes that are not instructions are written as data. Returns
+// the length of the text, like snprintf.
+int format_instr(const Instr *in, char *buf, size_t size) {
+	for (size_t i = 0; i < NUM_ASM_FORMATS; i++) {
+		const AsmFormat *f = &ASM_FORMATS[i];
+		if (f->exec != in->exec) {
+			continue;
+		}
+
+		switch (f->ops) {
+			case OPS_NONE:
+				return snprintf(buf, size, "%s", f->format);
+			case OPS_NNN:
+				return snprintf(buf, size, f->format, in->nnn);
+			case OPS_X:
+				return snprintf(buf, size, f->format, in->x);
+			case OPS_X_NN:
+				return snprintf(buf, size, f->format, in->x, in->nn);
+			case OPS_X_Y:
+				return snprintf(buf, size, f->format, in->x, in->y);
+			case OPS_X_Y_N:
+				return snprintf(buf, size, f->format, in->x, in->y, in->n);
+		}
+	}
+
+	return snprintf(buf, size, "dw 0x%04X", in->raw);
+}
+
+// Only instructions that lie entirely in the ROM image are analysed
+int in_cfg_rom(const Cfg *cfg, long addr) {
+	return addr >= RAM_START_ADDR
+		&& addr + 1 < RAM_START_ADDR + (long)cfg->size;
+}
+
+void decode_cfg_instr(const Cfg *cfg, uint16_t addr, Instr *in) {
+	decd_instr(cfg->mem[addr] << 8 | cfg->mem[addr + 1], in);
+}
+
+// Whether the byte is part of a reachable instruction (instructions may
+// start at odd addresses, so this is not the same as CFG_CODE)
+int is_code_byte(const Cfg *cfg, uint16_t addr) {
+	return (cfg->flags[addr] & CFG_CODE)
+		|| (addr > 0 && (cfg->flags[addr - 1] & CFG_CODE));
+}
+
+// Number of instructions in the block starting at addr: it goes on while
+// instructions fall through to an instruction that does not start a block
+int get_block_length(const Cfg *cfg, uint16_t addr) {
+	int len = 1;
+	for (;;) {
+		Instr in;
+		decode_cfg_instr(cfg, addr, &in);
+		if (get_flow(&in) != FLOW_NEXT || !in_cfg_rom(cfg, addr + 2)
+				|| (cfg->flags[addr + 2] & (CFG_CODE | CFG_LEADER))
+				!= CFG_CODE) {
+			return len;
+		}
+		addr += 2;
+		len++;
+	}
+}
+
+// Find every instruction reachable from the entry point, following jumps,
+// calls, skips and fall-throughs (but not returns and indirect jumps, whose
+// targets are only known at run time), and mark where basic blocks start:
+// at the targets of jumps, calls, returns and skips, and around key waits,
+// where execution resumes after a wait.
+static void find_code(Cfg *cfg) {
+	uint16_t worklist[MEM_SIZE];
+	int top = 0;
+	if (in_cfg_rom(cfg, RAM_START_ADDR)) {
+		cfg->flags[RAM_START_ADDR] = CFG_CODE | CFG_LEADER;
+		worklist[top++] = RAM_START_ADDR;
+	}
+
+	while (top > 0) {
+		uint16_t addr = worklist[--top];
+		Instr in;
+		decode_cfg_instr(cfg, addr, &in);
+		cfg->num_instrs++;
+
+		long succ[2];
+		int num_succ = 0;
+		int leaders = 0;
+		switch (get_flow(&in)) {
+			case FLOW_NEXT:
+				succ[num_succ++] = addr + 2;
+				if (in.exec == ld_Vx_k) {
+					cfg->flags[addr] |= CFG_LEADER;
+					leaders = 1;
+				}
+				break;
+			case FLOW_JUMP:
+				succ[num_succ++] = in.nnn;
+				leaders = 1;
+				break;
+			case FLOW_CALL:
+				succ[num_succ++] = in.nnn;
+				succ[num_succ++] = addr + 2;
+				leaders = 1;
+				if (in_cfg_rom(cfg, in.nnn)) {
+					cfg->flags[in.nnn] |= CFG_SUBROUTINE;
+				}
+				break;
+			case FLOW_SKIP:
+				succ[num_succ++] = addr + 2;
+				succ[num_succ++] = addr + 4;
+				leaders = 1;
+				break;
+			case FLOW_INDIRECT:
+				cfg->num_indirect_jumps++;
+				break;
+			default:
+				break;
+		}
+
+		for (int i = 0; i < num_succ; i++) {
+			if (!in_cfg_rom(cfg, succ[i])) {
+				continue;
+			}
+			if (leaders) {
+				cfg->flags[succ[i]] |= CFG_LEADER;
+			}
+			if (!(cfg->flags[succ[i]] & CFG_CODE)) {
+				cfg->flags[succ[i]] |= CFG_CODE;
+				worklist[top++] = succ[i];
+			}
+		}
+	}
+}
+
+// Walk the body of a subroutine: what is reachable from its entry without
+// entering the subroutines it calls
+static void walk_subroutine(const Cfg *cfg, Subroutine *s) {
+	uint16_t worklist[MEM_SIZE];
+	uint8_t seen[MEM_SIZE] = {0};
+	int top = 0;
+	worklist[top++] = s->entry;
+	seen[s->entry] = 1;
+
+	while (top > 0) {
+		uint16_t addr = worklist[--top];
+		Instr in;
+		decode_cfg_instr(cfg, addr, &in);
+		s->num_instrs++;
+
+		long succ[2];
+		int num_succ = 0;
+		switch (get_flow(&in)) {
+			case FLOW_NEXT:
+			case FLOW_CALL:
+				succ[num_succ++] = addr + 2;
+				break;
+			case FLOW_JUMP:
+				succ[num_succ++] = in.nnn;
+				break;
+			case FLOW_SKIP:
+				succ[num_succ++] = addr + 2;
+				succ[num_succ++] = addr + 4;
+				break;
+			case FLOW_RETURN:
+				s->num_rets++;
+				break;
+			default:
+				break;
+		}
+
+		for (int i = 0; i < num_succ; i++) {
+			if (in_cfg_rom(cfg, succ[i]) && !seen[succ[i]]) {
+				seen[succ[i]] = 1;
+				worklist[top++] = succ[i];
+			}
+		}
+	}
+}
+
+static void find_subroutines(Cfg *cfg) {
+	for (long addr = RAM_START_ADDR; in_cfg_rom(cfg, addr); addr++) {
+		if (cfg->flags[addr] & CFG_SUBROUTINE) {
+			Subroutine *s = &cfg->subroutines[cfg->num_subroutines++];
+			memset(s, 0, sizeof(*s));
+			s->entry = addr;
+			walk_subroutine(cfg, s);
+		}
+	}
+
+	// Count the call sites of each subroutine
+	for (long addr = RAM_START_ADDR; in_cfg_rom(cfg, addr); addr++) {
+		Instr in;
+		if (!(cfg->flags[addr] & CFG_CODE)) {
+			continue;
+		}
+		decode_cfg_instr(cfg, addr, &in);
+		for (int i = 0; in.exec == call_nnn && i < cfg->num_subroutines; i++) {
+			if (cfg->subroutines[i].entry == in.nnn) {
+				cfg->subroutines[i].num_callers++;
+				break;
+			}
+		}
+	}
+}
+
+// Find the stores of every block. I is only known after an ld I, nnn earlier
+// in the same block.
+static void find_stores(Cfg *cfg) {
+	for (long leader = RAM_START_ADDR; in_cfg_rom(cfg, leader); leader++) {
+		if ((cfg->flags[leader] & (CFG_CODE | CFG_LEADER))
+				!= (CFG_CODE | CFG_LEADER)) {
+			continue;
+		}
+		cfg->num_blocks++;
+
+		int known = 0;
+		uint16_t I = 0;
+		int len = get_block_length(cfg, leader);
+		for (int i = 0; i < len; i++) {
+			Instr in;
+			decode_cfg_instr(cfg, leader + 2 * i, &in);
+			int count = 0;
+			if (in.exec == ld_I_nnn) {
+				known = 1;
+				I = in.nnn;
+			} else if (in.exec == add_I_Vx || in.exec == ld_I_f) {
+				known = 0;
+			} else if (in.exec == ld_I_b) {
+				count = 3;
+			} else if (in.exec == ld_I_from_reg) {
+				count = in.x + 1;
+			}
+
+			if (count == 0) {
+				continue;
+			} else if (!known) {
+				cfg->num_unknown_stores++;
+				continue;
+			}
+
+			int hits_code = 0;
+			for (int j = 0; j < count; j++) {
+				uint16_t addr = (I + j) & (MEM_SIZE - 1);
+				cfg->flags[addr] |= CFG_STORED;
+				hits_code |= is_code_byte(cfg, addr);
+			}
+			cfg->num_known_stores++;
+			cfg->num_code_stores += hits_code;
+		}
+	}
+}
+
+// Analyse the ROM as it would be loaded at 0x200
+void build_cfg(Cfg *cfg, const uint8_t *rom, size_t size) {
+	memset(cfg, 0, sizeof(*cfg));
+	if (size > MAX_ROM_SIZE) {
+		size = MAX_ROM_SIZE;
+	}
+	memcpy(&cfg->mem[RAM_START_ADDR], rom, size);
+	cfg->size = size;
+
+	find_code(cfg);
+	find_subroutines(cfg);
+	find_stores(cfg);
+}
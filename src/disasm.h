@@ -0,0 +1,75 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+#include "instructions.h"
+
+// Disassembler and static analysis of ROMs. build_cfg follows every path
+// from the entry point at 0x200 (recursive descent) to tell reachable code
+// from data, finds the basic blocks and the subroutines, and the stores that
+// may write to code.
+
+// Longest assembly text of an instruction, with the terminating NUL
+#define MAX_ASM_SIZE 32
+
+// How control leaves an instruction
+typedef enum Flow {
+	FLOW_NEXT,     // Falls through to the next instruction
+	FLOW_JUMP,     // jmp_nnn
+	FLOW_CALL,     // call_nnn, returns to the next instruction
+	FLOW_SKIP,     // Falls through or skips the next instruction
+	FLOW_RETURN,   // ret, to an address only known at run time
+	FLOW_INDIRECT, // jmp_V0_nnn, to an address only known at run time
+	FLOW_STOP      // invalid, faults
+} Flow;
+
+// Flags of an address in Cfg
+#define CFG_CODE 0x01       // A reachable instruction starts here
+#define CFG_LEADER 0x02     // The instruction starts a basic block
+#define CFG_SUBROUTINE 0x04 // The instruction is the target of a call
+#define CFG_STORED 0x08     // The byte is written by a store (I known statically)
+
+typedef struct Subroutine {
+	uint16_t entry;
+	uint16_t num_instrs; // Reachable from the entry without following calls
+	uint16_t num_rets;
+	uint16_t num_callers;
+} Subroutine;
+
+typedef struct Cfg {
+	// The ROM image as loaded at 0x200, the rest of memory is zero
+	uint8_t mem[MEM_SIZE];
+	size_t size;
+
+	uint8_t flags[MEM_SIZE];
+	int num_instrs;
+	int num_blocks;
+
+	// In order of their entry points
+	Subroutine subroutines[MAX_ROM_SIZE / 2];
+	int num_subroutines;
+
+	// Jumps through V0, whose targets (and what they reach) are not analysed
+	int num_indirect_jumps;
+
+	// Stores (Fx33, Fx55) through an I that is set in the same block, and
+	// how many of them write to code, which makes the ROM self-modifying.
+	// Stores through any other I may write anywhere.
+	int num_known_stores;
+	int num_code_stores;
+	int num_unknown_stores;
+} Cfg;
+
+Flow get_flow(const Instr *in);
+int format_instr(const Instr *in, char *buf, size_t size);
+
+void build_cfg(Cfg *cfg, const uint8_t *rom, size_t size);
+void decode_cfg_instr(const Cfg *cfg, uint16_t addr, Instr *in);
+int in_cfg_rom(const Cfg *cfg, long addr);
+int is_code_byte(const Cfg *cfg, uint16_t addr);
+int get_block_length(const Cfg *cfg, uint16_t addr);
+
+#endif
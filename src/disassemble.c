@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+#include "disasm.h"
+#include "instructions.h"
+
+// Data bytes per line of the listing
+#define DATA_PER_LINE 8
+
+static const Subroutine *find_subroutine(const Cfg *cfg, uint16_t addr) {
+	for (int i = 0; i < cfg->num_subroutines; i++) {
+		if (cfg->subroutines[i].entry == addr) {
+			return &cfg->subroutines[i];
+		}
+	}
+	return NULL;
+}
+
+static void print_label(const Cfg *cfg, uint16_t addr) {
+	const Subroutine *s = find_subroutine(cfg, addr);
+	if (s != NULL) {
+		printf("\nsub_%03X:  ; %d caller%s, %d instructions, %d return%s\n",
+			addr, s->num_callers, s->num_callers == 1 ? "" : "s",
+			s->num_instrs, s->num_rets, s->num_rets == 1 ? "" : "s");
+	} else {
+		printf("\nL_%03X:\n", addr);
+	}
+}
+
+// Print the data bytes from addr up to the next instruction, returns the
+// address after them
+static long print_data(const Cfg *cfg, long addr) {
+	long end = RAM_START_ADDR + cfg->size;
+	while (addr < end && !is_code_byte(cfg, addr)) {
+		printf("%03lX        db ", addr);
+		int stored = 0;
+		for (int i = 0; i < DATA_PER_LINE && addr < end
+				&& !is_code_byte(cfg, addr); i++, addr++) {
+			printf("%s0x%02X", i ? ", " : "", cfg->mem[addr]);
+			stored |= cfg->flags[addr] & CFG_STORED;
+		}
+		printf("%s\n", stored ? "  ; written" : "");
+	}
+
+	return addr;
+}
+
+static void print_listing(const Cfg *cfg) {
+	long end = RAM_START_ADDR + cfg->size;
+	long addr = RAM_START_ADDR;
+	while (addr < end) {
+		if (!(cfg->flags[addr] & CFG_CODE)) {
+			addr = print_data(cfg, addr);
+			continue;
+		}
+
+		if (cfg->flags[addr] & CFG_LEADER) {
+			print_label(cfg, addr);
+		}
+
+		Instr in;
+		char text[MAX_ASM_SIZE];
+		decode_cfg_instr(cfg, addr, &in);
+		format_instr(&in, text, sizeof(text));
+		if ((cfg->flags[addr] | cfg->flags[addr + 1]) & CFG_STORED) {
+			printf("%03lX  %04X  %-20s  ; written (self-modifying)\n", addr,
+				in.raw, text);
+		} else {
+			printf("%03lX  %04X  %s\n", addr, in.raw, text);
+		}
+
+		// An instruction may also start at the odd address in between
+		addr += cfg->flags[addr + 1] & CFG_CODE ? 1 : 2;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	// Disassemble a ROM:
+	//     disassemble {PATH_TO_ROM}
+	// The listing shows the code reachable from 0x200 as basic blocks (with
+	// the subroutines labeled) and everything else as data. Bytes that stores
+	// are known to write are marked. It starts with a summary of the
+	// analysis.
+
+	if (argc != 2) {
+		printf("Usage: %s {PATH_TO_ROM}\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t size;
+	Chip8Status status = read_rom_file(argv[1], rom, &size);
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to load ROM '%s': %s.\n", argv[1],
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+
+	static Cfg cfg;
+	build_cfg(&cfg, rom, size);
+
+	int code_bytes = 0;
+	for (long addr = RAM_START_ADDR; addr < RAM_START_ADDR + (long)size;
+			addr++) {
+		code_bytes += is_code_byte(&cfg, addr);
+	}
+
+	printf("; %s: %zu bytes, %d of code, %zu of data\n", argv[1], size,
+		code_bytes, size - code_bytes);
+	printf("; %d instructions in %d blocks, %d subroutines, %d indirect "
+		"jumps\n", cfg.num_instrs, cfg.num_blocks, cfg.num_subroutines,
+		cfg.num_indirect_jumps);
+	printf("; %d stores to known addresses (%d into code), %d through a "
+		"computed I\n", cfg.num_known_stores, cfg.num_code_stores,
+		cfg.num_unknown_stores);
+	print_listing(&cfg);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,216 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+
+// Idle loops of up to half this many instructions are found
+#define MAX_IDLE_PROBE 32
+#define MAX_IDLE_BACKOFF 64
+
+const char *ENGINE_NAMES[NUM_ENGINES] = {
+	[ENGINE_INTERP] = "interp",
+	[ENGINE_CACHE] = "cache",
+	[ENGINE_BLOCK] = "block",
+	[ENGINE_JIT] = "jit",
+};
+
+// Returns the engine with the given name, or -1 if there is none
+int get_engine_from_name(const char *name) {
+	for (int i = 0; i < NUM_ENGINES; i++) {
+		if (strcmp(name, ENGINE_NAMES[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Returns 0 on success, or -1 if the engine state could not be allocated
+int init_engine(Engine *e, EngineKind kind) {
+	e->kind = kind;
+	e->icache = NULL;
+	e->block_cache = NULL;
+	e->jit = NULL;
+	e->skip_idle = 1;
+	e->idle_backoff = 0;
+	e->idle_wait = 0;
+	e->idle_len = 0;
+	e->idle_skipped = 0;
+	e->debug = NULL;
+
+	if (kind == ENGINE_CACHE) {
+		e->icache = malloc(sizeof(ICache));
+		if (e->icache == NULL) {
+			return -1;
+		}
+		init_icache(e->icache);
+	} else if (kind == ENGINE_BLOCK) {
+		e->block_cache = malloc(sizeof(BlockCache));
+		if (e->block_cache == NULL) {
+			return -1;
+		}
+		init_block_cache(e->block_cache);
+	} else if (kind == ENGINE_JIT) {
+		e->jit = malloc(sizeof(Jit));
+		if (e->jit == NULL) {
+			return -1;
+		}
+		if (init_jit(e->jit) != 0) {
+			free(e->jit);
+			e->jit = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Decode the code reachable from 0x200 in memory ahead of the first run.
+// Only the cache engine does, the block engines translate a block the first
+// time it is entered anyway.
+void precompile_engine(Engine *e, Chip8 *c) {
+	if (e->kind != ENGINE_CACHE) {
+		return;
+	}
+
+	Cfg *cfg = malloc(sizeof(Cfg));
+	if (cfg == NULL) {
+		return;
+	}
+	build_cfg(cfg, &c->mem[RAM_START_ADDR], MAX_ROM_SIZE);
+	precompile_icache(e->icache, c, cfg);
+	free(cfg);
+}
+
+static long run_interp(Chip8 *c, long cycles) {
+	long n = 0;
+	for (; n < cycles && !is_stopped(c); n++) {
+		uint16_t instr = fetch_instr(c);
+		decd_and_exec_instr(c, instr);
+	}
+
+	return n;
+}
+
+// Everything an instruction that neither draws nor stores can change: the
+// registers and flags, but not the display or memory
+static int same_regs(const Chip8 *a, const Chip8 *b) {
+	return memcmp(a, b, offsetof(Chip8, fb)) == 0
+		&& memcmp(&a->is_running, &b->is_running,
+			offsetof(Chip8, mem) - offsetof(Chip8, is_running)) == 0;
+}
+
+// Look for an idle loop at the current PC by running up to MAX_IDLE_PROBE
+// instructions on the interpreter. If the registers return to an earlier
+// value without a draw or a store in between, the program is at a fixed
+// point: the timers and keys do not change during a run, so it repeats the
+// same iteration until the run ends. All whole iterations left in the run
+// are then skipped, since they end in the state they start from, and the
+// engine runs what remains. The loop is found with Brent's algorithm, which
+// first tries the length of the loop found in the previous run: a program
+// that is still in it is caught after a single iteration, so that even the
+// few instructions of a 60 Hz frame at a low clock rate get skipped.
+// Returns the number of instructions run or skipped.
+static long skip_idle_loop(Engine *e, Chip8 *c, long cycles) {
+	uint16_t dirty_pages = c->dirty_pages;
+	uint32_t dirty_rows = c->dirty_rows;
+	c->dirty_pages = 0;
+	c->dirty_rows = 0;
+
+	Chip8 saved;
+	memcpy(&saved, c, offsetof(Chip8, mem));
+	long n = 0;
+	long len = 0;
+	long power = e->idle_len > 0 ? e->idle_len : 1;
+	int found = 0;
+	while (n < cycles && n < MAX_IDLE_PROBE && !is_stopped(c)) {
+		decd_and_exec_instr(c, fetch_instr(c));
+		n++;
+		len++;
+		if (c->dirty_pages || c->dirty_rows) {
+			break;
+		}
+
+		if (same_regs(c, &saved)) {
+			e->idle_len = len;
+			long skipped = (cycles - n) / len * len;
+			e->idle_skipped += skipped;
+			n += skipped;
+			found = 1;
+			break;
+		}
+
+		if (len == power) {
+			memcpy(&saved, c, offsetof(Chip8, mem));
+			power *= 2;
+			len = 0;
+		}
+	}
+
+	c->dirty_pages |= dirty_pages;
+	c->dirty_rows |= dirty_rows;
+
+	// Back off exponentially while the program keeps busy, so that probing
+	// costs next to nothing when it is not idle
+	if (found) {
+		e->idle_backoff = 0;
+	} else {
+		e->idle_len = 0;
+		e->idle_backoff = e->idle_backoff ? e->idle_backoff * 2 : 1;
+		if (e->idle_backoff > MAX_IDLE_BACKOFF) {
+			e->idle_backoff = MAX_IDLE_BACKOFF;
+		}
+	}
+	e->idle_wait = e->idle_backoff;
+	return n;
+}
+
+static long run_kind(Engine *e, Chip8 *c, long cycles) {
+	switch (e->kind) {
+		case ENGINE_CACHE:
+			return run_icache(e->icache, c, cycles);
+		case ENGINE_BLOCK:
+			return run_block_cache(e->block_cache, c, cycles);
+		case ENGINE_JIT:
+			return run_jit(e->jit, c, cycles);
+		default:
+			return run_interp(c, cycles);
+	}
+}
+
+// Execute up to the given number of instructions. Returns the number of
+// instructions executed, which is less than requested only if the program is
+// waiting for a key press or has faulted. Skipped idle iterations count as
+// executed.
+long run_engine(Engine *e, Chip8 *c, long cycles) {
+	// While debugging, the instrumented loop runs instead of the engine
+	if (e->debug != NULL && is_debug_armed(e->debug)) {
+		return run_debug(e->debug, c, cycles);
+	}
+
+	// Runs too short to hold two iterations of any loop are left to the engine
+	if (!e->skip_idle || cycles < MIN_IDLE_RUN || is_stopped(c)) {
+		return run_kind(e, c, cycles);
+	}
+	if (e->idle_wait > 0) {
+		e->idle_wait--;
+		return run_kind(e, c, cycles);
+	}
+
+	long n = skip_idle_loop(e, c, cycles);
+	return n + run_kind(e, c, cycles - n);
+}
+
+void close_engine(Engine *e) {
+	if (e->jit != NULL) {
+		close_jit(e->jit);
+	}
+
+	free(e->icache);
+	free(e->block_cache);
+	free(e->jit);
+	e->icache = NULL;
+	e->block_cache = NULL;
+	e->jit = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "chip8.h"
+#include "debug.h"
+#include "icache.h"
+#include "block.h"
+#include "jit.h"
+
+// Execution engines. All engines produce exactly the same machine state, they
+// only differ in how instructions are dispatched.
+typedef enum EngineKind {
+	ENGINE_INTERP, // Fetch, decode and execute every instruction
+	ENGINE_CACHE,  // Decoded instruction cache
+	ENGINE_BLOCK,  // Basic-block cache with threaded dispatch
+	ENGINE_JIT,    // Native x86-64 code (only where JIT_SUPPORTED)
+	NUM_ENGINES
+} EngineKind;
+
+// Shortest run in which an idle loop is looked for: with 60 runs a second,
+// idle loops are only looked for from a clock rate of 480 Hz
+#define MIN_IDLE_RUN 8
+
+typedef struct Engine Engine;
+
+struct Engine {
+	EngineKind kind;
+	ICache *icache;
+	BlockCache *block_cache;
+	Jit *jit;
+
+	// Idle loops (a program polling DT or a key without doing anything
+	// else) are fast-forwarded to the end of the run when skip_idle is set,
+	// which init_engine does. Runs of fewer than MIN_IDLE_RUN instructions
+	// are never probed. idle_skipped counts the instructions that were not
+	// executed but counted as run.
+	int skip_idle;
+	int idle_backoff; // Runs to wait before probing again after a miss
+	int idle_wait;
+	int idle_len;     // Length of the loop found by the last probe, or 0
+	long idle_skipped;
+
+	// Attached debugger (debug.h), or NULL. Its breakpoints and watchpoints
+	// are only checked while any is set.
+	Debugger *debug;
+};
+
+extern const char *ENGINE_NAMES[NUM_ENGINES];
+
+int get_engine_from_name(const char *name);
+int init_engine(Engine *e, EngineKind kind);
+void precompile_engine(Engine *e, Chip8 *c);
+long run_engine(Engine *e, Chip8 *c, long cycles);
+void close_engine(Engine *e);
+
+#endif
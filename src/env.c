@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libchip8.h"
+#include "lockstep.h"
+
+#define DEFAULT_CLOCK_RATE 700
+#define FRAME_RATE 60
+
+struct Chip8Env {
+	Lockstep ls;
+	Chip8EnvConfig config;
+	long cycles_owed; // Remainder of the clock rate / FRAME_RATE
+
+	// Copies of the readers of the config
+	Chip8MemReader *rewards;
+	Chip8MemReader done;
+
+	// Per environment: the last value of each reward reader (num_rewards
+	// values per environment), the steps since the last reset and whether
+	// the episode ended in the last step
+	long *values;
+	long *steps;
+	uint8_t *ended;
+};
+
+static int is_valid_reader(const Chip8MemReader *r) {
+	return r->size >= 1 && r->size <= 4;
+}
+
+static long read_value(const Chip8 *c, const Chip8MemReader *r) {
+	long value = 0;
+	for (int i = 0; i < r->size; i++) {
+		uint8_t b = read_mem(c, r->addr + i);
+		value = r->bcd ? value * 10 + b : (value << 8) | b;
+	}
+	return value;
+}
+
+static void reset_env(Chip8Env *env, int i) {
+	reset_lane(&env->ls, i);
+
+	const Chip8 *c = &env->ls.lanes[i];
+	long *values = &env->values[(long)i * env->config.num_rewards];
+	for (int j = 0; j < env->config.num_rewards; j++) {
+		values[j] = read_value(c, &env->rewards[j]);
+	}
+	env->steps[i] = 0;
+	env->ended[i] = 0;
+}
+
+static void write_obs(const Chip8Env *env, int i, uint8_t *obs) {
+	const Chip8 *c = &env->ls.lanes[i];
+	obs += i * chip8_env_obs_size(env);
+
+	if (env->config.obs_format == CHIP8_OBS_BITS) {
+		memcpy(obs, c->fb, sizeof(c->fb));
+		return;
+	}
+
+	for (int row = 0; row < SCREEN_HEIGHT; row++) {
+		uint64_t bits = c->fb[row];
+		for (int col = 0; col < SCREEN_WIDTH; col++) {
+			*obs++ = (bits >> (SCREEN_WIDTH - 1 - col)) & 1;
+		}
+	}
+}
+
+Chip8Status chip8_env_create(Chip8Env **env, int num_envs,
+		const uint8_t *rom, size_t size, const Chip8EnvConfig *config) {
+	*env = NULL;
+
+	Chip8EnvConfig defaults = {0};
+	if (config == NULL) {
+		config = &defaults;
+	}
+
+	if (num_envs <= 0 || config->clock_rate < 0 || config->frame_skip < 0
+			|| config->num_rewards < 0 || config->max_steps < 0
+			|| (config->obs_format != CHIP8_OBS_BITS
+			&& config->obs_format != CHIP8_OBS_PIXELS)
+			|| (config->num_rewards > 0 && config->rewards == NULL)
+			|| (config->done != NULL && !is_valid_reader(config->done))) {
+		return CHIP8_ERR_INVALID_ARG;
+	}
+	for (int j = 0; j < config->num_rewards; j++) {
+		if (!is_valid_reader(&config->rewards[j])) {
+			return CHIP8_ERR_INVALID_ARG;
+		}
+	}
+
+	Chip8Env *e = calloc(1, sizeof(Chip8Env));
+	if (e == NULL) {
+		return CHIP8_ERR_NO_MEMORY;
+	}
+
+	e->config = *config;
+	if (e->config.clock_rate == 0) {
+		e->config.clock_rate = DEFAULT_CLOCK_RATE;
+	}
+	if (e->config.frame_skip == 0) {
+		e->config.frame_skip = 1;
+	}
+	if (config->done != NULL) {
+		e->done = *config->done;
+		e->config.done = &e->done;
+	}
+
+	int num_rewards = config->num_rewards;
+	e->rewards = malloc((num_rewards ? num_rewards : 1)
+		* sizeof(Chip8MemReader));
+	e->values = malloc(((long)num_envs * num_rewards + 1) * sizeof(long));
+	e->steps = malloc(num_envs * sizeof(long));
+	e->ended = malloc(num_envs);
+	if (e->rewards == NULL || e->values == NULL || e->steps == NULL
+			|| e->ended == NULL || init_lockstep(&e->ls, num_envs) != 0) {
+		chip8_env_destroy(e);
+		return CHIP8_ERR_NO_MEMORY;
+	}
+	if (num_rewards > 0) {
+		memcpy(e->rewards, config->rewards,
+			num_rewards * sizeof(Chip8MemReader));
+	}
+	e->config.rewards = e->rewards;
+
+	Chip8Status status = load_lockstep(&e->ls, rom, size);
+	if (status != CHIP8_OK) {
+		chip8_env_destroy(e);
+		return status;
+	}
+
+	chip8_env_reset(e, NULL);
+	*env = e;
+	return CHIP8_OK;
+}
+
+void chip8_env_destroy(Chip8Env *env) {
+	if (env == NULL) {
+		return;
+	}
+
+	close_lockstep(&env->ls);
+	free(env->rewards);
+	free(env->values);
+	free(env->steps);
+	free(env->ended);
+	free(env);
+}
+
+size_t chip8_env_obs_size(const Chip8Env *env) {
+	if (env->config.obs_format == CHIP8_OBS_BITS) {
+		return CHIP8_SCREEN_HEIGHT * sizeof(uint64_t);
+	}
+	return CHIP8_SCREEN_HEIGHT * CHIP8_SCREEN_WIDTH;
+}
+
+void chip8_env_reset(Chip8Env *env, void *obs) {
+	env->cycles_owed = 0;
+	for (int i = 0; i < env->ls.num_lanes; i++) {
+		reset_env(env, i);
+		if (obs != NULL) {
+			write_obs(env, i, obs);
+		}
+	}
+	seed_lanes(&env->ls, env->config.seed);
+}
+
+void chip8_env_step(Chip8Env *env, const uint16_t *actions,
+		void *obs, float *rewards, uint8_t *done) {
+	Lockstep *ls = &env->ls;
+	const Chip8EnvConfig *config = &env->config;
+
+	for (int i = 0; i < ls->num_lanes; i++) {
+		if (env->ended[i]) {
+			reset_env(env, i);
+		}
+		set_lane_keys(ls, i, actions[i]);
+	}
+
+	for (int f = 0; f < config->frame_skip; f++) {
+		start_lockstep_frame(ls);
+		env->cycles_owed += config->clock_rate;
+		run_lockstep(ls, env->cycles_owed / FRAME_RATE);
+		env->cycles_owed %= FRAME_RATE;
+		tick_lockstep_timers(ls);
+	}
+
+	for (int i = 0; i < ls->num_lanes; i++) {
+		const Chip8 *c = &ls->lanes[i];
+		long *values = &env->values[(long)i * config->num_rewards];
+		float reward = 0;
+		for (int j = 0; j < config->num_rewards; j++) {
+			long value = read_value(c, &config->rewards[j]);
+			reward += config->rewards[j].scale * (value - values[j]);
+			values[j] = value;
+		}
+
+		env->steps[i]++;
+		env->ended[i] = c->fault != CHIP8_OK
+			|| (config->done != NULL
+			&& read_value(c, config->done) == config->done_value)
+			|| (config->max_steps > 0 && env->steps[i] >= config->max_steps);
+
+		if (rewards != NULL) {
+			rewards[i] = reward;
+		}
+		if (done != NULL) {
+			done[i] = env->ended[i];
+		}
+		if (obs != NULL) {
+			write_obs(env, i, obs);
+		}
+	}
+}
@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aot.h"
+#include "chip8.h"
+#include "instructions.h"
+#include "engine.h"
+#include "lockstep.h"
+#include "movie.h"
+#include "profile.h"
+
+#define DEFAULT_CLOCK_RATE 700
+#define TIMER_RATE 60
+
+// Print the registers and the frame buffer so that the final state of a run
+// can be inspected (or diffed) without a display.
+static void dump_state(Chip8 *c) {
+	printf("PC=%03X I=%03X SP=%03X DT=%02X ST=%02X\n",
+		c->PC, c->I, c->SP, c->DT, c->ST);
+
+	for (int i = 0; i < NUM_V_REGISTERS; i++) {
+		printf("V%c=%02X%c", HEX[i], c->V[i],
+			i == NUM_V_REGISTERS - 1 ? '\n' : ' ');
+	}
+
+	for (int row = 0; row < SCREEN_HEIGHT; row++) {
+		uint64_t bits = c->fb[row];
+		for (int col = 0; col < SCREEN_WIDTH; col++) {
+			putchar(bits >> 63 ? '#' : '.');
+			bits <<= 1;
+		}
+		putchar('\n');
+	}
+}
+
+// Run copies of the ROM on the lanes of the lockstep engine, one frame at a
+// time like main does with a single machine, and dump the state of the
+// first lane. In verify mode, every lane is compared after every frame with
+// a machine running the same program (and seed) on the interpreter.
+static int run_lanes(const char *rom_path, int num_lanes, long cycles,
+		long rate, uint16_t keys, uint64_t seed, int verify) {
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t size;
+	Chip8Status status = read_rom_file(rom_path, rom, &size);
+	Lockstep ls;
+	if (status == CHIP8_OK && init_lockstep(&ls, num_lanes) != 0) {
+		status = CHIP8_ERR_NO_MEMORY;
+	}
+	if (status == CHIP8_OK) {
+		status = load_lockstep(&ls, rom, size);
+		if (status != CHIP8_OK) {
+			close_lockstep(&ls);
+		}
+	}
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to load ROM '%s': %s.\n", rom_path,
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < num_lanes; i++) {
+		set_lane_keys(&ls, i, keys);
+	}
+	seed_lanes(&ls, seed);
+
+	Chip8 *refs = NULL;
+	Engine ref_engine;
+	if (verify) {
+		refs = malloc(num_lanes * sizeof(Chip8));
+		if (refs == NULL) {
+			printf("ERROR: Out of memory.\n");
+			close_lockstep(&ls);
+			return EXIT_FAILURE;
+		}
+		for (int i = 0; i < num_lanes; i++) {
+			init_sys(&refs[i]);
+			load_rom(&refs[i], rom, size);
+			refs[i].keys = keys;
+			seed_rng(&refs[i], seed + i);
+		}
+		init_engine(&ref_engine, ENGINE_INTERP);
+		ref_engine.skip_idle = 0;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	long instructions = 0;
+	long cycles_owed = 0;
+	for (long executed = 0; executed < cycles; ) {
+		POLL_PROFILE();
+		cycles_owed += rate;
+		long frame_cycles = cycles_owed / TIMER_RATE;
+		cycles_owed %= TIMER_RATE;
+		long burst = frame_cycles;
+		if (burst > cycles - executed) {
+			burst = cycles - executed;
+		}
+
+		start_lockstep_frame(&ls);
+		instructions += run_lockstep(&ls, burst);
+		if (burst == frame_cycles) {
+			tick_lockstep_timers(&ls);
+		}
+
+		for (int i = 0; verify && i < num_lanes; i++) {
+			Chip8 *ref = &refs[i];
+			if (ref->start_wait && ref->keys) {
+				ref->end_wait = 1;
+			}
+			run_engine(&ref_engine, ref, burst);
+			if (burst == frame_cycles) {
+				tick_timers(ref);
+			}
+
+			Chip8 *c = sync_lane(&ls, i);
+			if (!same_state(c, ref)) {
+				printf("ERROR: Lane %d diverged from the interpreter between "
+					"cycles %ld and %ld.\n", i, executed, executed + burst);
+				printf("\n--- lane %d ---\n", i);
+				dump_state(c);
+				printf("\n--- interp ---\n");
+				dump_state(ref);
+				return EXIT_FAILURE;
+			}
+		}
+		executed += burst;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	int faulted = 0;
+	for (int i = 0; i < num_lanes; i++) {
+		faulted += ls.lanes[i].fault != CHIP8_OK;
+	}
+
+	printf("lanes=%d instructions=%ld faulted=%d time=%.6fs "
+		"(%.0f instructions/s)\n", num_lanes, instructions, faulted, elapsed,
+		elapsed > 0 ? instructions / elapsed : 0);
+	Chip8 *c = sync_lane(&ls, 0);
+	if (c->fault != CHIP8_OK) {
+		printf("ERROR: %s (0x%04X at 0x%03X).\n",
+			chip8_status_message(c->fault), fetch_instr(c), c->PC);
+	}
+	dump_state(c);
+	close_lockstep(&ls);
+	if (verify) {
+		close_engine(&ref_engine);
+		free(refs);
+	}
+
+	return faulted == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Replay a movie recorded by the SDL frontend as fast as possible. Every frame
+// runs like it did there (the frame's share of the clock rate with the
+// remainder carried over, then a timer tick) with the recorded keys held
+// down, and with the recorded seed.
+static int run_replay(const char *rom_path, const char *movie_path,
+		int engine_kind, int skip_idle, int verify) {
+	Movie m;
+	Chip8Status status = read_movie(&m, movie_path);
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to load movie '%s': %s.\n", movie_path,
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t size;
+	Chip8 c;
+	init_sys(&c);
+	status = read_rom_file(rom_path, rom, &size);
+	if (status == CHIP8_OK) {
+		status = load_rom(&c, rom, size);
+	}
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to load ROM '%s': %s.\n", rom_path,
+			chip8_status_message(status));
+		close_movie(&m);
+		return EXIT_FAILURE;
+	}
+	if (hash_rom(rom, size) != m.rom_hash) {
+		printf("ERROR: Movie '%s' was recorded with a different ROM.\n",
+			movie_path);
+		close_movie(&m);
+		return EXIT_FAILURE;
+	}
+	seed_rng(&c, m.seed);
+
+	Engine engine;
+	if (init_engine(&engine, engine_kind) != 0) {
+		printf("ERROR: Unable to initialize the %s engine.\n",
+			ENGINE_NAMES[engine_kind]);
+		close_movie(&m);
+		return EXIT_FAILURE;
+	}
+	engine.skip_idle = skip_idle;
+
+	// The reference never skips idle loops, so that skipping is verified too
+	Chip8 ref = c;
+	Engine ref_engine;
+	if (verify) {
+		init_engine(&ref_engine, ENGINE_INTERP);
+		ref_engine.skip_idle = 0;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	long executed = 0;
+	long cycles_owed = 0;
+	long frame;
+	for (frame = 0; frame < m.num_frames; frame++) {
+		POLL_PROFILE();
+		cycles_owed += m.rate;
+		long burst = cycles_owed / TIMER_RATE;
+		cycles_owed %= TIMER_RATE;
+
+		c.keys = m.keys[frame];
+		if (c.start_wait && c.keys) {
+			c.end_wait = 1;
+		}
+		executed += run_engine(&engine, &c, burst);
+
+		if (verify) {
+			ref.keys = m.keys[frame];
+			if (ref.start_wait && ref.keys) {
+				ref.end_wait = 1;
+			}
+			run_engine(&ref_engine, &ref, burst);
+			if (!same_state(&c, &ref)) {
+				printf("ERROR: %s engine diverged from the interpreter in "
+					"frame %ld.\n", ENGINE_NAMES[engine_kind], frame);
+				printf("\n--- %s ---\n", ENGINE_NAMES[engine_kind]);
+				dump_state(&c);
+				printf("\n--- interp ---\n");
+				dump_state(&ref);
+				return EXIT_FAILURE;
+			}
+		}
+
+		// The frontend stops at a fault, before the timers are ticked
+		if (c.fault != CHIP8_OK) {
+			break;
+		}
+		tick_timers(&c);
+		tick_timers(&ref);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("frames=%ld/%ld cycles=%ld skipped=%ld hash=%016llx time=%.6fs "
+		"(%.0fx real time)\n", frame, m.num_frames, executed,
+		engine.idle_skipped, (unsigned long long)hash_state(&c), elapsed,
+		elapsed > 0 ? frame / (double)TIMER_RATE / elapsed : 0);
+	if (c.fault != CHIP8_OK) {
+		printf("ERROR: %s (0x%04X at 0x%03X).\n",
+			chip8_status_message(c.fault), fetch_instr(&c), c.PC);
+	}
+	dump_state(&c);
+	close_engine(&engine);
+	if (verify) {
+		close_engine(&ref_engine);
+	}
+	close_movie(&m);
+
+	return c.fault == CHIP8_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage(const char *prog) {
+	printf("Usage: %s {PATH_TO_ROM} [--cycles N | --frames N] [--rate HZ] "
+		"[--engine NAME] [--keys MASK] [--seed N] [--verify] [--lanes N] "
+		"[--replay MOVIE] [--no-idle-skip] [--aot]\n", prog);
+	printf("Engines:");
+	for (int i = 0; i < NUM_ENGINES; i++) {
+		printf(" %s", ENGINE_NAMES[i]);
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	// The headless runner executes a ROM as fast as the host allows for a
+	// fixed budget of instructions (or 60 Hz frames) and then dumps the final
+	// state. There is no display, no sound and no keyboard. Keys can be held
+	// down for the whole run with --keys (bit k of the mask is key k); without
+	// it, a ROM waiting for a key press simply idles until the budget runs out.
+	// Random numbers are drawn from a generator seeded with --seed (0 by
+	// default), so runs are reproducible. With --lanes, that many copies of
+	// the ROM run on the lockstep engine (copy i seeded with seed + i). With
+	// --replay, a movie recorded by the SDL frontend is replayed instead (with
+	// its own keys, seed and clock rate). With --aot, the ROM runs as the
+	// program it was recompiled to at build time (aot.h) instead of on an
+	// engine.
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	long cycles = -1;
+	long frames = -1;
+	long rate = DEFAULT_CLOCK_RATE;
+	int engine_kind = ENGINE_CACHE;
+	int verify = 0;
+	uint16_t keys = 0;
+	uint64_t seed = DEFAULT_SEED;
+	int lanes = 0;
+	const char *movie_path = NULL;
+	int skip_idle = 1;
+	int use_aot = 0;
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--verify") == 0) {
+			verify = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--no-idle-skip") == 0) {
+			skip_idle = 0;
+			continue;
+		}
+		if (strcmp(argv[i], "--aot") == 0) {
+			use_aot = 1;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			printf("ERROR: Missing value for option '%s'.\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		if (strcmp(argv[i], "--cycles") == 0) {
+			cycles = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--frames") == 0) {
+			frames = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--rate") == 0) {
+			rate = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--lanes") == 0) {
+			lanes = atoi(argv[++i]);
+			if (lanes <= 0) {
+				printf("ERROR: Lane count must be positive.\n");
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "--keys") == 0) {
+			keys = strtol(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--replay") == 0) {
+			movie_path = argv[++i];
+		} else if (strcmp(argv[i], "--seed") == 0) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--engine") == 0) {
+			engine_kind = get_engine_from_name(argv[++i]);
+			if (engine_kind < 0) {
+				printf("ERROR: Unknown engine '%s'.\n", argv[i]);
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else {
+			printf("ERROR: Unknown option '%s'.\n", argv[i]);
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (rate <= 0) {
+		printf("ERROR: Clock rate must be positive.\n");
+		return EXIT_FAILURE;
+	}
+
+	// The timers tick at 60 Hz whatever the clock rate, so a frame runs
+	// rate / TIMER_RATE instructions, with the remainder carried over to the
+	// next frame like main does. A budget of frames is the sum of those.
+	if (cycles < 0) {
+		cycles = (frames < 0 ? TIMER_RATE : frames) * rate / TIMER_RATE;
+	}
+
+	// In a CHIP8_PROFILE build, the handler histogram is printed at exit
+	INIT_PROFILE();
+
+	if (use_aot && (movie_path != NULL || lanes > 0)) {
+		printf("ERROR: --aot cannot be combined with --replay or --lanes.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (movie_path != NULL) {
+		if (lanes > 0) {
+			printf("ERROR: --replay cannot be combined with --lanes.\n");
+			return EXIT_FAILURE;
+		}
+		return run_replay(argv[1], movie_path, engine_kind, skip_idle,
+			verify);
+	}
+
+	if (lanes > 0) {
+		return run_lanes(argv[1], lanes, cycles, rate, keys, seed, verify);
+	}
+
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t size;
+	Chip8 c;
+	init_sys(&c);
+	Chip8Status status = read_rom_file(argv[1], rom, &size);
+	if (status == CHIP8_OK) {
+		status = load_rom(&c, rom, size);
+	}
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to load ROM '%s': %s.\n", argv[1],
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+	const AotProgram *aot = NULL;
+	if (use_aot) {
+		aot = find_aot_program(rom, size);
+		if (aot == NULL) {
+			printf("ERROR: No recompiled program for ROM '%s'.\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+	const char *engine_name = aot ? "aot" : ENGINE_NAMES[engine_kind];
+	c.keys = keys;
+	seed_rng(&c, seed);
+
+	Engine engine;
+	if (init_engine(&engine, engine_kind) != 0) {
+		printf("ERROR: Unable to initialize the %s engine.\n",
+			ENGINE_NAMES[engine_kind]);
+		return EXIT_FAILURE;
+	}
+	engine.skip_idle = skip_idle;
+	precompile_engine(&engine, &c);
+
+	// In verify mode, a second machine runs the same program with the plain
+	// interpreter and both states are compared after every burst. It starts
+	// with the same random number generator, so both draw the same numbers.
+	// It never skips idle loops, so that skipping is verified as well.
+	Chip8 ref = c;
+	Engine ref_engine;
+	if (verify) {
+		init_engine(&ref_engine, ENGINE_INTERP);
+		ref_engine.skip_idle = 0;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	long executed = 0;
+	long frame = 0;
+	long cycles_owed = 0;
+	while (executed < cycles) {
+		POLL_PROFILE();
+
+		// Run up to the next timer tick (or the end of the budget)
+		cycles_owed += rate;
+		long frame_cycles = cycles_owed / TIMER_RATE;
+		cycles_owed %= TIMER_RATE;
+		long burst = frame_cycles;
+		if (burst > cycles - executed) {
+			burst = cycles - executed;
+		}
+
+		// Like the SDL frontend, a wait for a key press ends at the start of
+		// a frame if a key is held down. Otherwise, the remaining cycles of
+		// the frame are spent idle.
+		if (c.start_wait && c.keys) {
+			c.end_wait = 1;
+		}
+		if (ref.start_wait && ref.keys) {
+			ref.end_wait = 1;
+		}
+		long ran = aot ? aot->run(&c, burst) : run_engine(&engine, &c, burst);
+
+		if (verify) {
+			run_engine(&ref_engine, &ref, burst);
+			if (!same_state(&c, &ref)) {
+				printf("ERROR: %s engine diverged from the interpreter "
+					"between cycles %ld and %ld.\n", engine_name, executed,
+					executed + burst);
+				printf("\n--- %s ---\n", engine_name);
+				dump_state(&c);
+				printf("\n--- interp ---\n");
+				dump_state(&ref);
+				return EXIT_FAILURE;
+			}
+		}
+
+		// A fault stops the machine for good
+		if (c.fault != CHIP8_OK) {
+			executed += ran;
+			break;
+		}
+
+		executed += burst;
+
+		if (burst == frame_cycles) {
+			tick_timers(&c);
+			tick_timers(&ref);
+			frame++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("cycles=%ld frames=%ld skipped=%ld time=%.6fs%s\n", executed,
+		frame, engine.idle_skipped, elapsed,
+		c.start_wait ? " (waiting for key)" : "");
+	if (c.fault != CHIP8_OK) {
+		printf("ERROR: %s (0x%04X at 0x%03X).\n",
+			chip8_status_message(c.fault), fetch_instr(&c), c.PC);
+	}
+	dump_state(&c);
+	close_engine(&engine);
+	if (verify) {
+		close_engine(&ref_engine);
+	}
+
+	return c.fault == CHIP8_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,77 @@
+#include <string.h>
+
+#include "icache.h"
+#include "profile.h"
+
+void init_icache(ICache *ic) {
+	memset(ic->entries, 0, sizeof(ic->entries));
+}
+
+// Drop the decoded entries of every page set in the mask. The instruction
+// starting at the last byte of the previous page also reads the first byte of
+// the page, so it is dropped as well.
+void flush_icache(ICache *ic, uint16_t pages) {
+	for (int p = 0; p < NUM_PAGES; p++) {
+		if (!(pages & (1 << p))) {
+			continue;
+		}
+
+		int start = p * PAGE_SIZE - 1;
+		int end = start + PAGE_SIZE;
+		if (start < RAM_START_ADDR) {
+			start = RAM_START_ADDR;
+		}
+
+		for (int addr = start; addr <= end && addr <= RAM_END_ADDR; addr++) {
+			ic->entries[addr - RAM_START_ADDR].exec = NULL;
+		}
+	}
+}
+
+// Decode every instruction the analysis found up front, so that reachable
+// code does not pay for decoding when it first runs. Pending stores are
+// consumed first, like run_icache does, so the entries are not dropped.
+void precompile_icache(ICache *ic, Chip8 *c, const Cfg *cfg) {
+	if (c->dirty_pages) {
+		flush_icache(ic, c->dirty_pages);
+		c->dirty_pages = 0;
+	}
+
+	for (int addr = RAM_START_ADDR; addr < RAM_END_ADDR; addr++) {
+		if (cfg->flags[addr] & CFG_CODE) {
+			decd_instr(c->mem[addr] << 8 | c->mem[addr + 1],
+				&ic->entries[addr - RAM_START_ADDR]);
+		}
+	}
+}
+
+// Execute up to the given number of instructions, decoding each address only
+// the first time it is reached. Stops early when the program starts waiting
+// for a key press or faults. Returns the number of instructions executed.
+long run_icache(ICache *ic, Chip8 *c, long cycles) {
+	long n = 0;
+	for (; n < cycles && !is_stopped(c); n++) {
+		// Stores from the previous instruction (or outside of execution, such
+		// as load_rom) invalidate the pages they touched
+		if (c->dirty_pages) {
+			flush_icache(ic, c->dirty_pages);
+			c->dirty_pages = 0;
+		}
+
+		uint16_t pc = c->PC;
+		if (pc < RAM_START_ADDR || pc >= RAM_END_ADDR) {
+			decd_and_exec_instr(c, fetch_instr(c));
+			continue;
+		}
+
+		Instr *in = &ic->entries[pc - RAM_START_ADDR];
+		if (in->exec == NULL) {
+			decd_instr(fetch_instr(c), in);
+		}
+
+		c->PC += 2;
+		PROFILE_EXEC(c, in);
+	}
+
+	return n;
+}
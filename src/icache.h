@@ -0,0 +1,27 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+#include "disasm.h"
+#include "instructions.h"
+
+// One entry per byte address of RAM (instructions are not required to be
+// aligned, so a jump to an odd address is valid)
+#define ICACHE_SIZE (RAM_END_ADDR - RAM_START_ADDR + 1)
+
+typedef struct ICache ICache;
+
+// Decoded instruction cache covering 0x200-0xFFF. Entries are decoded lazily
+// on first execution; an entry with a NULL handler has not been decoded yet.
+struct ICache {
+	Instr entries[ICACHE_SIZE];
+};
+
+void init_icache(ICache *ic);
+void flush_icache(ICache *ic, uint16_t pages);
+void precompile_icache(ICache *ic, Chip8 *c, const Cfg *cfg);
+long run_icache(ICache *ic, Chip8 *c, long cycles);
+
+#endif
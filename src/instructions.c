@@ -5,45 +5,33 @@
 #include "chip8.h"
 
 
-// GETTERS
-
-
-uint8_t get_x(uint16_t instr) {
-    return (instr & X_MASK) >> 8;
-}
-
-uint8_t get_y(uint16_t instr) {
-    return (instr & Y_MASK) >> 4;
-}
-
-uint8_t get_n(uint16_t instr) {
-    return instr & N_MASK;
-}
+// INSTRUCTIONS
 
-uint8_t get_nn(uint16_t instr) {
-    return instr & NN_MASK;
-}
 
-uint16_t get_nnn(uint16_t instr) {
-    return instr & NNN_MASK;
+// Handler for opcodes that do not map to any instruction
+void invalid(Chip8 *c, const Instr *in) {
+    (void)in;
+    c->fault = CHIP8_ERR_INVALID_INSTR;
+    c->PC -= 2;
 }
 
-
-// INSTRUCTIONS
-
-
 // Clear screen
-void cls(Chip8 *c) {
-    for (int i = FRAME_BUFFER_START_ADDR; i <= FRAME_BUFFER_END_ADDR; i++) {
-        c->mem[i] = 0;
+void cls(Chip8 *c, const Instr *in) {
+    (void)in;
+    for (int i = 0; i < SCREEN_HEIGHT; i++) {
+        c->fb[i] = 0;
     }
+    c->dirty_rows = ALL_ROWS;
+    c->update_screen = 1;
 }
 
 // Return from subroutine
-void ret(Chip8 *c) {
+void ret(Chip8 *c, const Instr *in) {
+    (void)in;
     if (c->SP == STACK_START_ADDR) {
-        printf("ERROR: Stack underflow.\n");
-        exit(EXIT_FAILURE);
+        c->fault = CHIP8_ERR_STACK_UNDERFLOW;
+        c->PC -= 2;
+        return;
     }
 
     c->SP -= 2;
@@ -53,284 +41,213 @@ void ret(Chip8 *c) {
 }
 
 // Jump to memory address nnn
-void jmp_nnn(Chip8 *c, uint16_t instr) {
-    uint16_t nnn = get_nnn(instr);
-    c->PC = nnn;
+void jmp_nnn(Chip8 *c, const Instr *in) {
+    c->PC = in->nnn;
 }
 
 // Call subroutine at address nnn
-void call_nnn(Chip8 *c, uint16_t instr) {
+void call_nnn(Chip8 *c, const Instr *in) {
     if (c->SP > STACK_END_ADDR) {
-        printf("ERROR: Stack Overflow.\n");
-        exit(EXIT_FAILURE);
+        c->fault = CHIP8_ERR_STACK_OVERFLOW;
+        c->PC -= 2;
+        return;
     }
 
     uint8_t msb = (c->PC & 0xFF00) >> 8;
     uint8_t lsb = (c->PC & 0x00FF);
-    
-    c->mem[c->SP] = msb;
-    c->mem[c->SP + 1] = lsb;
+
+    write_mem(c, c->SP, msb);
+    write_mem(c, c->SP + 1, lsb);
     c->SP += 2;
-    c->PC = get_nnn(instr);
+    c->PC = in->nnn;
 }
 
 // Skip next instruction if Vx = nn
-void se_Vx_nn(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t nn = get_nn(instr);
-
-    if (c->V[x] == nn) {
+void se_Vx_nn(Chip8 *c, const Instr *in) {
+    if (c->V[in->x] == in->nn) {
         c->PC += 2;
     }
 }
 
 // Skip next instruction if Vx != nn
-void sne_Vx_nn(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t nn = get_nn(instr);
-
-    if (c->V[x] != nn) {
+void sne_Vx_nn(Chip8 *c, const Instr *in) {
+    if (c->V[in->x] != in->nn) {
         c->PC += 2;
     }
 }
 
 // Skip next instruction if Vx = Vy
-void se_Vx_Vy(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-
-    if (c->V[x] == c->V[y]) {
+void se_Vx_Vy(Chip8 *c, const Instr *in) {
+    if (c->V[in->x] == c->V[in->y]) {
         c->PC += 2;
     }
 }
 
 // Load nn into Vx
-void ld_Vx_nn(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t nn = get_nn(instr);
-    c->V[x] = nn;
+void ld_Vx_nn(Chip8 *c, const Instr *in) {
+    c->V[in->x] = in->nn;
 }
 
 // Load Vx + nn into Vx
-void add_Vx_nn(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t nn = get_nn(instr);
-    c->V[x] += nn;
+void add_Vx_nn(Chip8 *c, const Instr *in) {
+    c->V[in->x] += in->nn;
 }
 
 // Load Vy into Vx
-void ld_Vx_Vy(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-    c->V[x] = c->V[y];
+void ld_Vx_Vy(Chip8 *c, const Instr *in) {
+    c->V[in->x] = c->V[in->y];
 }
 
 // Load Vx OR Vy into Vx
-void bor(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-
-    c->V[x] |= c->V[y];
+void bor(Chip8 *c, const Instr *in) {
+    c->V[in->x] |= c->V[in->y];
 }
 
 // Load Vx AND Vy into Vx
-void band(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-
-    c->V[x] &= c->V[y];
+void band(Chip8 *c, const Instr *in) {
+    c->V[in->x] &= c->V[in->y];
 }
 
 // Load Vx XOR Vy into Vx
-void bxor(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-
-    c->V[x] ^= c->V[y];
+void bxor(Chip8 *c, const Instr *in) {
+    c->V[in->x] ^= c->V[in->y];
 }
 
 // Load Vx + Vy into Vx and load the carry bit into VF
-void add_Vx_Vy(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-
-    uint16_t res = c->V[x] + c->V[y];
-    c->V[x] = res;
+void add_Vx_Vy(Chip8 *c, const Instr *in) {
+    uint16_t res = c->V[in->x] + c->V[in->y];
+    c->V[in->x] = res;
     c->V[0xF] = res > 255 ? 1 : 0;
 }
 
-// Load Vx - Vy into Vx 
+// Load Vx - Vy into Vx
 // If Vx > Vy, load 1 into VF, else 0
-void sub(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-
-    uint8_t flag = c->V[x] > c->V[y] ? 1 : 0;
-    c->V[x] -= c->V[y];
+void sub(Chip8 *c, const Instr *in) {
+    uint8_t flag = c->V[in->x] > c->V[in->y] ? 1 : 0;
+    c->V[in->x] -= c->V[in->y];
     c->V[0xF] = flag;
 }
 
 // Load Vx >> 1 into Vx
-void shr(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    c->V[x] >>= 1;
+void shr(Chip8 *c, const Instr *in) {
+    c->V[in->x] >>= 1;
 }
 
 // Load Vy - Vx into Vx
 // If Vy > Vx, load 1 into VF, else 0
-void subn(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-
-    uint8_t flag = c->V[y] > c->V[x] ? 1 : 0;
-    c->V[x] = c->V[y] - c->V[x];
+void subn(Chip8 *c, const Instr *in) {
+    uint8_t flag = c->V[in->y] > c->V[in->x] ? 1 : 0;
+    c->V[in->x] = c->V[in->y] - c->V[in->x];
     c->V[0xF] = flag;
 }
 
 // Load Vx << 1 into Vx
-void shl(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    c->V[x] <<= 1;
+void shl(Chip8 *c, const Instr *in) {
+    c->V[in->x] <<= 1;
 }
 
 // Skip next instruction if Vx != Vy
-void sne_Vx_Vy(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-
-    if (c->V[x] != c->V[y]) {
+void sne_Vx_Vy(Chip8 *c, const Instr *in) {
+    if (c->V[in->x] != c->V[in->y]) {
         c->PC += 2;
     }
 }
 
 // Load nnn into I
-void ld_I_nnn(Chip8* c, uint16_t instr) {
-    uint16_t nnn = get_nnn(instr);
-    c->I = nnn;
+void ld_I_nnn(Chip8* c, const Instr *in) {
+    c->I = in->nnn;
 }
 
 // Jump to memory address V0 + nnn
-void jmp_V0_nnn(Chip8 *c, uint16_t instr) {
-    uint16_t nnn = get_nnn(instr);
-    c->PC = c->V[0] + nnn;
+void jmp_V0_nnn(Chip8 *c, const Instr *in) {
+    c->PC = c->V[0] + in->nnn;
 }
 
 // Load random byte & nn into Vx
-void rnd(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t nn = get_nn(instr);
-
-    uint8_t rnd_byte = rand();
-    c->V[x] = rnd_byte & nn;
+void rnd(Chip8 *c, const Instr *in) {
+    uint8_t rnd_byte = next_random(c);
+    c->V[in->x] = rnd_byte & in->nn;
 }
 
 // Draw n-byte sprite at (Vx, Vy)
-void drw(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    uint8_t y = get_y(instr);
-    uint8_t n = get_n(instr);
-
-    // Reset VF to 0
-    c->V[0xF] = 0;
-
-    int x_coord = c->V[x];
-    int y_coord = c->V[y];
-
-    for (int i = 0; i < n; i++) {
-        uint8_t sprite = c->mem[c->I + i];
-
-        // The address of the byte (in the frame buffer) to change can be
-        // computed from the x and y coordinates. We can also compute the exact
-        // pixel offset by taking modulo 8 of the x coordinate.
-        uint16_t y_offset = (y_coord + i) * 8; // byte offset
-        uint16_t x_byte_offset = x_coord / 8;
-        uint16_t x_pixel_offset = x_coord % 8;
-        uint16_t byte_addr = FRAME_BUFFER_START_ADDR + y_offset + x_byte_offset;
-
-        // The position of the sprite is not guaranteed to be at the start of
-        // the byte. And since sprites are one byte in width, the width of a
-        // sprite can span two bytes in the frame buffer.
-        // Therefore, we need to apply the following operation twice, once to
-        // the byte at byte_addr and once to the byte following it.
-        // Additionally, we need to compute which of the 8 bits of the sprite
-        // affect the first byte, and which of them affect the second byte.
-
-        uint8_t sprite_mask = sprite >> x_pixel_offset;
-        uint8_t *frame_byte = &c->mem[byte_addr];
-        for (int j = 0; j < 8; j++) {
-            if (sprite_mask & 0x80) {
-                *frame_byte ^= 0x80 >> j;
-                int new = *frame_byte & (0x80 >> j);
-                if (!new) {
-                    c->V[0xF] = 1;
-                }
-
-            }
-
-            sprite_mask <<= 1;
-        }
+void drw(Chip8 *c, const Instr *in) {
+    // The starting position wraps around the screen, but the sprite itself is
+    // clipped at the right and bottom edges
+    int x_coord = c->V[in->x] % SCREEN_WIDTH;
+    int y_coord = c->V[in->y] % SCREEN_HEIGHT;
+
+    int rows = in->n;
+    if (rows > SCREEN_HEIGHT - y_coord) {
+        rows = SCREEN_HEIGHT - y_coord;
+    }
 
-        sprite_mask = sprite << (8 - x_pixel_offset);
-        frame_byte += 1;
-        for (int j = 0; j < 8; j++) {
-            if (sprite_mask & 0x80) {
-                *frame_byte ^= 0x80 >> j;
-                int new = *frame_byte & (0x80 >> j);
-                if (!new) {
-                    c->V[0xF] = 1;
-                }
-            }
-
-            sprite_mask <<= 1;
-        }
+    // Each sprite row is moved to the top byte of a 64-bit word and shifted
+    // right to its x position, pixels past the right edge fall off the end.
+    // A pixel is erased (collision) when it is set both in the sprite and in
+    // the row, which is checked for the whole row with a single AND.
+    uint64_t collision = 0;
+    uint64_t *row = &c->fb[y_coord];
+    for (int i = 0; i < rows; i++) {
+        uint64_t sprite = (uint64_t)read_mem(c, c->I + i) << 56 >> x_coord;
+        collision |= row[i] & sprite;
+        row[i] ^= sprite;
     }
 
+    c->V[0xF] = collision != 0;
+    c->dirty_rows |= (uint32_t)((1ull << rows) - 1) << y_coord;
+
     // Set update screen flag
     c->update_screen = 1;
 }
 
 // Skip next instruction if key with the value Vx is pressed
-void skp(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    if (c->key_down == c->V[x]) {
+void skp(Chip8 *c, const Instr *in) {
+    if (is_key_down(c, c->V[in->x])) {
         c->PC += 2;
     }
 }
 
 // Skip next instruction if key with the value Vx is not pressed
-void skpn(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    if (c->key_down != c->V[x]) {
+void skpn(Chip8 *c, const Instr *in) {
+    if (!is_key_down(c, c->V[in->x])) {
         c->PC += 2;
     }
 }
 
 // Load DT into Vx
-void ld_Vx_DT(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    c->V[x] = c->DT;
+void ld_Vx_DT(Chip8 *c, const Instr *in) {
+    c->V[in->x] = c->DT;
 }
 
 // Load the value of the next key press into Vx
-void ld_Vx_k(Chip8 *c, uint16_t instr) {
+void ld_Vx_k(Chip8 *c, const Instr *in) {
     // This instruction will be executed twice, the first time to start the
     // wait period and the second time when a key is pressed (wait period ends)
 
     // If we haven't started the wait period, then this is the first time this
     // instruction is called and so we start the wait period (for the key press)
-    // PC is decremented by 2 to set it back to this instruction since we 
+    // PC is decremented by 2 to set it back to this instruction since we
     // incremented it by 2 at the start of decd_and_exec_instr
 
-    // If we have ended the wait period, then this is the second time this 
-    // instruction is executed and we can go ahead with the operation (since we 
-    // now have our valid key press)
+    // If we have ended the wait period, then this is the second time this
+    // instruction is executed and we can go ahead with the operation (since we
+    // now have our valid key press). If several keys are held down, the
+    // lowest one is loaded. If the key was released before the instruction
+    // got to run again (a frame can end the wait and run no instructions at
+    // low clock rates), the wait goes on.
 
     if (!c->start_wait) {
         c->start_wait = 1;
         c->PC -= 2;
-    } else if (c->end_wait) { 
-        uint8_t x = get_x(instr);
-        c->V[x] = c->key_down;
+    } else if (c->end_wait && c->keys == 0) {
+        c->end_wait = 0;
+        c->PC -= 2;
+    } else if (c->end_wait) {
+        uint8_t key = 0;
+        while (key < 15 && !(c->keys & (1 << key))) {
+            key++;
+        }
+        c->V[in->x] = key;
 
         c->start_wait = 0;
         c->end_wait = 0;
@@ -338,55 +255,49 @@ void ld_Vx_k(Chip8 *c, uint16_t instr) {
 }
 
 // Load Vx into DT
-void ld_DT_Vx(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    c->DT = c->V[x];
+void ld_DT_Vx(Chip8 *c, const Instr *in) {
+    c->DT = c->V[in->x];
 }
 
 // Load Vx into ST
-void ld_ST_Vx(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    c->ST = c->V[x];
+void ld_ST_Vx(Chip8 *c, const Instr *in) {
+    c->ST = c->V[in->x];
 }
 
 // Load I + Vx into I
-void add_I_Vx(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    c->I += c->V[x];
+void add_I_Vx(Chip8 *c, const Instr *in) {
+    c->I += c->V[in->x];
 }
 
 // Load the memory address of the sprite that represents f into I
-void ld_I_f(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    c->I = FONTSET_START_ADDR + 5 * c->V[x];
+void ld_I_f(Chip8 *c, const Instr *in) {
+    c->I = FONTSET_START_ADDR + 5 * c->V[in->x];
 }
 
 // Load:
     // the hundreds digit of x into location at I
     // the tens digit of x into location at I + 1
     // the ones digit of x into location at I + 2
-void ld_I_b(Chip8 *c, uint16_t instr) {
-    uint8_t Vx = c->V[get_x(instr)];
-    c->mem[c->I] = Vx / 100;
+void ld_I_b(Chip8 *c, const Instr *in) {
+    uint8_t Vx = c->V[in->x];
+    write_mem(c, c->I, Vx / 100);
     Vx %= 100;
-    c->mem[c->I + 1] = Vx / 10;
+    write_mem(c, c->I + 1, Vx / 10);
     Vx %= 10;
-    c->mem[c->I + 2] = Vx;
+    write_mem(c, c->I + 2, Vx);
 }
 
 // Load into I, I + 1, ... I + x the values from registers V0, V1, ... Vx
-void ld_I_from_reg(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    for (int i = 0; i <= x; i++) {
-        c->mem[c->I + i] = c->V[i];
+void ld_I_from_reg(Chip8 *c, const Instr *in) {
+    for (int i = 0; i <= in->x; i++) {
+        write_mem(c, c->I + i, c->V[i]);
     }
 }
 
 // Load into V0, V1, ... Vx the values from memory locations I, I + 1, ... I + x
-void ld_V_from_mem(Chip8 *c, uint16_t instr) {
-    uint8_t x = get_x(instr);
-    for (int i = 0; i <= x; i++) {
-        c->V[i] = c->mem[c->I + i];
+void ld_V_from_mem(Chip8 *c, const Instr *in) {
+    for (int i = 0; i <= in->x; i++) {
+        c->V[i] = read_mem(c, c->I + i);
     }
 }
 
@@ -3,47 +3,87 @@
 
 #include <stdint.h>
 
+#define OPCODE_MASK 0xF000
+#define X_MASK 0x0F00
+#define Y_MASK 0x00F0
+#define N_MASK 0x000F
+#define NN_MASK 0x00FF
+#define NNN_MASK 0x0FFF
+
 typedef struct Chip8 Chip8;
+typedef struct Instr Instr;
+
+typedef void (*InstrHandler)(Chip8 *c, const Instr *in);
+
+// A decoded instruction: the handler that executes it and its operands,
+// extracted once at decode time so handlers never have to mask the raw opcode.
+struct Instr {
+	InstrHandler exec;
+	uint16_t raw;
+	uint16_t nnn;
+	uint8_t x;
+	uint8_t y;
+	uint8_t n;
+	uint8_t nn;
+#ifdef CHIP8_PROFILE
+	uint8_t op; // Id of the handler in the profile (profile.h)
+#endif
+};
+
+static inline uint8_t get_x(uint16_t instr) {
+	return (instr & X_MASK) >> 8;
+}
+
+static inline uint8_t get_y(uint16_t instr) {
+	return (instr & Y_MASK) >> 4;
+}
+
+static inline uint8_t get_n(uint16_t instr) {
+	return instr & N_MASK;
+}
+
+static inline uint8_t get_nn(uint16_t instr) {
+	return instr & NN_MASK;
+}
+
+static inline uint16_t get_nnn(uint16_t instr) {
+	return instr & NNN_MASK;
+}
+
+void invalid(Chip8 *c, const Instr *in);
+void cls(Chip8 *c, const Instr *in);
+void ret(Chip8 *c, const Instr *in);
+void jmp_nnn(Chip8 *c, const Instr *in);
+void call_nnn(Chip8 *c, const Instr *in);
+void se_Vx_nn(Chip8 *c, const Instr *in);
+void sne_Vx_nn(Chip8 *c, const Instr *in);
+void se_Vx_Vy(Chip8 *c, const Instr *in);
+void ld_Vx_nn(Chip8 *c, const Instr *in);
+void add_Vx_nn(Chip8 *c, const Instr *in);
+void ld_Vx_Vy(Chip8 *c, const Instr *in);
+void bor(Chip8 *c, const Instr *in);
+void band(Chip8 *c, const Instr *in);
+void bxor(Chip8 *c, const Instr *in);
+void add_Vx_Vy(Chip8 *c, const Instr *in);
+void sub(Chip8 *c, const Instr *in);
+void shr(Chip8 *c, const Instr *in);
+void subn(Chip8 *c, const Instr *in);
+void shl(Chip8 *c, const Instr *in);
+void sne_Vx_Vy(Chip8 *c, const Instr *in);
+void ld_I_nnn(Chip8* c, const Instr *in);
+void jmp_V0_nnn(Chip8 *c, const Instr *in);
+void rnd(Chip8 *c, const Instr *in);
+void drw(Chip8 *c, const Instr *in);
+void skp(Chip8 *c, const Instr *in);
+void skpn(Chip8 *c, const Instr *in);
+void ld_Vx_DT(Chip8 *c, const Instr *in);
+void ld_Vx_k(Chip8 *c, const Instr *in);
+void ld_DT_Vx(Chip8 *c, const Instr *in);
+void ld_ST_Vx(Chip8 *c, const Instr *in);
+void add_I_Vx(Chip8 *c, const Instr *in);
+void ld_I_f(Chip8 *c, const Instr *in);
+void ld_I_b(Chip8 *c, const Instr *in);
+void ld_I_from_reg(Chip8 *c, const Instr *in);
+void ld_V_from_mem(Chip8 *c, const Instr *in);
 
-uint8_t get_x(uint16_t instr);
-uint8_t get_y(uint16_t instr);
-uint8_t get_n(uint16_t instr);
-uint8_t get_nn(uint16_t instr);
-uint16_t get_nnn(uint16_t instr);
-
-void cls(Chip8 *c);
-void ret(Chip8 *c);
-void jmp_nnn(Chip8 *c, uint16_t instr);
-void call_nnn(Chip8 *c, uint16_t instr);
-void se_Vx_nn(Chip8 *c, uint16_t instr);
-void sne_Vx_nn(Chip8 *c, uint16_t instr);
-void se_Vx_Vy(Chip8 *c, uint16_t instr);
-void ld_Vx_nn(Chip8 *c, uint16_t instr);
-void add_Vx_nn(Chip8 *c, uint16_t instr);
-void ld_Vx_Vy(Chip8 *c, uint16_t instr);
-void bor(Chip8 *c, uint16_t instr);
-void band(Chip8 *c, uint16_t instr);
-void bxor(Chip8 *c, uint16_t instr);
-void add_Vx_Vy(Chip8 *c, uint16_t instr);
-void sub(Chip8 *c, uint16_t instr);
-void shr(Chip8 *c, uint16_t instr);
-void subn(Chip8 *c, uint16_t instr);
-void shl(Chip8 *c, uint16_t instr);
-void sne_Vx_Vy(Chip8 *c, uint16_t instr);
-void ld_I_nnn(Chip8* c, uint16_t instr);
-void jmp_V0_nnn(Chip8 *c, uint16_t instr);
-void rnd(Chip8 *c, uint16_t instr);
-void drw(Chip8 *c, uint16_t instr);
-void skp(Chip8 *c, uint16_t instr);
-void skpn(Chip8 *c, uint16_t instr);
-void ld_Vx_DT(Chip8 *c, uint16_t instr);
-void ld_Vx_k(Chip8 *c, uint16_t instr);
-void ld_DT_Vx(Chip8 *c, uint16_t instr);
-void ld_ST_Vx(Chip8 *c, uint16_t instr);
-void add_I_Vx(Chip8 *c, uint16_t instr);
-void ld_I_f(Chip8 *c, uint16_t instr);
-void ld_I_b(Chip8 *c, uint16_t instr);
-void ld_I_from_reg(Chip8 *c, uint16_t instr);
-void ld_V_from_mem(Chip8 *c, uint16_t instr);
-
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,546 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "jit.h"
+
+#if JIT_SUPPORTED
+
+#include <sys/mman.h>
+
+// Register assignment of compiled code:
+//   rbx  Chip8 *c (V[], DT, ST, ... are addressed relative to it)
+//   r12  Remaining cycle budget
+//   r13  I
+// PC is a constant of every compiled instruction and is only written back
+// to c->PC when control leaves native code or a handler is called.
+//
+// Compiled code is entered through the trampoline, which returns the remaining
+// budget in rax and, when the exit can be linked to the block of the new PC,
+// the address of the rel32 field to patch in rdx.
+
+#define OFF_V(x) ((int32_t)(offsetof(Chip8, V) + (x)))
+#define OFF_DT ((int32_t)offsetof(Chip8, DT))
+#define OFF_ST ((int32_t)offsetof(Chip8, ST))
+#define OFF_PC ((int32_t)offsetof(Chip8, PC))
+#define OFF_I ((int32_t)offsetof(Chip8, I))
+#define OFF_KEYS ((int32_t)offsetof(Chip8, keys))
+#define OFF_FAULT ((int32_t)offsetof(Chip8, fault))
+
+// Byte registers used as operands
+#define AL 0
+#define CL 1
+#define DL 2
+
+// Worst case size of a compiled instruction, including its exits
+#define MAX_INSTR_CODE 128
+
+typedef struct JitResult {
+	long budget;
+	uint8_t *patch;
+} JitResult;
+
+typedef JitResult (*JitEntry)(Chip8 *c, uint8_t *code, long budget);
+
+static void emit8(Jit *j, uint8_t b) {
+	*j->code_ptr++ = b;
+}
+
+static void emit32(Jit *j, uint32_t v) {
+	memcpy(j->code_ptr, &v, 4);
+	j->code_ptr += 4;
+}
+
+static void emit64(Jit *j, uint64_t v) {
+	memcpy(j->code_ptr, &v, 8);
+	j->code_ptr += 8;
+}
+
+// ModRM + disp32 for [rbx + off] with the given reg field
+static void emit_rbx(Jit *j, int reg, int32_t off) {
+	emit8(j, 0x80 | (reg << 3) | 3);
+	emit32(j, off);
+}
+
+// Patch the rel32 field at site to jump to target
+static void patch_rel32(uint8_t *site, uint8_t *target) {
+	int32_t rel = (int32_t)(target - (site + 4));
+	memcpy(site, &rel, 4);
+}
+
+// Emit a jcc/jmp with a rel32 to be patched later, returns the field address
+static uint8_t *emit_jcc(Jit *j, uint8_t cc) {
+	emit8(j, 0x0F);
+	emit8(j, cc);
+	uint8_t *site = j->code_ptr;
+	emit32(j, 0);
+	return site;
+}
+
+static uint8_t *emit_jmp(Jit *j) {
+	emit8(j, 0xE9);
+	uint8_t *site = j->code_ptr;
+	emit32(j, 0);
+	return site;
+}
+
+static void emit_load_byte(Jit *j, int reg, int32_t off) {
+	emit8(j, 0x8A); // mov r8, [rbx + off]
+	emit_rbx(j, reg, off);
+}
+
+static void emit_store_byte(Jit *j, int reg, int32_t off) {
+	emit8(j, 0x88); // mov [rbx + off], r8
+	emit_rbx(j, reg, off);
+}
+
+static void emit_store_pc(Jit *j, uint16_t pc) {
+	emit8(j, 0x66); // mov word [rbx + PC], imm16
+	emit8(j, 0xC7);
+	emit_rbx(j, 0, OFF_PC);
+	emit8(j, pc & 0xFF);
+	emit8(j, pc >> 8);
+}
+
+static void emit_store_i(Jit *j) {
+	emit8(j, 0x66); // mov [rbx + I], r13w
+	emit8(j, 0x44);
+	emit8(j, 0x89);
+	emit_rbx(j, 5, OFF_I);
+}
+
+static void emit_load_i(Jit *j) {
+	emit8(j, 0x44); // movzx r13d, word [rbx + I]
+	emit8(j, 0x0F);
+	emit8(j, 0xB7);
+	emit_rbx(j, 5, OFF_I);
+}
+
+// Leave native code with c->PC already set, the exit cannot be linked
+static void emit_unlinked_exit(Jit *j) {
+	emit8(j, 0x31); // xor edx, edx
+	emit8(j, 0xD2);
+	patch_rel32(emit_jmp(j), j->exit);
+}
+
+// Continue at target. Until the target block is linked, the jump falls
+// through to a stub that leaves native code and reports the patch site.
+static void emit_linked_exit(Jit *j, uint16_t target) {
+	uint8_t *site = emit_jmp(j);
+	patch_rel32(site, j->code_ptr);
+
+	emit_store_pc(j, target);
+	emit8(j, 0x48); // lea rdx, [rip + disp32]
+	emit8(j, 0x8D);
+	emit8(j, 0x15);
+	emit32(j, (uint32_t)(int32_t)(site - (j->code_ptr + 4)));
+	patch_rel32(emit_jmp(j), j->exit);
+}
+
+// Call the regular instruction handler, falling back to the interpreter's
+// implementation of the instruction
+static void emit_call_handler(Jit *j, Instr *in, uint16_t next_pc) {
+	emit_store_pc(j, next_pc);
+	emit_store_i(j);
+
+	emit8(j, 0x48); // mov rdi, rbx
+	emit8(j, 0x89);
+	emit8(j, 0xDF);
+	emit8(j, 0x48); // mov rsi, imm64
+	emit8(j, 0xBE);
+	emit64(j, (uint64_t)(uintptr_t)in);
+	emit8(j, 0x48); // mov rax, imm64
+	emit8(j, 0xB8);
+	emit64(j, (uint64_t)(uintptr_t)in->exec);
+	emit8(j, 0xFF); // call rax
+	emit8(j, 0xD0);
+
+	emit_load_i(j);
+}
+
+// Skip the next instruction if the flags satisfy the condition (given as the
+// jcc opcode of the opposite condition)
+static void emit_skip(Jit *j, uint8_t jcc_not_taken, uint16_t next_pc) {
+	uint8_t *not_taken = emit_jcc(j, jcc_not_taken);
+	emit_linked_exit(j, next_pc + 2);
+	patch_rel32(not_taken, j->code_ptr);
+	emit_linked_exit(j, next_pc);
+}
+
+#define JC 0x82
+#define JNC 0x83
+#define JE 0x84
+#define JNE 0x85
+
+static void emit_trampoline(Jit *j) {
+	emit8(j, 0x53);       // push rbx
+	emit8(j, 0x55);       // push rbp
+	emit8(j, 0x41);       // push r12
+	emit8(j, 0x54);
+	emit8(j, 0x41);       // push r13
+	emit8(j, 0x55);
+	emit8(j, 0x41);       // push r14
+	emit8(j, 0x56);
+	emit8(j, 0x48);       // mov rbx, rdi
+	emit8(j, 0x89);
+	emit8(j, 0xFB);
+	emit8(j, 0x49);       // mov r12, rdx
+	emit8(j, 0x89);
+	emit8(j, 0xD4);
+	emit_load_i(j);
+	emit8(j, 0xFF);       // jmp rsi
+	emit8(j, 0xE6);
+
+	j->exit = j->code_ptr;
+	emit_store_i(j);
+	emit8(j, 0x4C);       // mov rax, r12
+	emit8(j, 0x89);
+	emit8(j, 0xE0);
+	emit8(j, 0x41);       // pop r14
+	emit8(j, 0x5E);
+	emit8(j, 0x41);       // pop r13
+	emit8(j, 0x5D);
+	emit8(j, 0x41);       // pop r12
+	emit8(j, 0x5C);
+	emit8(j, 0x5D);       // pop rbp
+	emit8(j, 0x5B);       // pop rbx
+	emit8(j, 0xC3);       // ret
+}
+
+// Compile one instruction. Returns 1 if it ends the block.
+static int compile_instr(Jit *j, Instr *in, uint16_t pc) {
+	InstrHandler h = in->exec;
+	uint16_t next_pc = pc + 2;
+	int32_t vx = OFF_V(in->x);
+	int32_t vy = OFF_V(in->y);
+
+	if (h == ld_Vx_nn) {
+		emit8(j, 0xC6); // mov byte [Vx], nn
+		emit_rbx(j, 0, vx);
+		emit8(j, in->nn);
+	} else if (h == add_Vx_nn) {
+		emit8(j, 0x80); // add byte [Vx], nn
+		emit_rbx(j, 0, vx);
+		emit8(j, in->nn);
+	} else if (h == ld_Vx_Vy) {
+		emit_load_byte(j, AL, vy);
+		emit_store_byte(j, AL, vx);
+	} else if (h == bor || h == band || h == bxor) {
+		emit_load_byte(j, AL, vy);
+		emit8(j, h == bor ? 0x08 : h == band ? 0x20 : 0x30); // op [Vx], al
+		emit_rbx(j, AL, vx);
+	} else if (h == add_Vx_Vy) {
+		emit_load_byte(j, AL, vx);
+		emit8(j, 0x02); // add al, [Vy]
+		emit_rbx(j, AL, vy);
+		emit8(j, 0x0F); // setc cl
+		emit8(j, 0x92);
+		emit8(j, 0xC1);
+		emit_store_byte(j, AL, vx);
+		emit_store_byte(j, CL, OFF_V(0xF));
+	} else if (h == sub || h == subn) {
+		// al = minuend, cl = subtrahend, the flag is set if al > cl
+		emit_load_byte(j, AL, h == sub ? vx : vy);
+		emit_load_byte(j, CL, h == sub ? vy : vx);
+		emit8(j, 0x38); // cmp al, cl
+		emit8(j, 0xC8);
+		emit8(j, 0x0F); // seta dl
+		emit8(j, 0x97);
+		emit8(j, 0xC2);
+		emit8(j, 0x28); // sub al, cl
+		emit8(j, 0xC8);
+		emit_store_byte(j, AL, vx);
+		emit_store_byte(j, DL, OFF_V(0xF));
+	} else if (h == shr || h == shl) {
+		emit8(j, 0xD0); // shr/shl byte [Vx], 1
+		emit_rbx(j, h == shr ? 5 : 4, vx);
+	} else if (h == ld_I_nnn) {
+		emit8(j, 0x41); // mov r13d, nnn
+		emit8(j, 0xBD);
+		emit32(j, in->nnn);
+	} else if (h == add_I_Vx) {
+		emit8(j, 0x0F); // movzx eax, byte [Vx]
+		emit8(j, 0xB6);
+		emit_rbx(j, AL, vx);
+		emit8(j, 0x41); // add r13d, eax
+		emit8(j, 0x01);
+		emit8(j, 0xC5);
+		emit8(j, 0x45); // movzx r13d, r13w
+		emit8(j, 0x0F);
+		emit8(j, 0xB7);
+		emit8(j, 0xED);
+	} else if (h == ld_I_f) {
+		emit8(j, 0x0F); // movzx eax, byte [Vx]
+		emit8(j, 0xB6);
+		emit_rbx(j, AL, vx);
+		emit8(j, 0x44); // lea r13d, [rax + rax * 4]
+		emit8(j, 0x8D);
+		emit8(j, 0x2C);
+		emit8(j, 0x80);
+		if (FONTSET_START_ADDR != 0) {
+			emit8(j, 0x41); // add r13d, imm32
+			emit8(j, 0x81);
+			emit8(j, 0xC5);
+			emit32(j, FONTSET_START_ADDR);
+		}
+	} else if (h == ld_Vx_DT || h == ld_DT_Vx || h == ld_ST_Vx) {
+		int32_t timer = h == ld_ST_Vx ? OFF_ST : OFF_DT;
+		emit_load_byte(j, AL, h == ld_Vx_DT ? timer : vx);
+		emit_store_byte(j, AL, h == ld_Vx_DT ? vx : timer);
+	} else if (h == cls || h == drw || h == rnd || h == ld_V_from_mem) {
+		emit_call_handler(j, in, next_pc);
+	} else if (h == jmp_nnn) {
+		emit_linked_exit(j, in->nnn);
+		return 1;
+	} else if (h == se_Vx_nn || h == sne_Vx_nn) {
+		emit8(j, 0x80); // cmp byte [Vx], nn
+		emit_rbx(j, 7, vx);
+		emit8(j, in->nn);
+		emit_skip(j, h == se_Vx_nn ? JNE : JE, next_pc);
+		return 1;
+	} else if (h == se_Vx_Vy || h == sne_Vx_Vy) {
+		emit_load_byte(j, AL, vx);
+		emit8(j, 0x3A); // cmp al, [Vy]
+		emit_rbx(j, AL, vy);
+		emit_skip(j, h == se_Vx_Vy ? JNE : JE, next_pc);
+		return 1;
+	} else if (h == skp || h == skpn) {
+		emit8(j, 0x0F); // movzx eax, byte [Vx]
+		emit8(j, 0xB6);
+		emit_rbx(j, AL, vx);
+		emit8(j, 0x83); // and eax, 0xF
+		emit8(j, 0xE0);
+		emit8(j, 0x0F);
+		emit8(j, 0x0F); // movzx ecx, word [keys]
+		emit8(j, 0xB7);
+		emit_rbx(j, CL, OFF_KEYS);
+		emit8(j, 0x0F); // bt ecx, eax (CF = key is down)
+		emit8(j, 0xA3);
+		emit8(j, 0xC1);
+		emit_skip(j, h == skp ? JNC : JC, next_pc);
+		return 1;
+	} else if (h == call_nnn) {
+		// A call that overflows the stack faults and must not go on to nnn
+		emit_call_handler(j, in, next_pc);
+		emit8(j, 0x83); // cmp dword [fault], 0
+		emit_rbx(j, 7, OFF_FAULT);
+		emit8(j, 0);
+		uint8_t *fault = emit_jcc(j, JNE);
+		emit_linked_exit(j, in->nnn);
+		patch_rel32(fault, j->code_ptr);
+		emit_unlinked_exit(j);
+		return 1;
+	} else {
+		// ret, jmp_V0_nnn, ld_Vx_k, stores and invalid instructions: the
+		// handler sets the new PC, and stores must be seen by run_jit
+		emit_call_handler(j, in, next_pc);
+		emit_unlinked_exit(j);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Compile the run of instructions starting at pc. Returns NULL if one of the
+// pools is full (the caller flushes and retries).
+static JitBlock *compile_block(Jit *j, Chip8 *c, uint16_t pc) {
+	if (j->num_blocks == JIT_MAX_BLOCKS
+			|| j->num_instrs + JIT_MAX_BLOCK_LEN > JIT_INSTR_POOL_SIZE
+			|| j->src_used + JIT_MAX_BLOCK_LEN * 2 > JIT_SRC_POOL_SIZE
+			|| j->code_end - j->code_ptr
+				< (JIT_MAX_BLOCK_LEN + 2) * MAX_INSTR_CODE) {
+		return NULL;
+	}
+
+	JitBlock *b = &j->blocks[j->num_blocks++];
+	b->code = j->code_ptr;
+	b->start = pc;
+	b->len = 0;
+	b->pages = 0;
+	b->src = j->src_used;
+
+	// Budget check: bail out to run_jit (which single-steps) if the whole
+	// block does not fit in the remaining cycles
+	emit8(j, 0x49); // cmp r12, imm32 (patched once the length is known)
+	emit8(j, 0x81);
+	emit8(j, 0xFC);
+	uint8_t *len_cmp = j->code_ptr;
+	emit32(j, 0);
+	uint8_t *bail = emit_jcc(j, 0x8C); // jl bail
+	emit8(j, 0x49); // sub r12, imm32
+	emit8(j, 0x81);
+	emit8(j, 0xEC);
+	uint8_t *len_sub = j->code_ptr;
+	emit32(j, 0);
+
+	int ended = 0;
+	while (!ended && b->len < JIT_MAX_BLOCK_LEN && pc < RAM_END_ADDR) {
+		Instr *in = &j->instrs[j->num_instrs++];
+		decd_instr((c->mem[pc] << 8) | c->mem[pc + 1], in);
+		b->pages |= (1 << (pc >> PAGE_SHIFT)) | (1 << ((pc + 1) >> PAGE_SHIFT));
+		b->len++;
+
+		ended = compile_instr(j, in, pc);
+		pc += 2;
+	}
+
+	if (!ended) {
+		emit_linked_exit(j, pc);
+	}
+
+	uint32_t len = b->len;
+	memcpy(len_cmp, &len, 4);
+	memcpy(len_sub, &len, 4);
+
+	patch_rel32(bail, j->code_ptr);
+	emit_store_pc(j, b->start);
+	emit_unlinked_exit(j);
+
+	b->bytes = pc - b->start;
+	memcpy(&j->src[b->src], &c->mem[b->start], b->bytes);
+	j->src_used += b->bytes;
+
+	j->map[b->start - RAM_START_ADDR] = b;
+	return b;
+}
+
+int init_jit(Jit *j) {
+	void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		j->code = NULL;
+		return -1;
+	}
+
+	j->code = code;
+	j->code_end = j->code + JIT_CODE_SIZE;
+	j->code_ptr = j->code;
+	emit_trampoline(j);
+	j->blocks_start = j->code_ptr;
+
+	memset(j->smc_count, 0, sizeof(j->smc_count));
+	flush_jit(j);
+
+	return 0;
+}
+
+// Drop all compiled code. Links between blocks are not tracked, so blocks are
+// never dropped individually.
+void flush_jit(Jit *j) {
+	memset(j->map, 0, sizeof(j->map));
+	j->num_blocks = 0;
+	j->num_instrs = 0;
+	j->src_used = 0;
+	j->code_ptr = j->blocks_start;
+}
+
+// Called when pages have been written: flush the compiled code if the source
+// of any block on those pages actually changed (stores to data that shares a
+// page with code are common and harmless)
+static void check_code(Jit *j, Chip8 *c, uint16_t pages) {
+	if (pages == ALL_PAGES) {
+		// A new program was loaded
+		memset(j->smc_count, 0, sizeof(j->smc_count));
+		flush_jit(j);
+		return;
+	}
+
+	for (int i = 0; i < j->num_blocks; i++) {
+		JitBlock *b = &j->blocks[i];
+		if ((b->pages & pages)
+				&& memcmp(&j->src[b->src], &c->mem[b->start], b->bytes) != 0) {
+			for (int p = 0; p < NUM_PAGES; p++) {
+				if ((b->pages & pages) & (1 << p) && j->smc_count[p] < 255) {
+					j->smc_count[p]++;
+				}
+			}
+			flush_jit(j);
+			return;
+		}
+	}
+}
+
+// Execute up to the given number of instructions, compiling blocks the first
+// time they are reached. Stops early when the program starts waiting for a key
+// press or faults. Returns the number of instructions executed.
+long run_jit(Jit *j, Chip8 *c, long cycles) {
+	JitEntry enter = (JitEntry)(void *)j->code;
+	long n = 0;
+
+	while (n < cycles && !is_stopped(c)) {
+		if (c->dirty_pages & RAM_PAGES) {
+			check_code(j, c, c->dirty_pages);
+		}
+		c->dirty_pages = 0;
+
+		uint16_t pc = c->PC;
+		if (pc < RAM_START_ADDR || pc >= RAM_END_ADDR
+				|| j->smc_count[pc >> PAGE_SHIFT] >= JIT_SMC_LIMIT) {
+			decd_and_exec_instr(c, fetch_instr(c));
+			n++;
+			continue;
+		}
+
+		JitBlock *b = j->map[pc - RAM_START_ADDR];
+		if (b == NULL) {
+			b = compile_block(j, c, pc);
+			if (b == NULL) {
+				flush_jit(j);
+				b = compile_block(j, c, pc);
+			}
+		}
+
+		// Not enough cycles left for the whole block: single-step the rest
+		if (b->len > cycles - n) {
+			for (; n < cycles && !is_stopped(c); n++) {
+				decd_and_exec_instr(c, fetch_instr(c));
+			}
+			break;
+		}
+
+		JitResult res = enter(c, b->code, cycles - n);
+		n = cycles - res.budget;
+
+		// Link the exit to the block of the new PC so that next time control
+		// goes there directly. The target is compiled now if needed, unless
+		// that flushes the cache (and with it the patch site).
+		uint16_t target = c->PC;
+		if (res.patch != NULL && target >= RAM_START_ADDR
+				&& target < RAM_END_ADDR
+				&& j->smc_count[target >> PAGE_SHIFT] < JIT_SMC_LIMIT) {
+			JitBlock *t = j->map[target - RAM_START_ADDR];
+			if (t == NULL) {
+				t = compile_block(j, c, target);
+			}
+			if (t != NULL) {
+				patch_rel32(res.patch, t->code);
+			}
+		}
+	}
+
+	return n;
+}
+
+void close_jit(Jit *j) {
+	if (j->code != NULL) {
+		munmap(j->code, JIT_CODE_SIZE);
+		j->code = NULL;
+	}
+}
+
+#else
+
+int init_jit(Jit *j) {
+	return -1;
+}
+
+void flush_jit(Jit *j) {
+}
+
+long run_jit(Jit *j, Chip8 *c, long cycles) {
+	return 0;
+}
+
+void close_jit(Jit *j) {
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+#include "instructions.h"
+#include "icache.h"
+
+// The JIT is only available on x86-64 hosts that can map executable memory
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) \
+	|| defined(__FreeBSD__))
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_MAX_BLOCK_LEN 64
+#define JIT_MAX_BLOCKS 4096
+#define JIT_INSTR_POOL_SIZE (JIT_MAX_BLOCKS * 8)
+#define JIT_SRC_POOL_SIZE (JIT_MAX_BLOCKS * 16)
+
+// A page whose code has been modified this many times is no longer compiled,
+// its instructions are left to the interpreter
+#define JIT_SMC_LIMIT 4
+
+typedef struct JitBlock JitBlock;
+typedef struct Jit Jit;
+
+// A contiguous run of CHIP-8 instructions compiled to native code. The source
+// bytes are kept so that a store to the page can be checked against them.
+struct JitBlock {
+	uint8_t *code;
+	uint16_t start;
+	uint16_t bytes;
+	uint16_t len;
+	uint16_t pages;
+	uint32_t src;
+};
+
+struct Jit {
+	// Executable code buffer. The entry trampoline and the common exit are
+	// emitted once at the start, blocks are appended after them.
+	uint8_t *code;
+	uint8_t *code_end;
+	uint8_t *code_ptr;
+	uint8_t *blocks_start;
+	uint8_t *exit;
+
+	JitBlock *map[ICACHE_SIZE];
+	JitBlock blocks[JIT_MAX_BLOCKS];
+	int num_blocks;
+
+	// Decoded instructions passed to the handlers that compiled code calls
+	Instr instrs[JIT_INSTR_POOL_SIZE];
+	int num_instrs;
+
+	uint8_t src[JIT_SRC_POOL_SIZE];
+	int src_used;
+
+	uint8_t smc_count[NUM_PAGES];
+};
+
+int init_jit(Jit *j);
+void flush_jit(Jit *j);
+long run_jit(Jit *j, Chip8 *c, long cycles);
+void close_jit(Jit *j);
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libchip8.h"
+#include "chip8.h"
+#include "engine.h"
+#include "snapshot.h"
+
+#define DEFAULT_CLOCK_RATE 700
+#define FRAME_RATE 60
+
+struct Chip8Emu {
+	Chip8 c;
+	Engine engine;
+
+	// Copy of the loaded ROM for chip8_reset
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t rom_size;
+
+	long rate;
+	uint64_t seed; // Of the generator of rnd, applied on every reset
+	long cycles_owed; // Remainder of rate / FRAME_RATE carried between frames
+
+	// The snapshot the machine was last saved to or restored from, which
+	// the next snapshot shares its unwritten pages with
+	Snapshot base;
+};
+
+struct Chip8Snapshot {
+	Snapshot s;
+	long cycles_owed;
+};
+
+// A packed state is followed by the cycles owed (always below FRAME_RATE)
+_Static_assert(PACKED_STATE_MAX_SIZE + 1 <= CHIP8_STATE_MAX_SIZE,
+	"CHIP8_STATE_MAX_SIZE is too small");
+
+Chip8Status chip8_create(Chip8Emu **emu, const char *engine) {
+	*emu = NULL;
+
+	int kind = ENGINE_CACHE;
+	if (engine != NULL) {
+		kind = get_engine_from_name(engine);
+		if (kind < 0) {
+			return CHIP8_ERR_ENGINE;
+		}
+	}
+
+	Chip8Emu *e = malloc(sizeof(Chip8Emu));
+	if (e == NULL) {
+		return CHIP8_ERR_NO_MEMORY;
+	}
+
+	if (init_engine(&e->engine, kind) != 0) {
+		free(e);
+		return CHIP8_ERR_ENGINE;
+	}
+
+	init_sys(&e->c);
+	e->rom_size = 0;
+	e->rate = DEFAULT_CLOCK_RATE;
+	e->seed = DEFAULT_SEED;
+	e->cycles_owed = 0;
+	init_snapshot(&e->base);
+
+	*emu = e;
+	return CHIP8_OK;
+}
+
+void chip8_destroy(Chip8Emu *emu) {
+	if (emu == NULL) {
+		return;
+	}
+
+	close_engine(&emu->engine);
+	free_snapshot(&emu->base);
+	free(emu);
+}
+
+Chip8Status chip8_load_rom(Chip8Emu *emu, const uint8_t *rom, size_t size) {
+	if (size == 0) {
+		return CHIP8_ERR_ROM_EMPTY;
+	}
+
+	if (size > MAX_ROM_SIZE) {
+		return CHIP8_ERR_ROM_TOO_LARGE;
+	}
+
+	memcpy(emu->rom, rom, size);
+	emu->rom_size = size;
+	return chip8_reset(emu);
+}
+
+Chip8Status chip8_load_rom_file(Chip8Emu *emu, const char *path) {
+	// Read into a separate buffer so that a failed load leaves the current
+	// ROM in place
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t size;
+	Chip8Status status = read_rom_file(path, rom, &size);
+	if (status != CHIP8_OK) {
+		return status;
+	}
+
+	return chip8_load_rom(emu, rom, size);
+}
+
+Chip8Status chip8_reset(Chip8Emu *emu) {
+	init_sys(&emu->c);
+	seed_rng(&emu->c, emu->seed);
+	emu->cycles_owed = 0;
+	if (emu->rom_size == 0) {
+		return CHIP8_ERR_NO_ROM;
+	}
+
+	Chip8Status status = load_rom(&emu->c, emu->rom, emu->rom_size);
+	if (status == CHIP8_OK) {
+		precompile_engine(&emu->engine, &emu->c);
+	}
+	return status;
+}
+
+Chip8Status chip8_set_clock_rate(Chip8Emu *emu, long hz) {
+	if (hz <= 0) {
+		return CHIP8_ERR_INVALID_ARG;
+	}
+
+	emu->rate = hz;
+	emu->cycles_owed = 0;
+	return CHIP8_OK;
+}
+
+Chip8Status chip8_run_cycles(Chip8Emu *emu, long cycles, long *executed) {
+	long n = 0;
+	if (emu->rom_size == 0) {
+		if (executed != NULL) {
+			*executed = 0;
+		}
+		return CHIP8_ERR_NO_ROM;
+	}
+
+	// Like at the start of a frame, a held key ends a wait for a key press
+	Chip8 *c = &emu->c;
+	if (c->start_wait && c->keys) {
+		c->end_wait = 1;
+	}
+
+	if (cycles > 0) {
+		n = run_engine(&emu->engine, c, cycles);
+	}
+
+	if (executed != NULL) {
+		*executed = n;
+	}
+	return c->fault;
+}
+
+Chip8Status chip8_run_frames(Chip8Emu *emu, long frames, long *executed) {
+	Chip8 *c = &emu->c;
+	long n = 0;
+	if (executed != NULL) {
+		*executed = 0;
+	}
+	if (emu->rom_size == 0) {
+		return CHIP8_ERR_NO_ROM;
+	}
+
+	for (long f = 0; f < frames && c->fault == CHIP8_OK; f++) {
+		if (c->start_wait && c->keys) {
+			c->end_wait = 1;
+		}
+
+		emu->cycles_owed += emu->rate;
+		n += run_engine(&emu->engine, c, emu->cycles_owed / FRAME_RATE);
+		emu->cycles_owed %= FRAME_RATE;
+
+		tick_timers(c);
+	}
+
+	if (executed != NULL) {
+		*executed = n;
+	}
+	return c->fault;
+}
+
+void chip8_set_seed(Chip8Emu *emu, uint64_t seed) {
+	emu->seed = seed;
+	seed_rng(&emu->c, seed);
+}
+
+void chip8_set_keys(Chip8Emu *emu, uint16_t keys) {
+	emu->c.keys = keys;
+}
+
+const uint64_t *chip8_get_framebuffer(const Chip8Emu *emu) {
+	return emu->c.fb;
+}
+
+uint32_t chip8_take_dirty_rows(Chip8Emu *emu) {
+	uint32_t rows = emu->c.dirty_rows;
+	emu->c.dirty_rows = 0;
+	emu->c.update_screen = 0;
+	return rows;
+}
+
+int chip8_is_sound_on(const Chip8Emu *emu) {
+	return emu->c.ST > 0;
+}
+
+int chip8_is_waiting_for_key(const Chip8Emu *emu) {
+	return emu->c.start_wait && !emu->c.end_wait;
+}
+
+uint64_t chip8_hash_state(const Chip8Emu *emu) {
+	return hash_state(&emu->c);
+}
+
+Chip8Status chip8_clone(const Chip8Emu *emu, Chip8Emu **clone) {
+	Chip8Status status = chip8_create(clone, ENGINE_NAMES[emu->engine.kind]);
+	if (status != CHIP8_OK) {
+		return status;
+	}
+
+	Chip8Emu *e = *clone;
+	e->c = emu->c;
+	e->c.dirty_pages = ALL_PAGES;
+	e->c.snap_pages = ALL_PAGES;
+	e->c.snap_base = 0;
+	memcpy(e->rom, emu->rom, emu->rom_size);
+	e->rom_size = emu->rom_size;
+	e->rate = emu->rate;
+	e->seed = emu->seed;
+	e->cycles_owed = emu->cycles_owed;
+	return CHIP8_OK;
+}
+
+Chip8Status chip8_snapshot_save(Chip8Emu *emu, Chip8Snapshot **snap) {
+	*snap = malloc(sizeof(Chip8Snapshot));
+	if (*snap == NULL) {
+		return CHIP8_ERR_NO_MEMORY;
+	}
+
+	init_snapshot(&(*snap)->s);
+	if (save_snapshot(&(*snap)->s, &emu->c, &emu->base) != 0) {
+		free(*snap);
+		*snap = NULL;
+		return CHIP8_ERR_NO_MEMORY;
+	}
+
+	(*snap)->cycles_owed = emu->cycles_owed;
+	copy_snapshot(&emu->base, &(*snap)->s);
+	return CHIP8_OK;
+}
+
+void chip8_snapshot_restore(Chip8Emu *emu, const Chip8Snapshot *snap) {
+	restore_snapshot(&emu->c, &snap->s);
+	emu->cycles_owed = snap->cycles_owed;
+	copy_snapshot(&emu->base, &snap->s);
+}
+
+void chip8_snapshot_free(Chip8Snapshot *snap) {
+	if (snap == NULL) {
+		return;
+	}
+
+	free_snapshot(&snap->s);
+	free(snap);
+}
+
+Chip8Status chip8_save_state(const Chip8Emu *emu, void *buf, size_t capacity,
+	size_t *size) {
+	uint8_t packed[PACKED_STATE_MAX_SIZE + 1];
+	size_t n = pack_state(&emu->c, packed);
+	packed[n++] = emu->cycles_owed;
+
+	*size = n;
+	if (n > capacity) {
+		return CHIP8_ERR_INVALID_ARG;
+	}
+
+	memcpy(buf, packed, n);
+	return CHIP8_OK;
+}
+
+Chip8Status chip8_load_state(Chip8Emu *emu, const void *buf, size_t size) {
+	const uint8_t *p = buf;
+	size_t n;
+
+	// Unpack into a copy, so that the machine is left unchanged if the
+	// trailing cycles owed are missing or invalid
+	Chip8 c = emu->c;
+	if (unpack_state(&c, p, size, &n) != CHIP8_OK || n >= size
+			|| p[n] >= FRAME_RATE) {
+		return CHIP8_ERR_INVALID_ARG;
+	}
+
+	emu->c = c;
+	emu->cycles_owed = p[n];
+	return CHIP8_OK;
+}
+
+Chip8Status chip8_get_status(const Chip8Emu *emu) {
+	return emu->c.fault;
+}
+
+const char *chip8_status_message(Chip8Status status) {
+	switch (status) {
+		case CHIP8_OK:
+			return "No error";
+		case CHIP8_ERR_NO_MEMORY:
+			return "Out of memory";
+		case CHIP8_ERR_ENGINE:
+			return "Engine unknown or not supported on this host";
+		case CHIP8_ERR_INVALID_ARG:
+			return "Invalid argument";
+		case CHIP8_ERR_FILE:
+			return "Unable to open or read the file";
+		case CHIP8_ERR_ROM_EMPTY:
+			return "ROM is empty";
+		case CHIP8_ERR_ROM_TOO_LARGE:
+			return "ROM does not fit into 0x200-0xFFF";
+		case CHIP8_ERR_NO_ROM:
+			return "No ROM loaded";
+		case CHIP8_ERR_INVALID_INSTR:
+			return "Invalid instruction";
+		case CHIP8_ERR_STACK_OVERFLOW:
+			return "Stack overflow";
+		case CHIP8_ERR_STACK_UNDERFLOW:
+			return "Stack underflow";
+		default:
+			return "Unknown error";
+	}
+}
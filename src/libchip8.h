@@ -0,0 +1,189 @@
+#ifndef LIBCHIP8_H
+#define LIBCHIP8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Public API of libchip8. A Chip8Emu is an opaque handle to one emulator:
+// the machine, its execution engine and its settings. Handles share no state,
+// so any number of them can run in one process (one thread per handle at a
+// time). Errors and faults of the emulated program are reported as status
+// codes, the library never prints or exits.
+
+// Only the functions declared here are exported from the shared library
+#if defined(__GNUC__)
+#define CHIP8_API __attribute__((visibility("default")))
+#else
+#define CHIP8_API
+#endif
+
+#define CHIP8_SCREEN_WIDTH 64
+#define CHIP8_SCREEN_HEIGHT 32
+
+typedef enum Chip8Status {
+	CHIP8_OK = 0,
+	CHIP8_ERR_NO_MEMORY,
+	CHIP8_ERR_ENGINE,         // Unknown engine or not supported on this host
+	CHIP8_ERR_INVALID_ARG,
+	CHIP8_ERR_FILE,           // The ROM file could not be opened or read
+	CHIP8_ERR_ROM_EMPTY,
+	CHIP8_ERR_ROM_TOO_LARGE,  // Larger than 0x200-0xFFF
+	CHIP8_ERR_NO_ROM,         // Running before a ROM was loaded
+
+	// Faults of the emulated program (all codes from here on). Execution
+	// stops at the faulting instruction until the machine is reset or another
+	// ROM is loaded.
+	CHIP8_ERR_INVALID_INSTR,
+	CHIP8_ERR_STACK_OVERFLOW,
+	CHIP8_ERR_STACK_UNDERFLOW
+} Chip8Status;
+
+typedef struct Chip8Emu Chip8Emu;
+
+// Create an emulator running on the named engine (interp, cache, block or
+// jit, NULL for the default) at the default clock rate of 700 Hz
+CHIP8_API Chip8Status chip8_create(Chip8Emu **emu, const char *engine);
+CHIP8_API void chip8_destroy(Chip8Emu *emu);
+
+// Reset the machine and load a ROM at 0x200. The ROM is copied and reloaded
+// by chip8_reset.
+CHIP8_API Chip8Status chip8_load_rom(Chip8Emu *emu, const uint8_t *rom,
+	size_t size);
+CHIP8_API Chip8Status chip8_load_rom_file(Chip8Emu *emu, const char *path);
+CHIP8_API Chip8Status chip8_reset(Chip8Emu *emu);
+
+// Number of instructions run per second by chip8_run_frames
+CHIP8_API Chip8Status chip8_set_clock_rate(Chip8Emu *emu, long hz);
+
+// Run up to the given number of instructions. A wait for a key press ends if
+// a key is held down at the start of the call; fewer instructions are run if
+// the program waits for a key press or faults. The number of instructions
+// run is stored in executed if it is not NULL. The timers are not ticked.
+CHIP8_API Chip8Status chip8_run_cycles(Chip8Emu *emu, long cycles,
+	long *executed);
+
+// Run the given number of 60 Hz frames: a wait for a key press ends at the
+// start of a frame if a key is held down, the frame's share of the clock rate
+// is run, then the timers are ticked. The number of instructions run is
+// stored in executed if it is not NULL.
+CHIP8_API Chip8Status chip8_run_frames(Chip8Emu *emu, long frames,
+	long *executed);
+
+// Seed the random number generator of rnd. Runs with the same seed, ROM and
+// inputs are identical. The seed (0 by default) is kept and applied again by
+// chip8_reset.
+CHIP8_API void chip8_set_seed(Chip8Emu *emu, uint64_t seed);
+
+// Bit k of keys is set while key k is held down
+CHIP8_API void chip8_set_keys(Chip8Emu *emu, uint16_t keys);
+
+// The display as CHIP8_SCREEN_HEIGHT rows of 64 pixels, the most significant
+// bit of a row is its leftmost pixel. The pointer stays valid for the life of
+// the handle.
+CHIP8_API const uint64_t *chip8_get_framebuffer(const Chip8Emu *emu);
+
+// Rows that changed since the last call (bit i is row i)
+CHIP8_API uint32_t chip8_take_dirty_rows(Chip8Emu *emu);
+
+CHIP8_API int chip8_is_sound_on(const Chip8Emu *emu);
+CHIP8_API int chip8_is_waiting_for_key(const Chip8Emu *emu);
+
+// 64-bit FNV-1a hash of the machine state (registers, timers, memory and
+// display), equal for machines in the same state
+CHIP8_API uint64_t chip8_hash_state(const Chip8Emu *emu);
+
+// The fault that stopped execution, or CHIP8_OK
+CHIP8_API Chip8Status chip8_get_status(const Chip8Emu *emu);
+CHIP8_API const char *chip8_status_message(Chip8Status status);
+
+// Create a new emulator with the engine, settings, ROM and machine state of
+// emu. The clone runs independently of emu.
+CHIP8_API Chip8Status chip8_clone(const Chip8Emu *emu, Chip8Emu **clone);
+
+// Snapshots of the machine state, cheap enough to take thousands of times per
+// second (e.g. for a tree search over inputs). A snapshot only copies the
+// memory pages written since the emulator was last saved to or restored from
+// a snapshot and shares the others. It can be restored into any emulator,
+// any number of times, and stays valid after the emulator is destroyed.
+typedef struct Chip8Snapshot Chip8Snapshot;
+
+CHIP8_API Chip8Status chip8_snapshot_save(Chip8Emu *emu,
+	Chip8Snapshot **snap);
+CHIP8_API void chip8_snapshot_restore(Chip8Emu *emu,
+	const Chip8Snapshot *snap);
+CHIP8_API void chip8_snapshot_free(Chip8Snapshot *snap);
+
+// Largest size of a saved state
+#define CHIP8_STATE_MAX_SIZE 4480
+
+// Serialize the machine state into a compact, portable format (the display
+// and memory are run-length encoded). The ROM and the settings are not part
+// of the state. The size of the state is stored in size; if it is larger than
+// capacity nothing is written and CHIP8_ERR_INVALID_ARG is returned.
+CHIP8_API Chip8Status chip8_save_state(const Chip8Emu *emu, void *buf,
+	size_t capacity, size_t *size);
+CHIP8_API Chip8Status chip8_load_state(Chip8Emu *emu, const void *buf,
+	size_t size);
+
+// Vectorized environments for reinforcement learning: num_envs copies of one
+// ROM stepped together on the lockstep engine. Actions are the keys held
+// down during a step, observations are the displays after it and rewards
+// are read from memory.
+typedef struct Chip8Env Chip8Env;
+
+typedef enum Chip8ObsFormat {
+	CHIP8_OBS_BITS,   // CHIP8_SCREEN_HEIGHT rows as by chip8_get_framebuffer
+	CHIP8_OBS_PIXELS  // One byte per pixel (0 or 1), row by row
+} Chip8ObsFormat;
+
+// A number stored in memory: size bytes at addr, most significant first. In
+// BCD, each byte holds one decimal digit (as stored by Fx33).
+typedef struct Chip8MemReader {
+	uint16_t addr;
+	uint8_t size; // 1 to 4
+	uint8_t bcd;
+	float scale;
+} Chip8MemReader;
+
+typedef struct Chip8EnvConfig {
+	long clock_rate;        // Instructions per second, 0 for 700
+	int frame_skip;         // 60 Hz frames run per step, 0 for 1
+	Chip8ObsFormat obs_format;
+
+	// The reward of a step is the sum of the scaled changes of the readers
+	const Chip8MemReader *rewards;
+	int num_rewards;
+
+	// An episode ends when the program faults, when the done reader (if
+	// not NULL) reads done_value, or after max_steps steps (if not 0)
+	const Chip8MemReader *done;
+	long done_value;
+	long max_steps;
+
+	// Environment i draws random numbers from a generator seeded with
+	// seed + i by chip8_env_reset. It is not reseeded when an episode ends.
+	uint64_t seed;
+} Chip8EnvConfig;
+
+// Create num_envs environments running the ROM. The config and its readers
+// are copied.
+CHIP8_API Chip8Status chip8_env_create(Chip8Env **env, int num_envs,
+	const uint8_t *rom, size_t size, const Chip8EnvConfig *config);
+CHIP8_API void chip8_env_destroy(Chip8Env *env);
+
+// Size in bytes of the observation of one environment. The observations of
+// all environments are written back to back.
+CHIP8_API size_t chip8_env_obs_size(const Chip8Env *env);
+
+// Reset every environment and write the first observations
+CHIP8_API void chip8_env_reset(Chip8Env *env, void *obs);
+
+// Hold down the keys of actions[i] (a mask, bit k is key k) in environment i
+// for frame_skip frames, then write the observations and the rewards, and
+// set done[i] if the episode of environment i ended. Such an environment is
+// reset at the start of its next step, so its observation is the last one of
+// the episode. Any of obs, rewards and done may be NULL.
+CHIP8_API void chip8_env_step(Chip8Env *env, const uint16_t *actions,
+	void *obs, float *rewards, uint8_t *done);
+
+#endif
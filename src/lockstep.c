@@ -0,0 +1,599 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockstep.h"
+#include "profile.h"
+
+// The hot paths are inlined into run_lockstep, which on x86-64 is compiled
+// for AVX2 as well as for the baseline, and the version to run is picked
+// when the program is loaded
+#define HOT static inline __attribute__((always_inline))
+#if defined(__x86_64__) && defined(__linux__) && !defined(__AVX2__)
+#define RUN_LOCKSTEP_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define RUN_LOCKSTEP_CLONES
+#endif
+
+typedef int8_t LaneMask __attribute__((vector_size(LANES_PER_CHUNK)));
+typedef int16_t LaneWordMask __attribute__((vector_size(2 * LANES_PER_CHUNK)));
+
+// Select a where the mask is set and b elsewhere
+#define BLEND(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+
+// Instructions with a vector implementation. Everything else (memory,
+// display, stack, keypad wait, rnd and invalid instructions) runs through
+// its handler, lane by lane.
+enum {
+	OP_HANDLER,
+	OP_LD_VX_NN,
+	OP_ADD_VX_NN,
+	OP_LD_VX_VY,
+	OP_OR,
+	OP_AND,
+	OP_XOR,
+	OP_ADD_VX_VY,
+	OP_SUB,
+	OP_SHR,
+	OP_SUBN,
+	OP_SHL,
+	OP_LD_I_NNN,
+	OP_LD_VX_DT,
+	OP_LD_DT_VX,
+	OP_LD_ST_VX,
+	OP_ADD_I_VX,
+	OP_LD_I_F,
+	OP_JMP,
+	OP_JMP_V0,
+	OP_SE_VX_NN,
+	OP_SNE_VX_NN,
+	OP_SE_VX_VY,
+	OP_SNE_VX_VY,
+	OP_SKP,
+	OP_SKPN
+};
+
+static uint8_t get_op_kind(const Instr *in) {
+	InstrHandler h = in->exec;
+
+	if (h == ld_Vx_nn) return OP_LD_VX_NN;
+	if (h == add_Vx_nn) return OP_ADD_VX_NN;
+	if (h == ld_Vx_Vy) return OP_LD_VX_VY;
+	if (h == bor) return OP_OR;
+	if (h == band) return OP_AND;
+	if (h == bxor) return OP_XOR;
+	if (h == add_Vx_Vy) return OP_ADD_VX_VY;
+	if (h == sub) return OP_SUB;
+	if (h == shr) return OP_SHR;
+	if (h == subn) return OP_SUBN;
+	if (h == shl) return OP_SHL;
+	if (h == ld_I_nnn) return OP_LD_I_NNN;
+	if (h == ld_Vx_DT) return OP_LD_VX_DT;
+	if (h == ld_DT_Vx) return OP_LD_DT_VX;
+	if (h == ld_ST_Vx) return OP_LD_ST_VX;
+	if (h == add_I_Vx) return OP_ADD_I_VX;
+	if (h == ld_I_f) return OP_LD_I_F;
+	if (h == jmp_nnn) return OP_JMP;
+	if (h == jmp_V0_nnn) return OP_JMP_V0;
+	if (h == se_Vx_nn) return OP_SE_VX_NN;
+	if (h == sne_Vx_nn) return OP_SNE_VX_NN;
+	if (h == se_Vx_Vy) return OP_SE_VX_VY;
+	if (h == sne_Vx_Vy) return OP_SNE_VX_VY;
+	if (h == skp) return OP_SKP;
+	if (h == skpn) return OP_SKPN;
+
+	return OP_HANDLER;
+}
+
+// Vectors are only passed around through macros and pointers: passing them by
+// value would depend on the vector ABI of the target
+#define SPLAT_BYTES(v) ((LaneBytes){0} + (uint8_t)(v))
+#define SPLAT_WORDS(v) ((LaneWords){0} + (uint16_t)(v))
+
+// Zero-extend bytes to words
+#define WIDEN(b) __builtin_convertvector((b), LaneWords)
+
+// Extend a byte mask (0x00 or 0xFF per lane) to a word mask
+#define WIDEN_MASK(m) \
+	((LaneWords)__builtin_convertvector((LaneMask)(m), LaneWordMask))
+
+// Byte mask of the lanes of a chunk whose PC is pc
+#define MATCH_PC(ch, pc) \
+	((LaneBytes)__builtin_convertvector((ch)->PC == (pc), LaneMask))
+
+HOT int any_lane(const LaneBytes *m) {
+	uint64_t w[LANES_PER_CHUNK / 8];
+	memcpy(w, m, sizeof(w));
+
+	uint64_t all = 0;
+	for (int i = 0; i < LANES_PER_CHUNK / 8; i++) {
+		all |= w[i];
+	}
+	return all != 0;
+}
+
+static inline uint16_t fetch_lane_instr(const Chip8 *c, uint16_t pc) {
+	return (read_mem(c, pc) << 8) | read_mem(c, pc + 1);
+}
+
+static void load_lane(const LaneChunk *ch, int s, Chip8 *c) {
+	for (int i = 0; i < NUM_V_REGISTERS; i++) {
+		c->V[i] = ch->V[i][s];
+	}
+	c->DT = ch->DT[s];
+	c->ST = ch->ST[s];
+	c->PC = ch->PC[s];
+	c->I = ch->I[s];
+}
+
+static void store_lane(LaneChunk *ch, int s, const Chip8 *c) {
+	for (int i = 0; i < NUM_V_REGISTERS; i++) {
+		ch->V[i][s] = c->V[i];
+	}
+	ch->DT[s] = c->DT;
+	ch->ST[s] = c->ST;
+	ch->PC[s] = c->PC;
+	ch->I[s] = c->I;
+}
+
+int init_lockstep(Lockstep *ls, int num_lanes) {
+	if (num_lanes <= 0) {
+		return -1;
+	}
+
+	ls->num_lanes = num_lanes;
+	ls->num_chunks = (num_lanes + LANES_PER_CHUNK - 1) / LANES_PER_CHUNK;
+	ls->chunks = aligned_alloc(_Alignof(LaneChunk),
+		ls->num_chunks * sizeof(LaneChunk));
+	ls->pending = aligned_alloc(_Alignof(LaneBytes),
+		ls->num_chunks * sizeof(LaneBytes));
+	ls->group = aligned_alloc(_Alignof(LaneBytes),
+		ls->num_chunks * sizeof(LaneBytes));
+	ls->lanes = malloc(ls->num_chunks * LANES_PER_CHUNK * sizeof(Chip8));
+	if (ls->chunks == NULL || ls->pending == NULL || ls->group == NULL
+			|| ls->lanes == NULL) {
+		close_lockstep(ls);
+		return -1;
+	}
+
+	// The padding of the last chunk is made of valid machines that never run
+	for (int i = 0; i < ls->num_chunks * LANES_PER_CHUNK; i++) {
+		init_sys(&ls->lanes[i]);
+	}
+	for (int k = 0; k < ls->num_chunks; k++) {
+		memset(&ls->chunks[k], 0, sizeof(LaneChunk));
+		ls->chunks[k].stopped = SPLAT_BYTES(0xFF);
+	}
+	memset(ls->written, 0, sizeof(ls->written));
+	ls->running = 0;
+
+	// Finding a group takes two passes over all chunks, which costs about as
+	// much as running a lane through its handler every four chunks
+	ls->min_group = ls->num_chunks / 4 + 1;
+
+	return 0;
+}
+
+void close_lockstep(Lockstep *ls) {
+	free(ls->chunks);
+	free(ls->pending);
+	free(ls->group);
+	free(ls->lanes);
+	ls->chunks = NULL;
+	ls->pending = NULL;
+	ls->group = NULL;
+	ls->lanes = NULL;
+}
+
+// Reset every lane and load the same ROM into all of them. The lanes are
+// seeded as by seed_lanes with DEFAULT_SEED.
+Chip8Status load_lockstep(Lockstep *ls, const uint8_t *rom, size_t size) {
+	init_sys(&ls->start);
+	Chip8Status status = load_rom(&ls->start, rom, size);
+	if (status != CHIP8_OK) {
+		return status;
+	}
+	ls->start.dirty_pages = 0;
+
+	ls->running = 0;
+	for (int k = 0; k < ls->num_chunks; k++) {
+		ls->chunks[k].stopped = SPLAT_BYTES(0xFF);
+	}
+	for (int i = 0; i < ls->num_chunks * LANES_PER_CHUNK; i++) {
+		reset_lane(ls, i);
+	}
+	memset(ls->written, 0, sizeof(ls->written));
+	seed_lanes(ls, DEFAULT_SEED);
+
+	return CHIP8_OK;
+}
+
+// Seed the generator of lane i with seed + i, so that every lane draws its
+// own random numbers
+void seed_lanes(Lockstep *ls, uint64_t seed) {
+	for (int i = 0; i < ls->num_lanes; i++) {
+		seed_rng(&ls->lanes[i], seed + i);
+	}
+}
+
+// Put a lane back into the state it was in after load_lockstep (with no key
+// held down). The lane keeps drawing from its random number generator, so
+// that its next run does not repeat the last one. Lanes past the last one
+// stay stopped.
+void reset_lane(Lockstep *ls, int lane) {
+	LaneChunk *ch = &ls->chunks[lane / LANES_PER_CHUNK];
+	int s = lane % LANES_PER_CHUNK;
+
+	uint64_t rng = ls->lanes[lane].rng;
+	memcpy(&ls->lanes[lane], &ls->start, sizeof(Chip8));
+	ls->lanes[lane].rng = rng;
+	store_lane(ch, s, &ls->start);
+	ch->keys[s] = 0;
+	ch->left[s] = 0;
+
+	if (lane < ls->num_lanes && ch->stopped[s]) {
+		ch->stopped[s] = 0;
+		ls->running++;
+	}
+}
+
+// Record the stores of the handler that just ran on c. Stores through I are
+// recorded by address, since ROMs commonly keep data next to their code,
+// and any other store (the stack) by page.
+static void mark_written(Lockstep *ls, Chip8 *c, const Instr *in, uint16_t I) {
+	int len = 0;
+	if (in->exec == ld_I_b) {
+		len = 3;
+	} else if (in->exec == ld_I_from_reg) {
+		len = in->x + 1;
+	}
+
+	if (len > 0) {
+		for (int i = 0; i < len; i++) {
+			ls->written[(I + i) & (MEM_SIZE - 1)] = 1;
+		}
+	} else {
+		for (int page = 0; page < NUM_PAGES; page++) {
+			if (c->dirty_pages & (1 << page)) {
+				memset(&ls->written[page << PAGE_SHIFT], 1, PAGE_SIZE);
+			}
+		}
+	}
+	c->dirty_pages = 0;
+}
+
+// Run one instruction on one lane through its handler
+static void run_lane(Lockstep *ls, int lane, const Instr *in) {
+	LaneChunk *ch = &ls->chunks[lane / LANES_PER_CHUNK];
+	int s = lane % LANES_PER_CHUNK;
+	Chip8 *c = &ls->lanes[lane];
+
+	load_lane(ch, s, c);
+	uint16_t I = c->I;
+	c->PC += 2;
+	PROFILE_EXEC(c, in);
+	store_lane(ch, s, c);
+
+	if (c->dirty_pages) {
+		mark_written(ls, c, in, I);
+	}
+	if (is_stopped(c)) {
+		ch->stopped[s] = 0xFF;
+		ls->running--;
+	}
+}
+
+// Run one instruction on the lanes of chunk k selected by the mask
+HOT void run_chunk(Lockstep *ls, int k, const LaneBytes *mask,
+		uint8_t kind, const Instr *in) {
+	LaneChunk *ch = &ls->chunks[k];
+	LaneBytes m = *mask;
+	LaneBytes *Vx = &ch->V[in->x];
+	LaneBytes *VF = &ch->V[0xF];
+	LaneBytes a = *Vx;
+	LaneBytes b = ch->V[in->y];
+	LaneBytes flag;
+	LaneWords next = ch->PC + 2;
+	LaneWords taken;
+
+	switch (kind) {
+		case OP_LD_VX_NN:
+			*Vx = BLEND(m, SPLAT_BYTES(in->nn), a);
+			break;
+		case OP_ADD_VX_NN:
+			*Vx = BLEND(m, a + in->nn, a);
+			break;
+		case OP_LD_VX_VY:
+			*Vx = BLEND(m, b, a);
+			break;
+		case OP_OR:
+			*Vx = BLEND(m, a | b, a);
+			break;
+		case OP_AND:
+			*Vx = BLEND(m, a & b, a);
+			break;
+		case OP_XOR:
+			*Vx = BLEND(m, a ^ b, a);
+			break;
+		case OP_ADD_VX_VY:
+			flag = (LaneBytes)(a + b < a) & 1;
+			*Vx = BLEND(m, a + b, a);
+			*VF = BLEND(m, flag, *VF);
+			break;
+		case OP_SUB:
+			flag = (LaneBytes)(a > b) & 1;
+			*Vx = BLEND(m, a - b, a);
+			*VF = BLEND(m, flag, *VF);
+			break;
+		case OP_SHR:
+			*Vx = BLEND(m, a >> 1, a);
+			break;
+		case OP_SUBN:
+			flag = (LaneBytes)(b > a) & 1;
+			*Vx = BLEND(m, b - a, a);
+			*VF = BLEND(m, flag, *VF);
+			break;
+		case OP_SHL:
+			*Vx = BLEND(m, a << 1, a);
+			break;
+		case OP_LD_I_NNN:
+			ch->I = BLEND(WIDEN_MASK(m), SPLAT_WORDS(in->nnn), ch->I);
+			break;
+		case OP_LD_VX_DT:
+			*Vx = BLEND(m, ch->DT, a);
+			break;
+		case OP_LD_DT_VX:
+			ch->DT = BLEND(m, a, ch->DT);
+			break;
+		case OP_LD_ST_VX:
+			ch->ST = BLEND(m, a, ch->ST);
+			break;
+		case OP_ADD_I_VX:
+			ch->I = BLEND(WIDEN_MASK(m), ch->I + WIDEN(a), ch->I);
+			break;
+		case OP_LD_I_F:
+			ch->I = BLEND(WIDEN_MASK(m), FONTSET_START_ADDR + WIDEN(a) * 5,
+				ch->I);
+			break;
+		case OP_JMP:
+			next = SPLAT_WORDS(in->nnn);
+			break;
+		case OP_JMP_V0:
+			next = WIDEN(ch->V[0]) + in->nnn;
+			break;
+		case OP_SE_VX_NN:
+			next += WIDEN_MASK((LaneBytes)(a == in->nn)) & 2;
+			break;
+		case OP_SNE_VX_NN:
+			next += WIDEN_MASK((LaneBytes)(a != in->nn)) & 2;
+			break;
+		case OP_SE_VX_VY:
+			next += WIDEN_MASK((LaneBytes)(a == b)) & 2;
+			break;
+		case OP_SNE_VX_VY:
+			next += WIDEN_MASK((LaneBytes)(a != b)) & 2;
+			break;
+		case OP_SKP:
+		case OP_SKPN:
+			taken = (LaneWords)(((ch->keys >> (WIDEN(a) & 0xF)) & 1) != 0);
+			if (kind == OP_SKPN) {
+				taken = ~taken;
+			}
+			next += taken & 2;
+			break;
+		default:
+			for (int s = 0; s < LANES_PER_CHUNK; s++) {
+				if (m[s]) {
+					run_lane(ls, k * LANES_PER_CHUNK + s, in);
+				}
+			}
+			return;
+	}
+
+	ch->PC = BLEND(WIDEN_MASK(m), next, ch->PC);
+}
+
+// Run the rest of the budget of one lane through the handlers, like the
+// interpreter does
+static void drain_lane(Lockstep *ls, int lane) {
+	LaneChunk *ch = &ls->chunks[lane / LANES_PER_CHUNK];
+	int s = lane % LANES_PER_CHUNK;
+	Chip8 *c = &ls->lanes[lane];
+	uint16_t left = ch->left[s];
+
+	load_lane(ch, s, c);
+	for (; left > 0 && !is_stopped(c); left--) {
+		Instr in;
+		decd_instr(fetch_lane_instr(c, c->PC), &in);
+		uint16_t I = c->I;
+		c->PC += 2;
+		PROFILE_EXEC(c, &in);
+		if (c->dirty_pages) {
+			mark_written(ls, c, &in, I);
+		}
+	}
+	store_lane(ch, s, c);
+
+	ch->left[s] = left;
+	if (is_stopped(c)) {
+		ch->stopped[s] = 0xFF;
+		ls->running--;
+	}
+}
+
+// Number of lanes set in a mask
+HOT int count_lanes(const LaneBytes *m) {
+	uint64_t w[LANES_PER_CHUNK / 8];
+	memcpy(w, m, sizeof(w));
+
+	int count = 0;
+	for (int i = 0; i < LANES_PER_CHUNK / 8; i++) {
+		count += ((w[i] & 0x0101010101010101) * 0x0101010101010101) >> 56;
+	}
+	return count;
+}
+
+// Find the lowest PC of the lanes that still have a budget and are not
+// stopped (and set their pending masks). Returns -1 if there are none.
+HOT long find_lowest_pc(Lockstep *ls) {
+	LaneWords lowest = SPLAT_WORDS(0xFFFF);
+	int any = 0;
+	for (int k = 0; k < ls->num_chunks; k++) {
+		LaneChunk *ch = &ls->chunks[k];
+		LaneWords ready = (LaneWords)(ch->left != 0) & ~WIDEN_MASK(ch->stopped);
+		LaneWords pc = BLEND(ready, ch->PC, SPLAT_WORDS(0xFFFF));
+		lowest = BLEND((LaneWords)(pc < lowest), pc, lowest);
+
+		ls->pending[k] = (LaneBytes)__builtin_convertvector((LaneWordMask)ready,
+			LaneMask);
+		any |= any_lane(&ls->pending[k]);
+	}
+	if (!any) {
+		return -1;
+	}
+
+	uint16_t pc = 0xFFFF;
+	for (int s = 0; s < LANES_PER_CHUNK; s++) {
+		if (lowest[s] < pc) {
+			pc = lowest[s];
+		}
+	}
+	return pc;
+}
+
+// Run the pending lanes at pc for one instruction, or to the end of their
+// budget if they are too few to be worth another pass over all chunks
+HOT void run_group(Lockstep *ls, uint16_t pc) {
+	int first = -1;
+	int last = 0;
+	int count = 0;
+	for (int k = 0; k < ls->num_chunks; k++) {
+		ls->group[k] = ls->pending[k] & MATCH_PC(&ls->chunks[k], pc);
+		if (any_lane(&ls->group[k])) {
+			first = first < 0 ? k : first;
+			last = k;
+			count += count_lanes(&ls->group[k]);
+		}
+	}
+
+	if (count < ls->min_group) {
+		for (int k = first; k <= last; k++) {
+			for (int s = 0; s < LANES_PER_CHUNK; s++) {
+				if (ls->group[k][s]) {
+					drain_lane(ls, k * LANES_PER_CHUNK + s);
+				}
+			}
+		}
+		return;
+	}
+
+	int leader = first * LANES_PER_CHUNK;
+	while (!ls->group[first][leader % LANES_PER_CHUNK]) {
+		leader++;
+	}
+	uint16_t raw = fetch_lane_instr(&ls->lanes[leader], pc);
+	Instr in;
+	decd_instr(raw, &in);
+	uint8_t kind = get_op_kind(&in);
+
+	// All lanes start from the same ROM, so their code can only differ where
+	// it has been written. Lanes running other code stay pending.
+	int shared_code = !ls->written[pc & (MEM_SIZE - 1)]
+		&& !ls->written[(pc + 1) & (MEM_SIZE - 1)];
+
+	for (int k = first; k <= last; k++) {
+		LaneBytes m = ls->group[k];
+		if (!shared_code) {
+			for (int s = 0; s < LANES_PER_CHUNK; s++) {
+				int lane = k * LANES_PER_CHUNK + s;
+				if (m[s] && fetch_lane_instr(&ls->lanes[lane], pc) != raw) {
+					m[s] = 0;
+				}
+			}
+		}
+		if (!any_lane(&m)) {
+			continue;
+		}
+
+		run_chunk(ls, k, &m, kind, &in);
+		ls->chunks[k].left -= WIDEN_MASK(m) & 1;
+	}
+}
+
+// Run up to the given number of instructions on every lane. Like
+// run_engine, a lane stops early while it waits for a key press or after a
+// fault. Returns the number of instructions run over all lanes.
+//
+// Lanes run in any order within the call, each one to the end of its own
+// budget: the lanes at the lowest PC always go first, so that lanes which
+// took different paths through the code (e.g. the two sides of a skip)
+// line up again where the paths meet.
+RUN_LOCKSTEP_CLONES long run_lockstep(Lockstep *ls, long cycles) {
+	long executed = 0;
+
+	while (cycles > 0 && ls->running > 0) {
+		uint16_t slice = cycles > 0xFFFF ? 0xFFFF : cycles;
+		cycles -= slice;
+
+		int running = ls->running;
+		for (int k = 0; k < ls->num_chunks; k++) {
+			LaneChunk *ch = &ls->chunks[k];
+			ch->left = SPLAT_WORDS(slice) & ~WIDEN_MASK(ch->stopped);
+		}
+
+		long pc;
+		while ((pc = find_lowest_pc(ls)) >= 0) {
+			run_group(ls, pc);
+		}
+
+		// Lanes that stopped early kept the rest of their budget
+		executed += (long)slice * running;
+		for (int i = 0; i < ls->num_lanes; i++) {
+			executed -= ls->chunks[i / LANES_PER_CHUNK].left[i % LANES_PER_CHUNK];
+		}
+	}
+
+	return executed;
+}
+
+// A wait for a key press ends at the start of a frame if a key is held down
+void start_lockstep_frame(Lockstep *ls) {
+	for (int i = 0; i < ls->num_lanes; i++) {
+		LaneChunk *ch = &ls->chunks[i / LANES_PER_CHUNK];
+		int s = i % LANES_PER_CHUNK;
+		if (!ch->stopped[s]) {
+			continue;
+		}
+
+		Chip8 *c = &ls->lanes[i];
+		if (c->start_wait && c->keys) {
+			c->end_wait = 1;
+		}
+		if (!is_stopped(c)) {
+			ch->stopped[s] = 0;
+			ls->running++;
+		}
+	}
+}
+
+void tick_lockstep_timers(Lockstep *ls) {
+	for (int k = 0; k < ls->num_chunks; k++) {
+		LaneChunk *ch = &ls->chunks[k];
+
+		// Adding the all-ones mask of the non-zero timers decrements them
+		ch->DT += (LaneBytes)(ch->DT != 0);
+		ch->ST += (LaneBytes)(ch->ST != 0);
+	}
+}
+
+void set_lane_keys(Lockstep *ls, int lane, uint16_t keys) {
+	ls->chunks[lane / LANES_PER_CHUNK].keys[lane % LANES_PER_CHUNK] = keys;
+	ls->lanes[lane].keys = keys;
+}
+
+// Copy the registers of a lane into its machine and return it, e.g. to
+// inspect or hash the state of the lane
+Chip8 *sync_lane(Lockstep *ls, int lane) {
+	Chip8 *c = &ls->lanes[lane];
+	load_lane(&ls->chunks[lane / LANES_PER_CHUNK], lane % LANES_PER_CHUNK, c);
+	return c;
+}
@@ -0,0 +1,88 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Lockstep execution of many machines running the same ROM (e.g. the
+// environments of a reinforcement learning run). The registers of the
+// machines (lanes) are kept as a structure of arrays, LANES_PER_CHUNK lanes
+// per chunk, so that lanes at the same PC execute an instruction together
+// with vector operations. Instructions that touch memory, the display or the
+// stack run lane by lane through the regular handlers.
+//
+// The vector types use the GCC/Clang vector extensions and compile to
+// whatever the target offers (SSE2 on plain x86-64, AVX2 with -mavx2 and so
+// on).
+
+// The bytes of a chunk fill an SSE register and its words an AVX2 register
+// (or two SSE registers). With AVX-512, chunks are twice as wide.
+#if defined(__AVX512BW__)
+#define LANES_PER_CHUNK 32
+#else
+#define LANES_PER_CHUNK 16
+#endif
+
+typedef uint8_t LaneBytes __attribute__((vector_size(LANES_PER_CHUNK)));
+typedef uint16_t LaneWords __attribute__((vector_size(2 * LANES_PER_CHUNK)));
+
+typedef struct LaneChunk {
+	LaneBytes V[NUM_V_REGISTERS];
+	LaneBytes DT;
+	LaneBytes ST;
+	LaneWords PC;
+	LaneWords I;
+	LaneWords keys;
+
+	// Instructions left to run in the current call to run_lockstep
+	LaneWords left;
+
+	// 0xFF for lanes that cannot run: waiting for a key press, faulted, or
+	// past the last lane
+	LaneBytes stopped;
+} LaneChunk;
+
+typedef struct Lockstep {
+	int num_lanes;
+	int num_chunks;
+	LaneChunk *chunks;
+
+	// The rest of the state of each lane (memory, display, stack pointer,
+	// wait and fault), used by the handlers. Its registers are only valid
+	// while a handler runs and after sync_lane.
+	Chip8 *lanes;
+
+	// Lanes with instructions left to run (pending) and the lanes running the
+	// current instruction (group)
+	LaneBytes *pending;
+	LaneBytes *group;
+
+	// Smaller groups are run lane by lane
+	int min_group;
+
+	// Number of lanes that are not stopped
+	int running;
+
+	// Set for every address of mem that any lane may have written since the
+	// ROM was loaded. Lanes at the same PC can only be running different code
+	// if it is at one of these addresses.
+	uint8_t written[MEM_SIZE];
+
+	// State of every lane after the ROM was loaded
+	Chip8 start;
+} Lockstep;
+
+int init_lockstep(Lockstep *ls, int num_lanes);
+void close_lockstep(Lockstep *ls);
+Chip8Status load_lockstep(Lockstep *ls, const uint8_t *rom, size_t size);
+void seed_lanes(Lockstep *ls, uint64_t seed);
+void reset_lane(Lockstep *ls, int lane);
+long run_lockstep(Lockstep *ls, long cycles);
+void start_lockstep_frame(Lockstep *ls);
+void tick_lockstep_timers(Lockstep *ls);
+void set_lane_keys(Lockstep *ls, int lane, uint16_t keys);
+Chip8 *sync_lane(Lockstep *ls, int lane);
+
+#endif
@@ -1,18 +1,282 @@
 #include <stdio.h>
-#include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <SDL2/SDL.h>
 
 #include "chip8.h"
 #include "instructions.h"
+#include "engine.h"
 #include "screen.h"
 #include "sound.h"
+#include "triple_buffer.h"
+#include "rewind.h"
+#include "movie.h"
+#include "profile.h"
+
+#define FRAME_RATE 60
+#define NS_PER_SEC 1000000000L
+
+// If the emulator falls behind by more than this many frames (e.g. the window
+// was being dragged), the missed frames are dropped instead of being run
+// back to back
+#define MAX_FRAME_LAG 4
+
+// How long the render thread waits for input before checking for a new frame
+#define EVENT_WAIT_MS 1
+
+// Holding the rewind key steps back through up to the last REWIND_SECONDS of
+// frames, kept in at most REWIND_CAPACITY bytes (a minute of play usually
+// takes well under a megabyte)
+#define REWIND_KEY SDLK_BACKSPACE
+#define REWIND_SECONDS 60
+#define REWIND_CAPACITY (4 << 20)
+
+// Pressing the turbo key toggles turbo mode, which runs DEFAULT_TURBO frames
+// of the game per frame shown (or as many as the host can, see --turbo)
+#define TURBO_KEY SDLK_TAB
+#define DEFAULT_TURBO 4
+
+// State shared by the render (main) thread and the emulation thread. The
+// render thread only writes the atomics, the machine itself is owned by the
+// emulation thread.
+typedef struct Emulator {
+	Chip8 c;
+	Engine engine;
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t rom_size;
+	long rate;
+	uint64_t seed; // Of the generator of rnd, applied again on reset
+	Rewind rewind;
+
+	// Keys of every frame since the last reset, written to movie_path on
+	// exit (if not NULL)
+	Movie movie;
+	const char *movie_path;
+
+	TripleBuffer frames;
+	atomic_uint keys; // Bit k is set while CHIP-8 key k is held down
+	atomic_int reset; // Set by the render thread to reload the ROM
+	atomic_int rewinding; // Set by the render thread while rewinding
+	atomic_int turbo; // Toggled by the render thread
+	atomic_int quit; // Set by either thread to stop the emulator
+
+	// Frames run per frame shown in turbo mode, 0 to run as many as fit
+	int turbo_factor;
+} Emulator;
+
+static long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// Sleep until the monotonic clock reaches deadline (in nanoseconds). Sleeping
+// to an absolute time means that oversleeping in one frame does not push
+// every following frame back.
+static void sleep_until_ns(long deadline) {
+	struct timespec ts = {deadline / NS_PER_SEC, deadline % NS_PER_SEC};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+		// Interrupted by a signal, keep sleeping
+	}
+}
+
+/*
+
+--- CONTROLLER LAYOUT ---
+1  2  3  C
+4  5  6  D
+7  8  9  E
+A  0  B  F
+
+--- MAPPING (QWERTY) ----
+1 --> 1
+2 --> 2
+3 --> 3
+4 --> C
+Q --> 4
+W --> 5
+E --> 6
+R --> D
+A --> 7
+S --> 8
+D --> 9
+F --> E
+Z --> A
+X --> 0
+C --> B
+V --> F
+
+*/
+
+// Scancode of each CHIP-8 key
+static const SDL_Scancode KEYMAP[16] = {
+	SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+	SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+	SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+	SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V
+};
+
+// CHIP-8 key of each scancode (-1 if the scancode is not mapped), built from
+// KEYMAP so that key events are translated with a single lookup
+static int8_t SCANCODE_KEYS[SDL_NUM_SCANCODES];
+
+static void init_scancode_keys() {
+	for (int sc = 0; sc < SDL_NUM_SCANCODES; sc++) {
+		SCANCODE_KEYS[sc] = -1;
+	}
+
+	for (int k = 0; k < 16; k++) {
+		SCANCODE_KEYS[KEYMAP[k]] = k;
+	}
+}
+
+// Run one frame of the game: its share of the clock rate with the keys
+// currently held down, then a timer tick. The number of instructions in a
+// frame is rate / FRAME_RATE, the remainder is carried over in cycles_owed
+// so that the average rate is exact (and rates below 60 Hz run an
+// instruction every few frames). Returns 0 if the program faulted.
+static int run_frame(Emulator *emu, long *cycles_owed) {
+	Chip8 *c = &emu->c;
+
+	// Get the currently pressed keys
+	c->keys = atomic_load(&emu->keys);
+	if (emu->movie_path != NULL
+			&& add_movie_frame(&emu->movie, c->keys) != 0) {
+		printf("ERROR: Out of memory, recording stopped.\n");
+		emu->movie_path = NULL;
+	}
+
+	// If there is a wait period (for a key press), we can set the end wait
+	// flag to signal the end of the wait period (since we recieved a key
+	// press).
+	if (c->start_wait && c->keys) {
+		c->end_wait = 1;
+	}
+
+	// Execute this frame's instructions. The engine stops early when the
+	// "wait until key press" instruction starts a wait period, the rest of
+	// the frame is then spent idle.
+	*cycles_owed += emu->rate;
+	run_engine(&emu->engine, c, *cycles_owed / FRAME_RATE);
+	*cycles_owed %= FRAME_RATE;
+
+	if (c->fault != CHIP8_OK) {
+		printf("ERROR: %s (0x%04X at 0x%03X).\n",
+			chip8_status_message(c->fault), fetch_instr(c), c->PC);
+		return 0;
+	}
+
+	// Decrement timers once per frame (60 Hz)
+	tick_timers(c);
+	push_rewind(&emu->rewind, c);
+	return 1;
+}
+
+// Emulation thread. Instructions are run in one burst per frame and every
+// completed frame is published to the render thread, which never blocks the
+// emulation: a slow present only means that the render thread skips frames.
+// In turbo mode, several frames of the game are run per frame shown and only
+// the last is published, so the game (timers included) runs faster while
+// the display is still refreshed at FRAME_RATE.
+static int run_emulation(void *data) {
+	Emulator *emu = data;
+	Chip8 *c = &emu->c;
+	long cycles_owed = 0;
+
+	// Frame n starts at start + n / FRAME_RATE seconds
+	long start = now_ns();
+	long frame = 0;
+
+	unsigned long seq = 0;
+	while (!atomic_load(&emu->quit)) {
+		POLL_PROFILE();
+
+		// A reset starts over: the rewind buffer and the recording only
+		// cover the frames since
+		if (atomic_exchange(&emu->reset, 0)) {
+			init_sys(c);
+			load_rom(c, emu->rom, emu->rom_size);
+			seed_rng(c, emu->seed);
+			precompile_engine(&emu->engine, c);
+			cycles_owed = 0;
+			clear_rewind(&emu->rewind);
+			push_rewind(&emu->rewind, c);
+			emu->movie.num_frames = 0;
+		}
+
+		// While rewinding, every frame goes one frame back instead of running
+		// (until the oldest recorded frame is reached). The frame is also
+		// taken back from the recording and from the cycles owed, so that a
+		// replay of the recording runs the frames that were kept exactly
+		// like they ran here.
+		int rewinding = atomic_load(&emu->rewinding);
+		int turbo = !rewinding && atomic_load(&emu->turbo);
+		long next_frame = start + (frame + 1) * NS_PER_SEC / FRAME_RATE;
+		int ok = 1;
+		if (rewinding) {
+			if (step_rewind(&emu->rewind, c)) {
+				cycles_owed = (cycles_owed + FRAME_RATE - emu->rate % FRAME_RATE)
+					% FRAME_RATE;
+				if (emu->movie.num_frames > 0) {
+					emu->movie.num_frames--;
+				}
+			}
+		} else if (turbo && emu->turbo_factor == 0) {
+			// Uncapped: run frames until it is time to show the next one
+			do {
+				ok = run_frame(emu, &cycles_owed);
+			} while (ok && now_ns() < next_frame);
+		} else {
+			int frames = turbo ? emu->turbo_factor : 1;
+			for (int i = 0; ok && i < frames; i++) {
+				ok = run_frame(emu, &cycles_owed);
+			}
+		}
+		if (!ok) {
+			atomic_store(&emu->quit, 1);
+			break;
+		}
+
+		// Publish the frame. The dirty rows (of all the frames run since the
+		// last one was published) are only meaningful to a reader that saw
+		// the previous frame, which it can tell from seq. The sound is muted
+		// while rewinding and in turbo mode.
+		Frame *f = get_write_frame(&emu->frames);
+		memcpy(f->fb, c->fb, sizeof(f->fb));
+		f->dirty_rows = c->dirty_rows;
+		f->seq = ++seq;
+		f->sound = !rewinding && !turbo && c->ST > 0;
+		publish_frame(&emu->frames);
+		c->dirty_rows = 0;
+		c->update_screen = 0;
+
+		// Wait for the start of the next frame. Frames are scheduled at
+		// fixed intervals from the start, so the time spent running a frame
+		// (or oversleeping) does not accumulate as drift.
+		frame++;
+		long now = now_ns();
+		if (now - next_frame > MAX_FRAME_LAG * NS_PER_SEC / FRAME_RATE) {
+			start = now;
+			frame = 0;
+		} else if (next_frame > now) {
+			sleep_until_ns(next_frame);
+		}
+	}
+
+	return 0;
+}
 
 int main(int argc, char *argv[]) {
 	// The program requires two inputs as command line arguments:
 		// 1. The absolute or relative path to the ROM
 		// 2. The clock rate (in Hz) at which the emulator should run
+	// An optional third argument seeds the random number generator, which
+	// makes a game repeat the same random numbers for the same inputs. By
+	// default, the seed is taken from the clock. With --record PATH, the
+	// keys of every frame are recorded into a movie that the headless runner
+	// can replay (--replay). --turbo N sets the speed of turbo mode (N times
+	// the clock rate, 0 for as fast as possible) and starts in it.
 
 	// Note: the clock rate is required to be inputted by the user (as opposed
 	// to a fixed value), because the original CHIP-8 specification does not
@@ -24,102 +288,180 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	// The emulator delay (in microseconds) is used to slow down the execution 
-	// of the main loop to emulate the processor clock speed.
-	const int EMU_DELAY = 1. / atoi(argv[2]) * 1000000;
-	
-	// This is the number of cycles it should take to decrement the timers by 1.
-	const int TIMER_UPDATE_CYCLES = atoi(argv[2]) / 60;
+	// The emulator is too large for the stack
+	Emulator *emu = malloc(sizeof(Emulator));
+	if (emu == NULL) {
+		printf("ERROR: Out of memory.\n");
+		return EXIT_FAILURE;
+	}
 
-	// Initialize the emulator and load the ROM
-	Chip8 c;
-	init_sys(&c);
-	load_rom(&c, argv[1]);
+	emu->rate = atol(argv[2]);
+	if (emu->rate <= 0) {
+		printf("ERROR: Clock rate must be positive.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Initialize the emulator and load the ROM. The ROM is kept to reload it
+	// on reset.
+	Chip8Status status = read_rom_file(argv[1], emu->rom, &emu->rom_size);
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to load ROM '%s': %s.\n", argv[1],
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+	emu->seed = (uint64_t)time(NULL);
+	emu->movie_path = NULL;
+	emu->turbo_factor = DEFAULT_TURBO;
+	int turbo = 0;
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			emu->movie_path = argv[++i];
+		} else if (strcmp(argv[i], "--turbo") == 0 && i + 1 < argc) {
+			emu->turbo_factor = atoi(argv[++i]);
+			turbo = 1;
+			if (emu->turbo_factor < 0) {
+				printf("ERROR: Turbo factor must not be negative.\n");
+				return EXIT_FAILURE;
+			}
+		} else if (i == 3 && argv[i][0] != '-') {
+			emu->seed = strtoull(argv[i], NULL, 0);
+		} else {
+			printf("ERROR: Unknown option '%s'.\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+	init_movie(&emu->movie, hash_rom(emu->rom, emu->rom_size), emu->seed,
+		emu->rate);
+	init_sys(&emu->c);
+	load_rom(&emu->c, emu->rom, emu->rom_size);
+	seed_rng(&emu->c, emu->seed);
+
+	if (init_rewind(&emu->rewind, REWIND_SECONDS * FRAME_RATE,
+			REWIND_CAPACITY) != 0) {
+		printf("ERROR: Out of memory.\n");
+		return EXIT_FAILURE;
+	}
+	push_rewind(&emu->rewind, &emu->c);
+	INIT_PROFILE();
+
+	init_triple_buffer(&emu->frames);
+	atomic_init(&emu->keys, 0);
+	atomic_init(&emu->reset, 0);
+	atomic_init(&emu->rewinding, 0);
+	atomic_init(&emu->turbo, turbo);
+	atomic_init(&emu->quit, 0);
+
+	if (init_engine(&emu->engine, ENGINE_CACHE) != 0) {
+		printf("ERROR: Unable to initialize the %s engine.\n",
+			ENGINE_NAMES[ENGINE_CACHE]);
+		return EXIT_FAILURE;
+	}
+	precompile_engine(&emu->engine, &emu->c);
 
 	// Initialize display and sound system
-	SDL_Window *window = NULL;
-	SDL_Renderer *renderer = NULL;
-	init_screen(&window, &renderer);
+	Screen screen;
+	if (init_screen(&screen) != 0) {
+		return EXIT_FAILURE;
+	}
 	init_sound();
 
-	SDL_Event e;
-	SDL_Scancode sc;
-	int cycles_since_timer_update = 0;
+	SDL_Thread *emu_thread = SDL_CreateThread(run_emulation, "emulation", emu);
+	if (emu_thread == NULL) {
+		printf("ERROR: Could not start the emulation thread: %s\n",
+			SDL_GetError());
+		return EXIT_FAILURE;
+	}
 
-	// Main loop
-	printf("\nRunning emulator... (Press [ESC] to reset)\n");
-	while (c.is_running) {
-		while (SDL_PollEvent(&e) != 0) {
+	// Main loop (render thread). SDL events and rendering stay on the main
+	// thread, frames are picked up from the emulation thread as they complete.
+	printf("\nRunning emulator... (Press [ESC] to reset, [TAB] to toggle "
+		"turbo, hold [BACKSPACE] to rewind)\n");
+	init_scancode_keys();
+	unsigned keys = 0;
+	unsigned long last_seq = 0;
+	int is_running = 1;
+	while (is_running && !atomic_load(&emu->quit)) {
+		SDL_Event e;
+		int has_event = SDL_WaitEventTimeout(&e, EVENT_WAIT_MS);
+		while (has_event) {
 			if (e.type == SDL_QUIT) {
-				c.is_running = 0;
-			} else if (e.type == SDL_KEYDOWN) {
-				if (e.key.keysym.sym == SDLK_ESCAPE) {
-					init_sys(&c);
-					load_rom(&c, argv[1]);
-					update_screen(&c, &renderer);
+				is_running = 0;
+			} else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+				if (e.type == SDL_KEYDOWN
+						&& e.key.keysym.sym == SDLK_ESCAPE) {
+					atomic_store(&emu->reset, 1);
 				}
-			}
-		}
 
-		if (c.ST > 0) {
-			play_sound();
-		} else {
-			pause_sound();
-		}
+				if (e.key.keysym.sym == REWIND_KEY) {
+					atomic_store(&emu->rewinding, e.type == SDL_KEYDOWN);
+				}
+
+				if (e.type == SDL_KEYDOWN && !e.key.repeat
+						&& e.key.keysym.sym == TURBO_KEY) {
+					atomic_fetch_xor(&emu->turbo, 1);
+				}
 
-		// Get the currently pressed key
-		c.key_down = -1;
-		const uint8_t *keyboard_state = SDL_GetKeyboardState(NULL);
-		for (int sc = 0; sc < SDL_NUM_SCANCODES; sc++) {
-			if (keyboard_state[sc]) {
-				c.key_down = get_key_from_scancode(sc);
-				// If there is a wait period (for a key press), we can set the
-				// end wait flag to signal the end of the wait period (since we
-				// recieved a key press).
-				if (c.start_wait && c.key_down != -1) {
-					c.end_wait = 1;
+				// Keep track of the pressed keys and publish them to the
+				// emulation thread
+				int key = SCANCODE_KEYS[e.key.keysym.scancode];
+				if (key != -1) {
+					if (e.type == SDL_KEYDOWN) {
+						keys |= 1u << key;
+					} else {
+						keys &= ~(1u << key);
+					}
+					atomic_store(&emu->keys, keys);
 				}
-				break;
 			}
+			has_event = SDL_PollEvent(&e);
 		}
 
-		// Execute instructions as long as there is no wait period
-		// A wait period can occur if the "wait until key press" instruction
-		// is executed.
-		if (!c.start_wait || c.end_wait) {
-			uint16_t instr = fetch_instr(&c);
-			decd_and_exec_instr(&c, instr);
+		const Frame *f = consume_frame(&emu->frames);
+		if (f == NULL) {
+			continue;
 		}
 
-		usleep(EMU_DELAY);
+		if (f->sound) {
+			play_sound();
+		} else {
+			pause_sound();
+		}
 
-		// Decrement timers and update the screen 60 times per second.
-		cycles_since_timer_update++;
-		if (cycles_since_timer_update == TIMER_UPDATE_CYCLES) {
-			if (c.DT > 0) {
-				c.DT--;
-			}
+		// If frames were skipped, the dirty rows of the skipped frames are
+		// not known and all rows are compared with what is shown instead.
+		// Rows that did not change are still not expanded or uploaded.
+		uint32_t dirty_rows = f->seq == last_seq + 1 ? f->dirty_rows : ALL_ROWS;
+		last_seq = f->seq;
+		if (dirty_rows) {
+			update_screen(&screen, f->fb, dirty_rows);
+		}
+	}
 
-			if (c.ST > 0) {
-				c.ST--;
-			}
+	atomic_store(&emu->quit, 1);
+	SDL_WaitThread(emu_thread, NULL);
 
-			// The screen also has a refresh rate of 60 Hz; however, we only
-			// update the screen if the update screen flag is set (i.e. a draw
-			// instruction was executed).
-			if (c.update_screen) {
-				update_screen(&c, &renderer);
-				c.update_screen = 0;
-			}
+	printf("Frames: %ld presented (%ld partial), %ld skipped\n",
+		screen.stats.presented, screen.stats.partial, screen.stats.skipped);
 
-			cycles_since_timer_update = 0;
+	if (emu->movie_path != NULL) {
+		status = write_movie(&emu->movie, emu->movie_path);
+		if (status != CHIP8_OK) {
+			printf("ERROR: Unable to write movie '%s': %s.\n", emu->movie_path,
+				chip8_status_message(status));
+		} else {
+			printf("Recorded %ld frames to '%s'.\n", emu->movie.num_frames,
+				emu->movie_path);
 		}
 	}
 
 	// Clean up
-	close_screen(&window, &renderer);
+	close_engine(&emu->engine);
+	close_rewind(&emu->rewind);
+	close_movie(&emu->movie);
+	free(emu);
+	close_screen(&screen);
 	close_sound();
 	SDL_Quit();
 
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "movie.h"
+
+#define MOVIE_MAGIC "C8MV"
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE 29
+
+// A run length takes at most 5 bytes of 7 bits (a frame count is 32 bits)
+#define MAX_RUN_BYTES 5
+
+void init_movie(Movie *m, uint64_t rom_hash, uint64_t seed, long rate) {
+	m->rom_hash = rom_hash;
+	m->seed = seed;
+	m->rate = rate;
+	m->keys = NULL;
+	m->num_frames = 0;
+	m->capacity = 0;
+}
+
+void close_movie(Movie *m) {
+	free(m->keys);
+	m->keys = NULL;
+	m->num_frames = 0;
+	m->capacity = 0;
+}
+
+// Append a frame. Returns -1 if out of memory.
+int add_movie_frame(Movie *m, uint16_t keys) {
+	if (m->num_frames == m->capacity) {
+		long capacity = m->capacity ? m->capacity * 2 : 4096;
+		uint16_t *grown = realloc(m->keys, capacity * sizeof(uint16_t));
+		if (grown == NULL) {
+			return -1;
+		}
+		m->keys = grown;
+		m->capacity = capacity;
+	}
+
+	m->keys[m->num_frames++] = keys;
+	return 0;
+}
+
+static void put_be(uint8_t *p, uint64_t val, int size) {
+	for (int i = 0; i < size; i++) {
+		p[i] = val >> (8 * (size - 1 - i));
+	}
+}
+
+static uint64_t get_be(const uint8_t *p, int size) {
+	uint64_t val = 0;
+	for (int i = 0; i < size; i++) {
+		val = val << 8 | p[i];
+	}
+	return val;
+}
+
+Chip8Status write_movie(const Movie *m, const char *path) {
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		return CHIP8_ERR_FILE;
+	}
+
+	uint8_t header[MOVIE_HEADER_SIZE];
+	memcpy(header, MOVIE_MAGIC, 4);
+	header[4] = MOVIE_VERSION;
+	put_be(&header[5], m->rom_hash, 8);
+	put_be(&header[13], m->seed, 8);
+	put_be(&header[21], m->rate, 4);
+	put_be(&header[25], m->num_frames, 4);
+	fwrite(header, 1, sizeof(header), f);
+
+	for (long i = 0; i < m->num_frames; ) {
+		long run = 1;
+		while (i + run < m->num_frames && m->keys[i + run] == m->keys[i]) {
+			run++;
+		}
+
+		uint8_t buf[MAX_RUN_BYTES + 2];
+		int len = 0;
+		for (uint32_t r = run; ; ) {
+			buf[len] = r & 0x7F;
+			r >>= 7;
+			if (r == 0) {
+				len++;
+				break;
+			}
+			buf[len++] |= 0x80;
+		}
+		put_be(&buf[len], m->keys[i], 2);
+		fwrite(buf, 1, len + 2, f);
+		i += run;
+	}
+
+	int failed = ferror(f);
+	if (fclose(f) != 0 || failed) {
+		return CHIP8_ERR_FILE;
+	}
+	return CHIP8_OK;
+}
+
+// Read the runs of keys that follow the header. Returns CHIP8_ERR_INVALID_ARG
+// if they do not add up to the frame count.
+static Chip8Status read_runs(Movie *m, FILE *f) {
+	long frame = 0;
+	while (frame < m->num_frames) {
+		uint32_t run = 0;
+		int byte;
+		int i = 0;
+		do {
+			byte = fgetc(f);
+			if (byte == EOF || i == MAX_RUN_BYTES) {
+				return CHIP8_ERR_INVALID_ARG;
+			}
+			run |= (uint32_t)(byte & 0x7F) << (7 * i++);
+		} while (byte & 0x80);
+
+		int msb = fgetc(f);
+		int lsb = fgetc(f);
+		if (run == 0 || run > m->num_frames - frame || lsb == EOF) {
+			return CHIP8_ERR_INVALID_ARG;
+		}
+
+		for (uint32_t j = 0; j < run; j++) {
+			m->keys[frame++] = msb << 8 | lsb;
+		}
+	}
+
+	return fgetc(f) == EOF ? CHIP8_OK : CHIP8_ERR_INVALID_ARG;
+}
+
+// Read a movie written by write_movie. Returns CHIP8_ERR_FILE if the file
+// cannot be read and CHIP8_ERR_INVALID_ARG if it is not a valid movie.
+Chip8Status read_movie(Movie *m, const char *path) {
+	init_movie(m, 0, 0, 0);
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return CHIP8_ERR_FILE;
+	}
+
+	uint8_t header[MOVIE_HEADER_SIZE];
+	Chip8Status status = CHIP8_OK;
+	if (fread(header, 1, sizeof(header), f) != sizeof(header)) {
+		status = ferror(f) ? CHIP8_ERR_FILE : CHIP8_ERR_INVALID_ARG;
+	} else if (memcmp(header, MOVIE_MAGIC, 4) != 0
+			|| header[4] != MOVIE_VERSION) {
+		status = CHIP8_ERR_INVALID_ARG;
+	}
+
+	if (status == CHIP8_OK) {
+		init_movie(m, get_be(&header[5], 8), get_be(&header[13], 8),
+			get_be(&header[21], 4));
+		m->num_frames = get_be(&header[25], 4);
+		m->capacity = m->num_frames;
+		m->keys = malloc((m->num_frames ? m->num_frames : 1)
+			* sizeof(uint16_t));
+		if (m->rate <= 0) {
+			status = CHIP8_ERR_INVALID_ARG;
+		} else if (m->keys == NULL) {
+			status = CHIP8_ERR_NO_MEMORY;
+		} else {
+			status = read_runs(m, f);
+		}
+	}
+
+	if (status == CHIP8_OK && ferror(f)) {
+		status = CHIP8_ERR_FILE;
+	}
+	fclose(f);
+	if (status != CHIP8_OK) {
+		close_movie(m);
+	}
+	return status;
+}
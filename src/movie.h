@@ -0,0 +1,34 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Recordings of a play session ("movies"): the keys held down in every 60 Hz
+// frame, together with everything else a run depends on (the ROM, the seed of
+// the random number generator and the clock rate). Replaying the keys frame
+// by frame reproduces the session exactly.
+//
+// On disk, a movie is the magic "C8MV", a version byte, the ROM hash, the
+// seed, the clock rate and the frame count (MSB first), followed by the key
+// masks as runs: a LEB128 run length and the 2-byte mask held for that run.
+
+typedef struct Movie {
+	uint64_t rom_hash; // hash_rom of the ROM
+	uint64_t seed;
+	long rate;
+
+	// Keys held down in each frame (bit k is key k)
+	uint16_t *keys;
+	long num_frames;
+	long capacity;
+} Movie;
+
+void init_movie(Movie *m, uint64_t rom_hash, uint64_t seed, long rate);
+void close_movie(Movie *m);
+int add_movie_frame(Movie *m, uint16_t keys);
+Chip8Status write_movie(const Movie *m, const char *path);
+Chip8Status read_movie(Movie *m, const char *path);
+
+#endif
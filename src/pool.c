@@ -0,0 +1,132 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// The tasks not yet started by a worker are the range [next, end). The owner
+// takes tasks from the front, thieves take the back half.
+typedef struct PoolQueue {
+	pthread_mutex_t lock;
+	long next;
+	long end;
+	char padding[64]; // Keep the queues of two workers off the same cache line
+} PoolQueue;
+
+typedef struct Pool {
+	PoolQueue *queues;
+	int num_workers;
+	PoolTask task;
+	void *ctx;
+} Pool;
+
+typedef struct PoolWorker {
+	Pool *pool;
+	int id;
+} PoolWorker;
+
+static int take_task(PoolQueue *q, long *task) {
+	pthread_mutex_lock(&q->lock);
+	int found = q->next < q->end;
+	if (found) {
+		*task = q->next++;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+// Move the back half of another worker's tasks into the (empty) queue of
+// worker id. Returns 0 when every queue is empty.
+static int steal_tasks(Pool *p, int id) {
+	for (int i = 1; i < p->num_workers; i++) {
+		PoolQueue *victim = &p->queues[(id + i) % p->num_workers];
+
+		pthread_mutex_lock(&victim->lock);
+		long left = victim->end - victim->next;
+		long start = victim->end - (left + 1) / 2;
+		long end = victim->end;
+		if (left > 0) {
+			victim->end = start;
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (left > 0) {
+			PoolQueue *own = &p->queues[id];
+			pthread_mutex_lock(&own->lock);
+			own->next = start;
+			own->end = end;
+			pthread_mutex_unlock(&own->lock);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void *run_worker(void *data) {
+	PoolWorker *w = data;
+	Pool *p = w->pool;
+
+	long task;
+	do {
+		while (take_task(&p->queues[w->id], &task)) {
+			p->task(p->ctx, task, w->id);
+		}
+	} while (steal_tasks(p, w->id));
+
+	return NULL;
+}
+
+int run_pool(int num_workers, long num_tasks, PoolTask task, void *ctx) {
+	if (num_workers < 1) {
+		num_workers = 1;
+	}
+	if (num_workers > num_tasks && num_tasks > 0) {
+		num_workers = num_tasks;
+	}
+
+	Pool p = {NULL, num_workers, task, ctx};
+	p.queues = malloc(num_workers * sizeof(PoolQueue));
+	PoolWorker *workers = malloc(num_workers * sizeof(PoolWorker));
+	pthread_t *threads = malloc(num_workers * sizeof(pthread_t));
+	if (p.queues == NULL || workers == NULL || threads == NULL) {
+		free(p.queues);
+		free(workers);
+		free(threads);
+		return -1;
+	}
+
+	for (int i = 0; i < num_workers; i++) {
+		pthread_mutex_init(&p.queues[i].lock, NULL);
+		p.queues[i].next = num_tasks * i / num_workers;
+		p.queues[i].end = num_tasks * (i + 1) / num_workers;
+		workers[i] = (PoolWorker){&p, i};
+	}
+
+	// If a thread cannot be started, its tasks are stolen by the others
+	int started = 1;
+	for (; started < num_workers; started++) {
+		if (pthread_create(&threads[started], NULL, run_worker,
+				&workers[started]) != 0) {
+			break;
+		}
+	}
+
+	run_worker(&workers[0]);
+	for (int i = 1; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (int i = 0; i < num_workers; i++) {
+		pthread_mutex_destroy(&p.queues[i].lock);
+	}
+	free(p.queues);
+	free(workers);
+	free(threads);
+	return 0;
+}
+
+int get_num_cpus() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
@@ -0,0 +1,16 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Runs task(ctx, i, worker) for every i in [0, num_tasks) on num_workers
+// threads (the calling thread is worker 0). Every worker starts with an equal
+// share of the tasks and, once it runs out, steals half of the remaining
+// tasks of another worker, so uneven tasks still keep all workers busy.
+// Returns -1 if out of memory.
+typedef void (*PoolTask)(void *ctx, long task, int worker);
+
+int run_pool(int num_workers, long num_tasks, PoolTask task, void *ctx);
+
+// Number of CPUs available to the process
+int get_num_cpus();
+
+#endif
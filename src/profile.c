@@ -0,0 +1,136 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile.h"
+
+#define HISTOGRAM_WIDTH 40
+
+#define PROFILE_HANDLER(name) name,
+static const InstrHandler PROFILE_HANDLER_FNS[NUM_PROFILE_OPS] = {
+	PROFILE_HANDLERS(PROFILE_HANDLER)
+};
+#undef PROFILE_HANDLER
+
+#define PROFILE_NAME(name) #name,
+static const char *PROFILE_NAMES[NUM_PROFILE_OPS] = {
+	PROFILE_HANDLERS(PROFILE_NAME)
+};
+#undef PROFILE_NAME
+
+ProfileCounter profile_counters[NUM_PROFILE_OPS];
+uint32_t profile_countdown = PROFILE_SAMPLE_INTERVAL;
+
+// Cost of reading the clock twice, taken off every sample
+static uint64_t overhead;
+static uint32_t sample_rng = 1;
+static volatile sig_atomic_t dump_requested;
+
+// Id of a handler in the histogram, looked up once per decode
+uint8_t get_profile_op(InstrHandler exec) {
+	for (int i = 0; i < NUM_PROFILE_OPS; i++) {
+		if (PROFILE_HANDLER_FNS[i] == exec) {
+			return i;
+		}
+	}
+	return PROFILE_invalid;
+}
+
+// Time one dispatch and pick the gap to the next sample (1 to twice the
+// sample interval, from a xorshift32 generator)
+void sample_profile(Chip8 *c, const Instr *in) {
+	uint64_t start = read_profile_ticks();
+	in->exec(c, in);
+	uint64_t ticks = read_profile_ticks() - start;
+
+	ProfileCounter *counter = &profile_counters[in->op];
+	counter->ticks += ticks > overhead ? ticks - overhead : 0;
+	counter->samples++;
+
+	sample_rng ^= sample_rng << 13;
+	sample_rng ^= sample_rng >> 17;
+	sample_rng ^= sample_rng << 5;
+	profile_countdown = 1 + sample_rng % (2 * PROFILE_SAMPLE_INTERVAL - 1);
+}
+
+static void request_dump(int sig) {
+	(void)sig;
+	dump_requested = 1;
+}
+
+// Print the histogram, most executed handlers first. The cycles of a handler
+// are estimated from its samples: the average of the samples times the
+// number of executions.
+void dump_profile() {
+	int order[NUM_PROFILE_OPS];
+	uint64_t total = 0;
+	double total_ticks = 0;
+	double est[NUM_PROFILE_OPS];
+	for (int i = 0; i < NUM_PROFILE_OPS; i++) {
+		const ProfileCounter *p = &profile_counters[i];
+		order[i] = i;
+		total += p->count;
+		est[i] = p->samples ? (double)p->ticks / p->samples * p->count : 0;
+		total_ticks += est[i];
+	}
+
+	// Insertion sort by count, there are only a few dozen handlers
+	for (int i = 1; i < NUM_PROFILE_OPS; i++) {
+		int op = order[i];
+		int j = i;
+		for (; j > 0 && profile_counters[order[j - 1]].count
+				< profile_counters[op].count; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = op;
+	}
+
+	fprintf(stderr, "\n%-14s %14s %7s %10s %7s\n", "handler", "count",
+		"count%", "cycles/op", "cycles%");
+	for (int i = 0; i < NUM_PROFILE_OPS; i++) {
+		const ProfileCounter *p = &profile_counters[order[i]];
+		if (p->count == 0) {
+			break;
+		}
+
+		// Handlers too rare to have been sampled have no cycle estimate
+		double share = (double)p->count / total;
+		fprintf(stderr, "%-14s %14llu %6.2f%% ", PROFILE_NAMES[order[i]],
+			(unsigned long long)p->count, 100 * share);
+		if (p->samples) {
+			fprintf(stderr, "%10.1f %6.2f%% ", (double)p->ticks / p->samples,
+				total_ticks > 0 ? 100 * est[order[i]] / total_ticks : 0);
+		} else {
+			fprintf(stderr, "%10s %7s ", "-", "-");
+		}
+		for (int bar = 0; bar < (int)(share * HISTOGRAM_WIDTH + 0.5); bar++) {
+			fputc('#', stderr);
+		}
+		fputc('\n', stderr);
+	}
+	fprintf(stderr, "%-14s %14llu (%.0f cycles estimated)\n", "total",
+		(unsigned long long)total, total_ticks);
+}
+
+// Dump the histogram if SIGUSR1 was received since the last call. Called
+// between frames, since printing is not safe in a signal handler.
+void poll_profile() {
+	if (dump_requested) {
+		dump_requested = 0;
+		dump_profile();
+	}
+}
+
+void init_profile() {
+	overhead = UINT64_MAX;
+	for (int i = 0; i < 1000; i++) {
+		uint64_t start = read_profile_ticks();
+		uint64_t ticks = read_profile_ticks() - start;
+		if (ticks < overhead) {
+			overhead = ticks;
+		}
+	}
+
+	signal(SIGUSR1, request_dump);
+	atexit(dump_profile);
+}
@@ -0,0 +1,97 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "instructions.h"
+
+// Optional profiler of the instruction handlers, built with the CHIP8_PROFILE
+// option. Every dispatch to a handler is counted: all instructions on the
+// interp and cache engines, and the instructions that the block and lockstep
+// engines do not translate themselves (the jit calls its handlers from
+// generated code, so only its fallbacks to the interpreter are counted). The
+// host cycles of a sample of the dispatches are measured with rdtsc (a
+// nanosecond clock on hosts without it). The histogram is printed to stderr
+// at exit and when the process receives SIGUSR1.
+//
+// Without CHIP8_PROFILE, PROFILE_EXEC is a plain handler call and the other
+// macros expand to nothing, so the dispatch loops are exactly those of a
+// normal build.
+
+#ifdef CHIP8_PROFILE
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// Instruction handlers, in the order of the histogram's ids
+#define PROFILE_HANDLERS(X) \
+	X(invalid) X(cls) X(ret) X(jmp_nnn) X(call_nnn) X(se_Vx_nn) \
+	X(sne_Vx_nn) X(se_Vx_Vy) X(ld_Vx_nn) X(add_Vx_nn) X(ld_Vx_Vy) X(bor) \
+	X(band) X(bxor) X(add_Vx_Vy) X(sub) X(shr) X(subn) X(shl) X(sne_Vx_Vy) \
+	X(ld_I_nnn) X(jmp_V0_nnn) X(rnd) X(drw) X(skp) X(skpn) X(ld_Vx_DT) \
+	X(ld_Vx_k) X(ld_DT_Vx) X(ld_ST_Vx) X(add_I_Vx) X(ld_I_f) X(ld_I_b) \
+	X(ld_I_from_reg) X(ld_V_from_mem)
+
+#define PROFILE_ID(name) PROFILE_##name,
+typedef enum ProfileOp {
+	PROFILE_HANDLERS(PROFILE_ID)
+	NUM_PROFILE_OPS
+} ProfileOp;
+#undef PROFILE_ID
+
+// On average, one dispatch in PROFILE_SAMPLE_INTERVAL is timed. The gaps
+// between samples are random so that they do not line up with loops.
+#define PROFILE_SAMPLE_INTERVAL 64
+
+typedef struct ProfileCounter {
+	uint64_t count;
+	uint64_t samples;
+	uint64_t ticks; // Host cycles of the samples
+} ProfileCounter;
+
+// Counters of the whole process (not synchronized, profile one emulation
+// thread at a time)
+extern ProfileCounter profile_counters[NUM_PROFILE_OPS];
+extern uint32_t profile_countdown;
+
+uint8_t get_profile_op(InstrHandler exec);
+void init_profile();
+void dump_profile();
+void poll_profile();
+void sample_profile(Chip8 *c, const Instr *in);
+
+static inline uint64_t read_profile_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void profile_exec(Chip8 *c, const Instr *in) {
+	profile_counters[in->op].count++;
+	if (--profile_countdown == 0) {
+		sample_profile(c, in);
+	} else {
+		in->exec(c, in);
+	}
+}
+
+#define PROFILE_EXEC(c, in) profile_exec((c), (in))
+#define INIT_PROFILE() init_profile()
+#define POLL_PROFILE() poll_profile()
+
+#else
+
+#define PROFILE_EXEC(c, in) (in)->exec((c), (in))
+#define INIT_PROFILE()
+#define POLL_PROFILE()
+
+#endif
+
+#endif
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+#include "disasm.h"
+#include "instructions.h"
+
+// Names of the handlers the generated code calls
+static const char *get_handler_name(InstrHandler h) {
+	if (h == cls) return "cls";
+	if (h == ret) return "ret";
+	if (h == call_nnn) return "call_nnn";
+	if (h == drw) return "drw";
+	if (h == ld_Vx_k) return "ld_Vx_k";
+	if (h == ld_I_b) return "ld_I_b";
+	if (h == ld_I_from_reg) return "ld_I_from_reg";
+	if (h == ld_V_from_mem) return "ld_V_from_mem";
+	if (h == invalid) return "invalid";
+	return NULL;
+}
+
+// Continue at addr: a direct goto if it starts a compiled block, through
+// the dispatcher otherwise
+static void emit_goto(FILE *f, const Cfg *p, long addr) {
+	if (in_cfg_rom(p, addr) && (p->flags[addr] & CFG_LEADER)) {
+		fprintf(f, "goto B_%03lX;\n", addr);
+	} else {
+		fprintf(f, "{ c->PC = 0x%03lX; goto dispatch; }\n", addr & 0xFFFF);
+	}
+}
+
+// Emit the code of the instruction at addr. rest is the number of
+// instructions after it in its block, which were counted at the start of
+// the block and are taken back if execution stops here.
+static void emit_instr(FILE *f, const Cfg *p, uint16_t addr, int rest) {
+	Instr in;
+	decode_cfg_instr(p, addr, &in);
+	InstrHandler h = in.exec;
+	int x = in.x;
+	int y = in.y;
+
+	char text[MAX_ASM_SIZE];
+	format_instr(&in, text, sizeof(text));
+	fprintf(f, "\t// %03X: %s\n\t", addr, text);
+
+	const char *handler = get_handler_name(h);
+	if (handler != NULL) {
+		// Handlers that fault, wait or store see the PC of the next
+		// instruction, like in the interpreter
+		if (h != cls && h != drw && h != ld_V_from_mem) {
+			fprintf(f, "c->PC = 0x%03X;\n\t", addr + 2);
+		}
+		fprintf(f, "%s(c, &I_%03X);\n", handler, addr);
+		if (h == cls || h == drw || h == ld_V_from_mem) {
+			return;
+		}
+		fprintf(f, "\t");
+	}
+
+	if (h == ld_Vx_k) {
+		fprintf(f, "if (is_stopped(c)) return n - %d;\n", rest);
+	} else if (h == ld_I_b || h == ld_I_from_reg) {
+		fprintf(f, "if (c->dirty_pages & CODE_PAGES) { n -= %d; "
+			"goto modified; }\n", rest);
+	} else if (h == call_nnn) {
+		fprintf(f, "if (c->fault) return n;\n\t");
+		fprintf(f, "if (c->dirty_pages & CODE_PAGES) goto modified;\n\t");
+		emit_goto(f, p, in.nnn);
+	} else if (h == ret) {
+		fprintf(f, "if (c->fault) return n;\n\tgoto dispatch;\n");
+	} else if (h == invalid) {
+		fprintf(f, "return n;\n");
+	} else if (h == jmp_nnn) {
+		emit_goto(f, p, in.nnn);
+	} else if (h == jmp_V0_nnn) {
+		fprintf(f, "c->PC = c->V[0] + 0x%03X;\n\tgoto dispatch;\n", in.nnn);
+	} else if (get_flow(&in) == FLOW_SKIP) {
+		const char *cond;
+		char buf[64];
+		if (h == se_Vx_nn) {
+			snprintf(buf, sizeof(buf), "c->V[%d] == 0x%02X", x, in.nn);
+		} else if (h == sne_Vx_nn) {
+			snprintf(buf, sizeof(buf), "c->V[%d] != 0x%02X", x, in.nn);
+		} else if (h == se_Vx_Vy) {
+			snprintf(buf, sizeof(buf), "c->V[%d] == c->V[%d]", x, y);
+		} else if (h == sne_Vx_Vy) {
+			snprintf(buf, sizeof(buf), "c->V[%d] != c->V[%d]", x, y);
+		} else if (h == skp) {
+			snprintf(buf, sizeof(buf), "is_key_down(c, c->V[%d])", x);
+		} else {
+			snprintf(buf, sizeof(buf), "!is_key_down(c, c->V[%d])", x);
+		}
+		cond = buf;
+		fprintf(f, "if (%s) ", cond);
+		emit_goto(f, p, addr + 4);
+		fprintf(f, "\t");
+		emit_goto(f, p, addr + 2);
+	} else if (h == ld_Vx_nn) {
+		fprintf(f, "c->V[%d] = 0x%02X;\n", x, in.nn);
+	} else if (h == add_Vx_nn) {
+		fprintf(f, "c->V[%d] += 0x%02X;\n", x, in.nn);
+	} else if (h == ld_Vx_Vy) {
+		fprintf(f, "c->V[%d] = c->V[%d];\n", x, y);
+	} else if (h == bor) {
+		fprintf(f, "c->V[%d] |= c->V[%d];\n", x, y);
+	} else if (h == band) {
+		fprintf(f, "c->V[%d] &= c->V[%d];\n", x, y);
+	} else if (h == bxor) {
+		fprintf(f, "c->V[%d] ^= c->V[%d];\n", x, y);
+	} else if (h == add_Vx_Vy) {
+		fprintf(f, "{ unsigned res = c->V[%d] + c->V[%d]; c->V[%d] = res; "
+			"c->V[15] = res > 255; }\n", x, y, x);
+	} else if (h == sub) {
+		fprintf(f, "{ uint8_t flag = c->V[%d] > c->V[%d]; c->V[%d] -= c->V[%d]; "
+			"c->V[15] = flag; }\n", x, y, x, y);
+	} else if (h == subn) {
+		fprintf(f, "{ uint8_t flag = c->V[%d] > c->V[%d]; "
+			"c->V[%d] = c->V[%d] - c->V[%d]; c->V[15] = flag; }\n", y, x, x, y,
+			x);
+	} else if (h == shr) {
+		fprintf(f, "c->V[%d] >>= 1;\n", x);
+	} else if (h == shl) {
+		fprintf(f, "c->V[%d] <<= 1;\n", x);
+	} else if (h == ld_I_nnn) {
+		fprintf(f, "c->I = 0x%03X;\n", in.nnn);
+	} else if (h == rnd) {
+		fprintf(f, "c->V[%d] = next_random(c) & 0x%02X;\n", x, in.nn);
+	} else if (h == ld_Vx_DT) {
+		fprintf(f, "c->V[%d] = c->DT;\n", x);
+	} else if (h == ld_DT_Vx) {
+		fprintf(f, "c->DT = c->V[%d];\n", x);
+	} else if (h == ld_ST_Vx) {
+		fprintf(f, "c->ST = c->V[%d];\n", x);
+	} else if (h == add_I_Vx) {
+		fprintf(f, "c->I += c->V[%d];\n", x);
+	} else if (h == ld_I_f) {
+		fprintf(f, "c->I = FONTSET_START_ADDR + 5 * c->V[%d];\n", x);
+	}
+}
+
+static void emit_program(FILE *f, const Cfg *p, const char *name,
+		const char *rom_path) {
+	fprintf(f, "// Generated by recompile from %s, do not edit.\n\n", rom_path);
+	fprintf(f, "#include \"aot.h\"\n\n");
+
+	fprintf(f, "static const uint8_t ROM[%zu] = {", p->size);
+	for (size_t i = 0; i < p->size; i++) {
+		fprintf(f, "%s0x%02X,", i % 12 ? " " : "\n\t",
+			p->mem[RAM_START_ADDR + i]);
+	}
+	fprintf(f, "\n};\n\n");
+
+	// Ranges of instruction bytes and the pages they are in
+	uint16_t code_pages = 0;
+	int num_ranges = 0;
+	fprintf(f, "static const uint16_t CODE_RANGES[][2] = {\n");
+	for (long addr = RAM_START_ADDR; addr < RAM_START_ADDR + (long)p->size; ) {
+		if (!(p->flags[addr] & CFG_CODE)) {
+			addr++;
+			continue;
+		}
+		long end = addr;
+		while (end < RAM_START_ADDR + (long)p->size
+				&& is_code_byte(p, end)) {
+			code_pages |= 1 << (end >> PAGE_SHIFT);
+			end++;
+		}
+		fprintf(f, "\t{0x%03lX, 0x%03lX},\n", addr, end);
+		num_ranges++;
+		addr = end;
+	}
+	fprintf(f, "};\n\n");
+	fprintf(f, "#define CODE_PAGES 0x%04X\n\n", code_pages);
+
+	fprintf(f, "extern const AotProgram aot_%s;\n\n", name);
+
+	// Operands of the instructions executed by their handlers
+	for (long addr = RAM_START_ADDR; addr < RAM_START_ADDR + (long)p->size;
+			addr++) {
+		Instr in;
+		if (!(p->flags[addr] & CFG_CODE)) {
+			continue;
+		}
+		decode_cfg_instr(p, addr, &in);
+		const char *handler = get_handler_name(in.exec);
+		if (handler != NULL) {
+			fprintf(f, "static const Instr I_%03lX = {.exec = %s, .raw = 0x%04X, "
+				".nnn = 0x%03X, .x = %d, .y = %d, .n = %d, .nn = 0x%02X};\n",
+				addr, handler, in.raw, in.nnn, in.x, in.y, in.n, in.nn);
+		}
+	}
+
+	fprintf(f, "\nstatic long run(Chip8 *c, long cycles) {\n");
+	fprintf(f, "\tlong n = 0;\n");
+	fprintf(f, "\tif (is_stopped(c)) {\n\t\treturn 0;\n\t}\n");
+	fprintf(f, "\tif (c->dirty_pages & CODE_PAGES) {\n\t\tgoto modified;\n"
+		"\t}\n\n");
+
+	// Blocks are entered by the PC, anything else is interpreted one
+	// instruction at a time until it reaches a block
+	fprintf(f, "dispatch:\n\tswitch (c->PC) {\n");
+	for (long addr = RAM_START_ADDR; addr < RAM_START_ADDR + (long)p->size;
+			addr++) {
+		if (p->flags[addr] & CFG_LEADER) {
+			fprintf(f, "\t\tcase 0x%03lX: goto B_%03lX;\n", addr, addr);
+		}
+	}
+	fprintf(f, "\t}\n");
+	fprintf(f, "\tif (n == cycles) {\n\t\treturn n;\n\t}\n");
+	fprintf(f, "\tdecd_and_exec_instr(c, fetch_instr(c));\n\tn++;\n");
+	fprintf(f, "\tif (is_stopped(c)) {\n\t\treturn n;\n\t}\n");
+	fprintf(f, "\tif (c->dirty_pages & CODE_PAGES) {\n\t\tgoto modified;\n"
+		"\t}\n\tgoto dispatch;\n\n");
+
+	// A store hit a page with compiled code. The compiled code is used as
+	// long as the instructions it was compiled from are unchanged.
+	fprintf(f, "modified:\n");
+	fprintf(f, "\tif (!aot_code_intact(c, &aot_%s)) {\n", name);
+	fprintf(f, "\t\treturn n + aot_interpret(c, cycles - n);\n\t}\n");
+	fprintf(f, "\tc->dirty_pages &= ~CODE_PAGES;\n\tgoto dispatch;\n");
+
+	// A block counts all of its instructions up front. If they do not fit
+	// in what is left of the budget, the rest is interpreted.
+	for (long addr = RAM_START_ADDR; addr < RAM_START_ADDR + (long)p->size;
+			addr++) {
+		if (!(p->flags[addr] & CFG_LEADER)) {
+			continue;
+		}
+
+		int len = get_block_length(p, addr);
+		fprintf(f, "\nB_%03lX:\n", addr);
+		fprintf(f, "\tif (cycles - n < %d) {\n\t\tc->PC = 0x%03lX;\n"
+			"\t\treturn n + aot_interpret(c, cycles - n);\n\t}\n", len, addr);
+		fprintf(f, "\tn += %d;\n", len);
+
+		uint16_t last = addr + 2 * (len - 1);
+		for (int i = 0; i < len; i++) {
+			emit_instr(f, p, addr + 2 * i, len - 1 - i);
+		}
+
+		Instr in;
+		decode_cfg_instr(p, last, &in);
+		if (get_flow(&in) == FLOW_NEXT) {
+			fprintf(f, "\t");
+			emit_goto(f, p, last + 2);
+		}
+	}
+	fprintf(f, "}\n\n");
+
+	fprintf(f, "const AotProgram aot_%s = {\n", name);
+	fprintf(f, "\t.name = \"%s\",\n", name);
+	fprintf(f, "\t.rom_hash = 0x%016llXull,\n",
+		(unsigned long long)hash_rom(&p->mem[RAM_START_ADDR], p->size));
+	fprintf(f, "\t.rom_size = %zu,\n", p->size);
+	fprintf(f, "\t.rom = ROM,\n");
+	fprintf(f, "\t.code_ranges = CODE_RANGES,\n");
+	fprintf(f, "\t.num_code_ranges = %d,\n", num_ranges);
+	fprintf(f, "\t.run = run\n};\n");
+}
+
+int main(int argc, char *argv[]) {
+	// Recompile a ROM ahead of time into a C translation unit that defines
+	// the AotProgram aot_NAME (see aot.h):
+	//     recompile {PATH_TO_ROM} {OUTPUT.c} {NAME}
+	// Every instruction reachable from 0x200 is translated, one labeled
+	// block per basic block, with direct gotos between blocks. Returns and
+	// indirect jumps go through a switch on the PC.
+
+	if (argc != 4) {
+		printf("Usage: %s {PATH_TO_ROM} {OUTPUT.c} {NAME}\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t rom[MAX_ROM_SIZE];
+	size_t size;
+	Chip8Status status = read_rom_file(argv[1], rom, &size);
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to load ROM '%s': %s.\n", argv[1],
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+	static Cfg p;
+	build_cfg(&p, rom, size);
+
+	FILE *f = fopen(argv[2], "w");
+	if (f == NULL) {
+		printf("ERROR: Unable to open '%s' for writing.\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	emit_program(f, &p, argv[3], argv[1]);
+	if (ferror(f) | fclose(f)) {
+		printf("ERROR: Unable to write '%s'.\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
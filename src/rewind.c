@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+
+// A record is a list of spans, each a 2-byte count of bytes to skip, a 2-byte
+// length and that many bytes to XOR into the state. Runs of zeros shorter
+// than a span header are kept inside the span.
+#define SPAN_HEADER_SIZE 4
+#define MAX_RECORD_SIZE (2 * REWIND_STATE_SIZE)
+
+// XORing a keyframe into this gives the state it holds
+static const uint8_t ZERO_STATE[REWIND_STATE_SIZE];
+
+// Allocate a buffer for up to max_frames frames in capacity bytes. Returns -1
+// if out of memory or if capacity cannot hold a record.
+int init_rewind(Rewind *r, int max_frames, size_t capacity) {
+	if (max_frames <= 0 || capacity < MAX_RECORD_SIZE) {
+		return -1;
+	}
+
+	r->buf = malloc(capacity);
+	r->records = malloc(max_frames * sizeof(RewindRecord));
+	r->scratch = malloc(MAX_RECORD_SIZE);
+	if (r->buf == NULL || r->records == NULL || r->scratch == NULL) {
+		close_rewind(r);
+		return -1;
+	}
+
+	r->capacity = capacity;
+	r->max_records = max_frames;
+	clear_rewind(r);
+	return 0;
+}
+
+void close_rewind(Rewind *r) {
+	free(r->buf);
+	free(r->records);
+	free(r->scratch);
+	r->buf = NULL;
+	r->records = NULL;
+	r->scratch = NULL;
+}
+
+// Forget every frame. The next push only sets the starting state.
+void clear_rewind(Rewind *r) {
+	r->head = 0;
+	r->first = 0;
+	r->count = 0;
+	r->since_keyframe = 0;
+	r->has_state = 0;
+}
+
+static void put_u16(uint8_t *p, size_t val) {
+	p[0] = val & 0xFF;
+	p[1] = val >> 8;
+}
+
+static size_t get_u16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+// Encode a XOR b as spans into out
+static size_t encode_xor(const uint8_t *a, const uint8_t *b, uint8_t *out) {
+	size_t size = 0;
+	size_t last = 0; // End of the previous span
+	size_t i = 0;
+	while (i < REWIND_STATE_SIZE) {
+		if (a[i] == b[i]) {
+			i++;
+			continue;
+		}
+
+		// Extend the span until a run of zeros long enough to be worth a
+		// new span
+		size_t start = i;
+		size_t end = i + 1;
+		for (i = end; i < REWIND_STATE_SIZE && i - end <= SPAN_HEADER_SIZE;
+				i++) {
+			if (a[i] != b[i]) {
+				end = i + 1;
+			}
+		}
+		i = end;
+
+		put_u16(&out[size], start - last);
+		put_u16(&out[size + 2], end - start);
+		size += SPAN_HEADER_SIZE;
+		for (size_t j = start; j < end; j++) {
+			out[size++] = a[j] ^ b[j];
+		}
+		last = end;
+	}
+
+	// An unchanged state is one empty span, so that every record takes up
+	// room in buf and the order of the records is the order of their offsets
+	if (size == 0) {
+		put_u16(&out[0], 0);
+		put_u16(&out[2], 0);
+		size = SPAN_HEADER_SIZE;
+	}
+	return size;
+}
+
+static void apply_xor(uint8_t *state, const uint8_t *rec, size_t size) {
+	size_t pos = 0;
+	for (size_t i = 0; i < size; ) {
+		pos += get_u16(&rec[i]);
+		size_t len = get_u16(&rec[i + 2]);
+		i += SPAN_HEADER_SIZE;
+		for (size_t j = 0; j < len; j++) {
+			state[pos++] ^= rec[i++];
+		}
+	}
+}
+
+static RewindRecord *get_record(Rewind *r, int n) {
+	return &r->records[(r->first + n) % r->max_records];
+}
+
+static void drop_oldest(Rewind *r) {
+	r->first = (r->first + 1) % r->max_records;
+	r->count--;
+}
+
+static int overlaps(const RewindRecord *rec, size_t offset, size_t size) {
+	return rec->offset < offset + size && offset < rec->offset + rec->size;
+}
+
+// Append the record in scratch, dropping the oldest records until it fits.
+// Records are laid out in order around buf, so the ones in the way of a new
+// record are always the oldest.
+static void add_record(Rewind *r, size_t size, int is_keyframe) {
+	size_t offset = r->head;
+	if (offset + size > r->capacity) {
+		while (r->count > 0 && get_record(r, 0)->offset >= offset) {
+			drop_oldest(r);
+		}
+		offset = 0;
+	}
+
+	while (r->count > 0 && (r->count == r->max_records
+			|| overlaps(get_record(r, 0), offset, size))) {
+		drop_oldest(r);
+	}
+
+	memcpy(&r->buf[offset], r->scratch, size);
+	r->count++;
+	*get_record(r, r->count - 1) = (RewindRecord){offset, size, is_keyframe};
+	r->head = offset + size;
+}
+
+// Record the state of the machine after a frame
+void push_rewind(Rewind *r, const Chip8 *c) {
+	const uint8_t *state = (const uint8_t *)c;
+	if (r->has_state) {
+		int is_keyframe = ++r->since_keyframe >= KEYFRAME_INTERVAL;
+		size_t size;
+		if (is_keyframe) {
+			size = encode_xor(r->state, ZERO_STATE, r->scratch);
+			r->since_keyframe = 0;
+		} else {
+			size = encode_xor(state, r->state, r->scratch);
+		}
+		add_record(r, size, is_keyframe);
+	}
+
+	memcpy(r->state, state, REWIND_STATE_SIZE);
+	r->has_state = 1;
+}
+
+// Put the machine back into the state of the frame before the newest one and
+// drop the newest. Returns 0 if there is no earlier frame.
+int step_rewind(Rewind *r, Chip8 *c) {
+	if (r->count == 0) {
+		return 0;
+	}
+
+	RewindRecord *rec = get_record(r, r->count - 1);
+	if (rec->is_keyframe) {
+		memset(r->state, 0, REWIND_STATE_SIZE);
+	}
+	apply_xor(r->state, &r->buf[rec->offset], rec->size);
+	r->head = rec->offset;
+	r->count--;
+
+	memcpy(c, r->state, SNAPSHOT_REGS_SIZE);
+	for (int i = 0; i < NUM_PAGES; i++) {
+		set_page(c, i, &r->state[SNAPSHOT_REGS_SIZE + (i << PAGE_SHIFT)]);
+	}
+	c->dirty_rows = ALL_ROWS;
+	return 1;
+}
@@ -0,0 +1,57 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+#include "snapshot.h"
+
+// Rewind buffer: the state after each of the last frames, kept in a ring of
+// records that each take the machine one frame back. Most records are the
+// XOR of a state with the one before it, which is almost all zeros and is
+// stored run-length encoded. Every KEYFRAME_INTERVAL frames a record holds
+// the whole earlier state instead, so that stepping back does not depend on
+// a long chain of deltas. Stepping back only decodes the newest record, so it
+// costs about as much as running a frame.
+
+// The state of the machine as one block: everything in Chip8 up to the end
+// of mem
+#define REWIND_STATE_SIZE (SNAPSHOT_REGS_SIZE + MEM_SIZE)
+
+#define KEYFRAME_INTERVAL 60
+
+typedef struct RewindRecord {
+	size_t offset; // Into Rewind.buf
+	size_t size;
+	int is_keyframe;
+} RewindRecord;
+
+typedef struct Rewind {
+	// Encoded records. The oldest records are dropped to make room for new
+	// ones, the buffer never grows.
+	uint8_t *buf;
+	size_t capacity;
+	size_t head; // Where the next record goes
+
+	// Ring of max_records records, count of them from first (the oldest)
+	RewindRecord *records;
+	int max_records;
+	int first;
+	int count;
+	int since_keyframe;
+
+	// The state after the newest record (valid once has_state is set) and
+	// room to encode the next record
+	int has_state;
+	uint8_t state[REWIND_STATE_SIZE];
+	uint8_t *scratch;
+} Rewind;
+
+int init_rewind(Rewind *r, int max_frames, size_t capacity);
+void close_rewind(Rewind *r);
+void clear_rewind(Rewind *r);
+void push_rewind(Rewind *r, const Chip8 *c);
+int step_rewind(Rewind *r, Chip8 *c);
+
+#endif
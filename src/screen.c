@@ -1,66 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+
 #include "screen.h"
 
 #define WINDOW_WIDTH 64
 #define WINDOW_HEIGHT 32
 #define WINDOW_SCALE 10
 
-#define ON_R 50
-#define ON_G 160
-#define ON_B 130
+#define ON_COLOR 0xFF32A082 // ARGB (50, 160, 130)
+#define OFF_COLOR 0xFF282828 // ARGB (40, 40, 40)
 
-#define OFF_R 40
-#define OFF_G 40
-#define OFF_B 40
+// PIXEL_LUT[b] holds the 8 pixels of the byte b, MSB (leftmost pixel) first.
+// Expanding a row is then 8 table lookups of 32 bytes each instead of 64
+// separate bit tests.
+static uint32_t PIXEL_LUT[256][8];
 
-void init_screen(SDL_Window **window, SDL_Renderer **renderer) {
-	SDL_Init(SDL_INIT_VIDEO);
+static void init_pixel_lut() {
+	for (int b = 0; b < 256; b++) {
+		for (int j = 0; j < 8; j++) {
+			PIXEL_LUT[b][j] = b & (0x80 >> j) ? ON_COLOR : OFF_COLOR;
+		}
+	}
+}
 
-	SDL_CreateWindowAndRenderer(WINDOW_WIDTH * WINDOW_SCALE,
-		WINDOW_HEIGHT * WINDOW_SCALE, 0, window, renderer);
-	SDL_RenderSetScale(*renderer, WINDOW_SCALE, WINDOW_SCALE);
-	SDL_SetWindowTitle(*window, "CHIP-8");
+int init_screen(Screen *s) {
+	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+		printf("ERROR: Could not initialize SDL video: %s\n", SDL_GetError());
+		return -1;
+	}
 
-	SDL_SetRenderDrawColor(*renderer, OFF_R, OFF_G, OFF_B, 255);
-	SDL_RenderClear(*renderer);
+	if (SDL_CreateWindowAndRenderer(WINDOW_WIDTH * WINDOW_SCALE,
+		WINDOW_HEIGHT * WINDOW_SCALE, 0, &s->window, &s->renderer) != 0) {
+		printf("ERROR: Could not create window: %s\n", SDL_GetError());
+		return -1;
+	}
+	SDL_SetWindowTitle(s->window, "CHIP-8");
+
+	// The texture has the size of the CHIP-8 display, it is scaled up to the
+	// window when it is copied to the renderer
+	s->texture = SDL_CreateTexture(s->renderer, SDL_PIXELFORMAT_ARGB8888,
+		SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+	if (s->texture == NULL) {
+		printf("ERROR: Could not create texture: %s\n", SDL_GetError());
+		return -1;
+	}
+
+	init_pixel_lut();
+
+	// Present a blank screen. shown is set to the inverse of the blank frame
+	// buffer so that every row is seen as changed.
+	uint64_t blank[SCREEN_HEIGHT] = {0};
+	for (int row = 0; row < SCREEN_HEIGHT; row++) {
+		s->shown[row] = ~blank[row];
+	}
+	update_screen(s, blank, ALL_ROWS);
+	s->stats = (ScreenStats){0};
+	return 0;
 }
 
-// Updates the SDL window/renderer based on the contents of the frame buffer.
-// This is done by computing the relative x and y coordinates of each byte
-// in the buffer, and then computing the exact x coordinate for each bit/pixel
-// in that byte. For example, FRAME_BUFFER_START_ADDR should contain pixels
-// in the range (0, 0) to (7, 0), and FRAME_BUFFER_END_ADDR should contain
-// pixels in the range (56, 31) to (63, 31).
-void update_screen(Chip8 *c, SDL_Renderer **renderer) {
-	for (int i = FRAME_BUFFER_START_ADDR; i <= FRAME_BUFFER_END_ADDR; i++) {
-		int index = i - FRAME_BUFFER_START_ADDR;
-		int row = index / 8; // Get the row (y) of the current byte
-		int col = index % 8; // Get the col (x) of the current byte
-
-		// For each bit in the current byte, paint the corresponding pixel
-		// if is set, else white
-		uint8_t byte = c->mem[i];
-		for (int j = 0; j < 8; j++) {
-			// We can iterate through each bit in the byte by isolating the 
-			// most significant bit. Then, to get the next bit, we can left 
-			// shift the byte and repeat.
-			int pixel = (byte & 0x80) >> 7;
-			byte <<= 1;
-
-			if (pixel) {
-				SDL_SetRenderDrawColor(*renderer, ON_R, ON_G, ON_B, 255);
-			} else {
-				SDL_SetRenderDrawColor(*renderer, OFF_R, OFF_G, OFF_B, 255);
-			}
-
-			// The exact column of the bit/pixel can be computed as follows
-			int pixel_col = col * 8 + j;
-			SDL_RenderDrawPoint(*renderer, pixel_col, row);
+// Expand one row of the frame buffer into pixels. The most significant bit of
+// the row is the leftmost pixel, so its bytes are expanded from the top down.
+static void expand_row(uint32_t *p, uint64_t bits) {
+	for (int shift = 56; shift >= 0; shift -= 8) {
+		memcpy(p, PIXEL_LUT[(bits >> shift) & 0xFF], sizeof(PIXEL_LUT[0]));
+		p += 8;
+	}
+}
+
+// Updates the SDL window based on the contents of the frame buffer. Only the
+// rows in dirty_rows are looked at, and of those only the ones that differ
+// from what is shown are expanded. The changed rows are uploaded as a single
+// band (from the first to the last changed row). If nothing changed, e.g. a
+// sprite was erased and drawn again at the same place, nothing is presented.
+void update_screen(Screen *s, const uint64_t *fb, uint32_t dirty_rows) {
+	int first = SCREEN_HEIGHT;
+	int last = -1;
+
+	for (int row = 0; row < SCREEN_HEIGHT; row++) {
+		if (!(dirty_rows & (1u << row)) || fb[row] == s->shown[row]) {
+			continue;
+		}
+
+		expand_row(&s->pixels[row * SCREEN_WIDTH], fb[row]);
+		s->shown[row] = fb[row];
+		if (row < first) {
+			first = row;
 		}
+		last = row;
+	}
+
+	if (last < 0) {
+		s->stats.skipped++;
+		return;
+	}
+
+	SDL_Rect band = {0, first, SCREEN_WIDTH, last - first + 1};
+	SDL_UpdateTexture(s->texture, &band, &s->pixels[first * SCREEN_WIDTH],
+		SCREEN_WIDTH * sizeof(uint32_t));
+	SDL_RenderCopy(s->renderer, s->texture, NULL, NULL);
+	SDL_RenderPresent(s->renderer);
+
+	s->stats.presented++;
+	if (band.h < SCREEN_HEIGHT) {
+		s->stats.partial++;
 	}
-	SDL_RenderPresent(*renderer);
 }
 
-void close_screen(SDL_Window **window, SDL_Renderer **renderer) {
-	SDL_DestroyRenderer(*renderer);
-	SDL_DestroyWindow(*window);
-}
\ No newline at end of file
+void close_screen(Screen *s) {
+	SDL_DestroyTexture(s->texture);
+	SDL_DestroyRenderer(s->renderer);
+	SDL_DestroyWindow(s->window);
+}
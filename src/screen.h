@@ -1,7 +1,34 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
 #include <SDL2/SDL.h>
 
 #include "chip8.h"
 
-void init_screen(SDL_Window **window, SDL_Renderer **renderer);
-void update_screen(Chip8 *c, SDL_Renderer **renderer);
-void close_screen(SDL_Window **window, SDL_Renderer **renderer);
\ No newline at end of file
+// Number of refreshes that were presented, that only uploaded some of the
+// rows (partial) and that were not presented at all because no pixel changed
+// (skipped)
+typedef struct ScreenStats {
+	long presented;
+	long partial;
+	long skipped;
+} ScreenStats;
+
+// The frame buffer is expanded into pixels (one 32-bit ARGB value per
+// pixel) on the CPU and uploaded to a streaming texture. The rows that are
+// currently shown are kept so that only rows that actually changed are
+// expanded and uploaded again.
+typedef struct Screen {
+	SDL_Window *window;
+	SDL_Renderer *renderer;
+	SDL_Texture *texture;
+	uint32_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+	uint64_t shown[SCREEN_HEIGHT];
+	ScreenStats stats;
+} Screen;
+
+int init_screen(Screen *s);
+void update_screen(Screen *s, const uint64_t *fb, uint32_t dirty_rows);
+void close_screen(Screen *s);
+
+#endif
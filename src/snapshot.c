@@ -0,0 +1,298 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+#define PACKED_MAGIC "C8ST"
+#define PACKED_VERSION 2
+
+// Run-length encoding: a control byte n below 128 is followed by n + 1
+// literal bytes, from 128 on by one byte repeated n - 125 times
+#define MAX_LITERALS 128
+#define MIN_RUN 3
+#define MAX_RUN 130
+
+struct SnapPage {
+	atomic_int refs;
+	uint8_t data[PAGE_SIZE];
+};
+
+// Snapshots may be saved on several threads at once
+static atomic_uint_fast64_t next_id = 1;
+
+static SnapPage *new_page(const uint8_t *data) {
+	SnapPage *p = malloc(sizeof(SnapPage));
+	if (p != NULL) {
+		atomic_init(&p->refs, 1);
+		memcpy(p->data, data, PAGE_SIZE);
+	}
+	return p;
+}
+
+static void release_page(SnapPage *p) {
+	if (p != NULL && atomic_fetch_sub(&p->refs, 1) == 1) {
+		free(p);
+	}
+}
+
+// Copy a page into mem if it differs, marking it written for the execution
+// engines and for the next snapshot
+void set_page(Chip8 *c, int page, const uint8_t *data) {
+	uint8_t *dst = &c->mem[page << PAGE_SHIFT];
+	if (memcmp(dst, data, PAGE_SIZE) != 0) {
+		memcpy(dst, data, PAGE_SIZE);
+		c->dirty_pages |= 1 << page;
+		c->snap_pages |= 1 << page;
+	}
+}
+
+void init_snapshot(Snapshot *s) {
+	s->id = 0;
+	for (int i = 0; i < NUM_PAGES; i++) {
+		s->pages[i] = NULL;
+	}
+}
+
+// Save the machine into s, replacing what s held. If the machine was last
+// saved to or restored from base, the pages it has not written since are
+// shared with base (which may be s itself). Returns -1 if out of memory, s
+// is left unchanged.
+int save_snapshot(Snapshot *s, Chip8 *c, const Snapshot *base) {
+	uint16_t copy = ALL_PAGES;
+	if (base != NULL && base->id != 0 && base->id == c->snap_base) {
+		copy = c->snap_pages;
+	}
+
+	SnapPage *pages[NUM_PAGES];
+	for (int i = 0; i < NUM_PAGES; i++) {
+		if (copy & (1 << i)) {
+			pages[i] = new_page(&c->mem[i << PAGE_SHIFT]);
+			if (pages[i] == NULL) {
+				while (i-- > 0) {
+					release_page(pages[i]);
+				}
+				return -1;
+			}
+		} else {
+			pages[i] = base->pages[i];
+			atomic_fetch_add(&pages[i]->refs, 1);
+		}
+	}
+
+	free_snapshot(s);
+	s->id = atomic_fetch_add(&next_id, 1);
+	memcpy(s->regs, c, SNAPSHOT_REGS_SIZE);
+	memcpy(s->pages, pages, sizeof(pages));
+
+	c->snap_pages = 0;
+	c->snap_base = s->id;
+	return 0;
+}
+
+// Put the machine back into the state saved in s. Only the pages written
+// since the machine was last saved to or restored from s are compared.
+void restore_snapshot(Chip8 *c, const Snapshot *s) {
+	uint16_t check = c->snap_base == s->id ? c->snap_pages : ALL_PAGES;
+	memcpy(c, s->regs, SNAPSHOT_REGS_SIZE);
+	for (int i = 0; i < NUM_PAGES; i++) {
+		if (check & (1 << i)) {
+			set_page(c, i, s->pages[i]->data);
+		}
+	}
+
+	c->dirty_rows = ALL_ROWS;
+	c->snap_pages = 0;
+	c->snap_base = s->id;
+}
+
+// Make dst another reference to the state in src, without copying any page
+void copy_snapshot(Snapshot *dst, const Snapshot *src) {
+	if (dst == src) {
+		return;
+	}
+
+	for (int i = 0; i < NUM_PAGES; i++) {
+		if (src->pages[i] != NULL) {
+			atomic_fetch_add(&src->pages[i]->refs, 1);
+		}
+	}
+
+	free_snapshot(dst);
+	memcpy(dst, src, sizeof(Snapshot));
+}
+
+// Release the pages of s and leave it empty
+void free_snapshot(Snapshot *s) {
+	for (int i = 0; i < NUM_PAGES; i++) {
+		release_page(s->pages[i]);
+	}
+	init_snapshot(s);
+}
+
+static size_t encode_runs(const uint8_t *src, size_t size, uint8_t *dst) {
+	size_t out = 0;
+	size_t i = 0;
+	while (i < size) {
+		size_t run = 1;
+		while (i + run < size && run < MAX_RUN && src[i + run] == src[i]) {
+			run++;
+		}
+
+		if (run >= MIN_RUN) {
+			dst[out++] = run + 125;
+			dst[out++] = src[i];
+			i += run;
+			continue;
+		}
+
+		// Literals up to the next run
+		size_t start = i;
+		while (i < size && i - start < MAX_LITERALS) {
+			if (i + 2 < size && src[i] == src[i + 1] && src[i] == src[i + 2]) {
+				break;
+			}
+			i++;
+		}
+		dst[out++] = i - start - 1;
+		memcpy(&dst[out], &src[start], i - start);
+		out += i - start;
+	}
+	return out;
+}
+
+// Decode exactly size bytes into dst. Returns the number of bytes of src
+// used, or 0 if src is truncated or does not decode to size bytes.
+static size_t decode_runs(const uint8_t *src, size_t src_size, uint8_t *dst,
+	size_t size) {
+	size_t in = 0;
+	size_t out = 0;
+	while (out < size) {
+		if (in >= src_size) {
+			return 0;
+		}
+
+		uint8_t n = src[in++];
+		if (n < MAX_LITERALS) {
+			size_t len = n + 1;
+			if (in + len > src_size || out + len > size) {
+				return 0;
+			}
+			memcpy(&dst[out], &src[in], len);
+			in += len;
+			out += len;
+		} else {
+			size_t len = n - 125;
+			if (in >= src_size || out + len > size) {
+				return 0;
+			}
+			memset(&dst[out], src[in++], len);
+			out += len;
+		}
+	}
+	return in;
+}
+
+// Serialize the machine state into buf, which must have room for
+// PACKED_STATE_MAX_SIZE bytes. Multi-byte values are stored MSB first, so
+// packed states can be moved between hosts. Returns the packed size.
+size_t pack_state(const Chip8 *c, uint8_t *buf) {
+	size_t n = 0;
+	memcpy(buf, PACKED_MAGIC, 4);
+	n += 4;
+	buf[n++] = PACKED_VERSION;
+	memcpy(&buf[n], c->V, NUM_V_REGISTERS);
+	n += NUM_V_REGISTERS;
+	buf[n++] = c->DT;
+	buf[n++] = c->ST;
+
+	uint16_t words[] = {c->PC, c->I, c->SP, c->keys};
+	for (int i = 0; i < 4; i++) {
+		buf[n++] = words[i] >> 8;
+		buf[n++] = words[i] & 0xFF;
+	}
+
+	buf[n++] = (c->is_running != 0) | (c->start_wait != 0) << 1
+		| (c->end_wait != 0) << 2 | (c->update_screen != 0) << 3;
+	buf[n++] = c->fault;
+	for (int shift = 56; shift >= 0; shift -= 8) {
+		buf[n++] = c->rng >> shift;
+	}
+
+	uint8_t body[PACKED_BODY_SIZE];
+	for (int row = 0; row < SCREEN_HEIGHT; row++) {
+		for (int i = 0; i < 8; i++) {
+			body[row * 8 + i] = c->fb[row] >> (56 - 8 * i);
+		}
+	}
+	memcpy(&body[8 * SCREEN_HEIGHT], c->mem, MEM_SIZE);
+
+	return n + encode_runs(body, PACKED_BODY_SIZE, &buf[n]);
+}
+
+// Load a state serialized by pack_state. The number of bytes of buf used is
+// stored in used if it is not NULL. Returns CHIP8_ERR_INVALID_ARG and leaves
+// the machine unchanged if buf does not hold a valid packed state.
+Chip8Status unpack_state(Chip8 *c, const uint8_t *buf, size_t size,
+	size_t *used) {
+	if (size < PACKED_HEADER_SIZE || memcmp(buf, PACKED_MAGIC, 4) != 0
+			|| buf[4] != PACKED_VERSION) {
+		return CHIP8_ERR_INVALID_ARG;
+	}
+
+	const uint8_t *p = &buf[5 + NUM_V_REGISTERS + 2];
+	uint16_t words[4];
+	for (int i = 0; i < 4; i++) {
+		words[i] = p[2 * i] << 8 | p[2 * i + 1];
+	}
+	uint8_t flags = p[8];
+	Chip8Status fault = p[9];
+	uint64_t rng = 0;
+	for (int i = 0; i < 8; i++) {
+		rng = rng << 8 | p[10 + i];
+	}
+	uint16_t sp = words[2];
+	if (sp < STACK_START_ADDR || sp > STACK_END_ADDR + 1
+			|| (sp - STACK_START_ADDR) % 2 != 0 || flags > 0xF || rng == 0
+			|| (fault != CHIP8_OK && (fault < CHIP8_ERR_INVALID_INSTR
+			|| fault > CHIP8_ERR_STACK_UNDERFLOW))) {
+		return CHIP8_ERR_INVALID_ARG;
+	}
+
+	uint8_t body[PACKED_BODY_SIZE];
+	size_t n = decode_runs(&buf[PACKED_HEADER_SIZE], size - PACKED_HEADER_SIZE,
+		body, PACKED_BODY_SIZE);
+	if (n == 0) {
+		return CHIP8_ERR_INVALID_ARG;
+	}
+
+	memcpy(c->V, &buf[5], NUM_V_REGISTERS);
+	c->DT = buf[5 + NUM_V_REGISTERS];
+	c->ST = buf[5 + NUM_V_REGISTERS + 1];
+	c->PC = words[0];
+	c->I = words[1];
+	c->SP = sp;
+	c->keys = words[3];
+	c->is_running = flags & 1;
+	c->start_wait = (flags >> 1) & 1;
+	c->end_wait = (flags >> 2) & 1;
+	c->update_screen = (flags >> 3) & 1;
+	c->fault = fault;
+	c->rng = rng;
+
+	for (int row = 0; row < SCREEN_HEIGHT; row++) {
+		c->fb[row] = 0;
+		for (int i = 0; i < 8; i++) {
+			c->fb[row] = c->fb[row] << 8 | body[row * 8 + i];
+		}
+	}
+	for (int i = 0; i < NUM_PAGES; i++) {
+		set_page(c, i, &body[8 * SCREEN_HEIGHT + (i << PAGE_SHIFT)]);
+	}
+	c->dirty_rows = ALL_ROWS;
+
+	if (used != NULL) {
+		*used = PACKED_HEADER_SIZE + n;
+	}
+	return CHIP8_OK;
+}
@@ -0,0 +1,44 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Snapshots of the machine state, for going back to an earlier state or
+// branching off many copies of one (e.g. a tree search over inputs). The
+// memory of a snapshot is kept in reference counted pages: saving a machine
+// that was last saved to or restored from a snapshot only copies the pages
+// written since then and shares the rest with that snapshot. Restoring only
+// copies the pages that differ.
+
+// Everything in Chip8 before mem is machine state
+#define SNAPSHOT_REGS_SIZE offsetof(Chip8, mem)
+
+// The packed format: a header with the registers and flags, followed by the
+// display rows (MSB first) and mem, compressed with run-length encoding
+#define PACKED_HEADER_SIZE 41
+#define PACKED_BODY_SIZE (8 * SCREEN_HEIGHT + MEM_SIZE)
+#define PACKED_STATE_MAX_SIZE (PACKED_HEADER_SIZE + PACKED_BODY_SIZE \
+	+ (PACKED_BODY_SIZE + 127) / 128)
+
+typedef struct SnapPage SnapPage;
+
+typedef struct Snapshot {
+	uint64_t id; // Unique for every saved snapshot, 0 while empty
+	uint8_t regs[SNAPSHOT_REGS_SIZE];
+	SnapPage *pages[NUM_PAGES];
+} Snapshot;
+
+void set_page(Chip8 *c, int page, const uint8_t *data);
+void init_snapshot(Snapshot *s);
+int save_snapshot(Snapshot *s, Chip8 *c, const Snapshot *base);
+void restore_snapshot(Chip8 *c, const Snapshot *s);
+void copy_snapshot(Snapshot *dst, const Snapshot *src);
+void free_snapshot(Snapshot *s);
+size_t pack_state(const Chip8 *c, uint8_t *buf);
+Chip8Status unpack_state(Chip8 *c, const uint8_t *buf, size_t size,
+	size_t *used);
+
+#endif
@@ -0,0 +1,38 @@
+#include <string.h>
+
+#include "triple_buffer.h"
+
+void init_triple_buffer(TripleBuffer *tb) {
+	memset(tb->frames, 0, sizeof(tb->frames));
+	tb->write_index = 0;
+	tb->read_index = 1;
+	atomic_init(&tb->middle, 2);
+}
+
+// Returns the frame owned by the writer, to be filled before publish_frame
+Frame *get_write_frame(TripleBuffer *tb) {
+	return &tb->frames[tb->write_index];
+}
+
+// Swap the filled frame into the middle and take back the old middle frame.
+// The release half of the exchange makes the frame contents visible to the
+// reader before it can see the index.
+void publish_frame(TripleBuffer *tb) {
+	int old = atomic_exchange_explicit(&tb->middle,
+		tb->write_index | FRAME_FRESH, memory_order_acq_rel);
+	tb->write_index = old & ~FRAME_FRESH;
+}
+
+// Returns the latest published frame, or NULL if nothing was published since
+// the last call. The frame stays valid until the next call.
+const Frame *consume_frame(TripleBuffer *tb) {
+	if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed)
+		& FRAME_FRESH)) {
+		return NULL;
+	}
+
+	int old = atomic_exchange_explicit(&tb->middle, tb->read_index,
+		memory_order_acq_rel);
+	tb->read_index = old & ~FRAME_FRESH;
+	return &tb->frames[tb->read_index];
+}
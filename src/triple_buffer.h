@@ -0,0 +1,42 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Bit set in TripleBuffer.middle when the middle frame has been published but
+// not consumed yet
+#define FRAME_FRESH 4
+
+typedef struct Frame Frame;
+typedef struct TripleBuffer TripleBuffer;
+
+// A completed frame as seen by the render thread
+struct Frame {
+	uint64_t fb[SCREEN_HEIGHT];
+	uint32_t dirty_rows; // Rows changed since the previous frame (seq - 1)
+	unsigned long seq;
+	int sound;
+};
+
+// Lock-free triple buffer for a single writer (the emulation thread) and a
+// single reader (the render thread). Each side owns one of the three frames,
+// the third one is swapped in and out of the middle with an atomic exchange.
+// Neither side ever waits for the other: the writer always has a frame to
+// fill and the reader always gets the latest published frame, frames that the
+// reader was too slow to see are overwritten.
+struct TripleBuffer {
+	Frame frames[3];
+	int write_index;
+	int read_index;
+	atomic_int middle; // Index of the middle frame | FRAME_FRESH
+};
+
+void init_triple_buffer(TripleBuffer *tb);
+Frame *get_write_frame(TripleBuffer *tb);
+void publish_frame(TripleBuffer *tb);
+const Frame *consume_frame(TripleBuffer *tb);
+
+#endif
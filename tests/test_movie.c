@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "movie.h"
+
+#define HEADER_SIZE 29
+
+// Runs of the same keys whose lengths take 1 to 4 bytes in LEB128, at and
+// around the boundaries
+static const long RUNS[] = {
+	1, 2, 127, 128, 129, 300, 16383, 16384, 16385, 2097151, 2097152, 1
+};
+#define NUM_RUNS (sizeof(RUNS) / sizeof(RUNS[0]))
+
+static int leb128_size(long val) {
+	int size = 1;
+	while (val >>= 7) {
+		size++;
+	}
+	return size;
+}
+
+static long file_size(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+// Rewrite the file without its last byte
+static int truncate_file(const char *path) {
+	long size = file_size(path);
+	uint8_t *buf = malloc(size);
+	FILE *f = fopen(path, "rb");
+	int ok = buf != NULL && f != NULL && fread(buf, 1, size, f) == (size_t)size;
+	if (f != NULL) {
+		fclose(f);
+	}
+	f = ok ? fopen(path, "wb") : NULL;
+	ok = f != NULL && fwrite(buf, 1, size - 1, f) == (size_t)size - 1;
+	if (f != NULL) {
+		ok = fclose(f) == 0 && ok;
+	}
+	free(buf);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	// Writes a movie to the path given as argument and reads it back: the
+	// frames must survive the run-length encoding, each run must take its
+	// LEB128 length and the 2-byte mask, and a truncated movie must be
+	// rejected
+
+	if (argc != 2) {
+		printf("Usage: %s {PATH_TO_MOVIE}\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	Movie m;
+	init_movie(&m, 0x0123456789ABCDEFULL, 0xFEDCBA9876543210ULL, 700);
+	long expected_size = HEADER_SIZE;
+	for (size_t i = 0; i < NUM_RUNS; i++) {
+		// Adjacent runs hold different keys, the last key has the top bit set
+		uint16_t keys = i + 1 == NUM_RUNS ? 0x8001 : 1 << (i % 16);
+		for (long j = 0; j < RUNS[i]; j++) {
+			if (add_movie_frame(&m, keys) != 0) {
+				printf("ERROR: Out of memory.\n");
+				return EXIT_FAILURE;
+			}
+		}
+		expected_size += leb128_size(RUNS[i]) + 2;
+	}
+
+	Chip8Status status = write_movie(&m, argv[1]);
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to write movie '%s': %s.\n", argv[1],
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+	if (file_size(argv[1]) != expected_size) {
+		printf("ERROR: The movie takes %ld bytes instead of %ld.\n",
+			file_size(argv[1]), expected_size);
+		return EXIT_FAILURE;
+	}
+
+	Movie read;
+	status = read_movie(&read, argv[1]);
+	if (status != CHIP8_OK) {
+		printf("ERROR: Unable to read movie '%s': %s.\n", argv[1],
+			chip8_status_message(status));
+		return EXIT_FAILURE;
+	}
+	if (read.rom_hash != m.rom_hash || read.seed != m.seed
+			|| read.rate != m.rate || read.num_frames != m.num_frames
+			|| memcmp(read.keys, m.keys,
+				m.num_frames * sizeof(uint16_t)) != 0) {
+		printf("ERROR: The movie read back differs from the one written.\n");
+		return EXIT_FAILURE;
+	}
+	close_movie(&read);
+	close_movie(&m);
+
+	if (!truncate_file(argv[1])) {
+		printf("ERROR: Unable to truncate movie '%s'.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (read_movie(&read, argv[1]) != CHIP8_ERR_INVALID_ARG) {
+		printf("ERROR: A truncated movie was accepted.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("movie: ok\n");
+	return EXIT_SUCCESS;
+}
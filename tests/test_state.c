@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libchip8.h"
+
+#define KEY_FRAMES 30
+#define NUM_KEYS 16
+
+static const char *ENGINES[] = {"interp", "cache", "block", "jit"};
+#define NUM_TEST_ENGINES (sizeof(ENGINES) / sizeof(ENGINES[0]))
+
+// Run frames starting at frame first, with the held key changing every half
+// second so that the program gets past its key waits. Machines that run the
+// same frames from the same state end in the same state.
+static void run_frames(Chip8Emu *emu, long first, long frames) {
+	for (long f = first; f < first + frames; f++) {
+		chip8_set_keys(emu, 1 << (f / KEY_FRAMES % NUM_KEYS));
+		chip8_run_frames(emu, 1, NULL);
+	}
+}
+
+static Chip8Emu *create_emu(const char *engine, const char *rom_path) {
+	Chip8Emu *emu;
+	if (chip8_create(&emu, engine) != CHIP8_OK) {
+		return NULL;
+	}
+	if (chip8_load_rom_file(emu, rom_path) != CHIP8_OK) {
+		printf("ERROR: Unable to load ROM '%s'.\n", rom_path);
+		exit(EXIT_FAILURE);
+	}
+	return emu;
+}
+
+static int check_hash(const char *engine, const char *what, Chip8Emu *emu,
+		uint64_t expected) {
+	if (chip8_hash_state(emu) != expected) {
+		printf("ERROR: %s: %s ended in a different state.\n", engine, what);
+		return 0;
+	}
+	return 1;
+}
+
+// Save the state of a machine in every way the library offers, restore it
+// into fresh emulators, and check that all of them go on like the original
+static int test_engine(const char *engine, const char *rom_path) {
+	Chip8Emu *emu = create_emu(engine, rom_path);
+	if (emu == NULL) {
+		// The JIT is not available on every host
+		printf("%s: not supported, skipped\n", engine);
+		return 1;
+	}
+	run_frames(emu, 0, 300);
+
+	uint8_t state[CHIP8_STATE_MAX_SIZE];
+	size_t size;
+	Chip8Snapshot *snap;
+	Chip8Emu *clone;
+	if (chip8_save_state(emu, state, sizeof(state), &size) != CHIP8_OK
+			|| chip8_snapshot_save(emu, &snap) != CHIP8_OK
+			|| chip8_clone(emu, &clone) != CHIP8_OK) {
+		printf("ERROR: %s: unable to save the state.\n", engine);
+		return 0;
+	}
+	uint64_t saved = chip8_hash_state(emu);
+
+	Chip8Emu *loaded = create_emu(engine, rom_path);
+	Chip8Emu *restored = create_emu(engine, rom_path);
+	int ok = chip8_load_state(loaded, state, size) == CHIP8_OK;
+	chip8_snapshot_restore(restored, snap);
+	ok = ok && check_hash(engine, "loaded state", loaded, saved)
+		&& check_hash(engine, "restored snapshot", restored, saved)
+		&& check_hash(engine, "clone", clone, saved);
+
+	run_frames(emu, 300, 300);
+	run_frames(loaded, 300, 300);
+	run_frames(restored, 300, 300);
+	run_frames(clone, 300, 300);
+	uint64_t expected = chip8_hash_state(emu);
+	ok = ok && check_hash(engine, "loaded state", loaded, expected)
+		&& check_hash(engine, "restored snapshot", restored, expected)
+		&& check_hash(engine, "clone", clone, expected);
+
+	// A snapshot can be restored again, into the machine it was taken from
+	chip8_snapshot_restore(emu, snap);
+	ok = ok && check_hash(engine, "second restore", emu, saved);
+
+	// A truncated state is rejected and leaves the machine unchanged, and so
+	// is one that ends with an invalid number of cycles owed
+	for (size_t n = 0; ok && n < size; n++) {
+		if (chip8_load_state(loaded, state, n) != CHIP8_ERR_INVALID_ARG) {
+			printf("ERROR: %s: a state truncated to %zu of %zu bytes was "
+				"accepted.\n", engine, n, size);
+			ok = 0;
+		}
+		ok = ok && check_hash(engine, "rejected state", loaded, expected);
+	}
+	state[size - 1] = 0xFF;
+	if (ok && chip8_load_state(loaded, state, size) != CHIP8_ERR_INVALID_ARG) {
+		printf("ERROR: %s: a state with invalid cycles owed was accepted.\n",
+			engine);
+		ok = 0;
+	}
+	ok = ok && check_hash(engine, "rejected state", loaded, expected);
+
+	chip8_snapshot_free(snap);
+	chip8_destroy(emu);
+	chip8_destroy(loaded);
+	chip8_destroy(restored);
+	chip8_destroy(clone);
+	if (ok) {
+		printf("%s: ok\n", engine);
+	}
+	return ok;
+}
+
+// A wait for a key press (Fx0A) ends when a key is held at the start of a
+// chip8_run_cycles call, like at the start of a frame
+static int test_key_wait() {
+	static const uint8_t ROM[] = {
+		0xF0, 0x0A, // 200: ld V0, K
+		0x70, 0x01, // 202: add V0, 1
+		0x12, 0x02  // 204: jp 202
+	};
+
+	Chip8Emu *emu;
+	if (chip8_create(&emu, NULL) != CHIP8_OK
+			|| chip8_load_rom(emu, ROM, sizeof(ROM)) != CHIP8_OK) {
+		printf("ERROR: Unable to create an emulator.\n");
+		return 0;
+	}
+
+	long n;
+	chip8_run_cycles(emu, 10, &n);
+	int ok = n == 1 && chip8_is_waiting_for_key(emu);
+	chip8_run_cycles(emu, 10, &n);
+	ok = ok && n == 0 && chip8_is_waiting_for_key(emu);
+
+	chip8_set_keys(emu, 0x20);
+	chip8_run_cycles(emu, 10, &n);
+	ok = ok && n == 10 && !chip8_is_waiting_for_key(emu);
+	chip8_destroy(emu);
+
+	printf(ok ? "key wait: ok\n" : "ERROR: A key wait did not end in "
+		"chip8_run_cycles with a key held.\n");
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	// Checks the snapshots, clones and saved states of libchip8 on every
+	// engine with the ROM given as argument
+
+	if (argc != 2) {
+		printf("Usage: %s {PATH_TO_ROM}\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int ok = test_key_wait();
+	for (size_t i = 0; i < NUM_TEST_ENGINES; i++) {
+		ok &= test_engine(ENGINES[i], argv[1]);
+	}
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}